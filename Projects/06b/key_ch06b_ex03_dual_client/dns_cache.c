@@ -0,0 +1,304 @@
+/******************************************************************************
+* File Name:   dns_cache.c
+*
+* Description: This file contains the host name cache shared by the TCP
+* client tasks, see dns_cache.h.
+*
+*******************************************************************************/
+
+/* Header file includes. */
+#include "cyhal.h"
+
+/* FreeRTOS header file. */
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+
+/* Standard C header file. */
+#include <stdio.h>
+#include <string.h>
+
+/* Host name cache header file. */
+#include "dns_cache.h"
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* A name and what was found for it. */
+typedef struct {
+	char name[DNS_CACHE_MAX_NAME];   // empty if the entry is free
+	cy_rslt_t result;                // of the last lookup
+	cy_socket_ip_address_t address;  // if result is CY_RSLT_SUCCESS
+	TickType_t found;                // tick of the last lookup
+	TickType_t ttl;                  // ticks the lookup is good for
+	TickType_t last_used;
+	bool used;                       // asked for since the last lookup
+} dns_cache_entry_t;
+
+/*******************************************************************************
+* Global Variables
+********************************************************************************/
+static dns_cache_entry_t dns_cache[DNS_CACHE_SIZE];
+static dns_cache_stats_t dns_cache_stats;
+
+/* The entries and the counters. */
+static SemaphoreHandle_t dns_cache_lock;
+
+/* One lookup at a time, so a name missed by two tasks is looked up once,
+ * and the cache lock is not held while waiting for the network. */
+static SemaphoreHandle_t dns_lookup_lock;
+
+/*******************************************************************************
+* Function Prototypes
+********************************************************************************/
+static void dns_cache_task(void *arg);
+static dns_cache_entry_t *dns_cache_find(const char *name);
+static bool dns_cache_get(const char *name, cy_socket_ip_address_t *address, cy_rslt_t *result);
+static void dns_cache_store(const char *name, cy_rslt_t result, const cy_socket_ip_address_t *address);
+
+/*******************************************************************************
+ * Function Name: dns_cache_init
+ *******************************************************************************
+ * Summary:
+ *  Create the locks and the refresh task. Called once, before the tasks that
+ *  resolve names are started.
+ *
+ * Return:
+ *  cy_result result: Result of the operation
+ *
+ *******************************************************************************/
+cy_rslt_t dns_cache_init(void){
+
+	dns_cache_lock = xSemaphoreCreateMutex();
+	dns_lookup_lock = xSemaphoreCreateMutex();
+	if(dns_cache_lock == NULL || dns_lookup_lock == NULL){
+		printf("Failed to create the host name cache\n");
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	if(xTaskCreate(dns_cache_task, "DNS cache task", DNS_CACHE_TASK_STACK_SIZE, NULL, DNS_CACHE_TASK_PRIORITY, NULL) != pdPASS){
+		printf("Failed to create the host name cache task\n");
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	return CY_RSLT_SUCCESS;
+}
+
+/*******************************************************************************
+ * Function Name: dns_cache_resolve
+ *******************************************************************************
+ * Summary:
+ *  Address of a host name. From the cache if it has the name and its time to
+ *  live has not run out, otherwise it is looked up and kept, whether it was
+ *  found or not.
+ *
+ * Parameters:
+ *  const char *name: host name
+ *  cy_socket_ip_address_t *address: the address found
+ *
+ * Return:
+ *  cy_result result: CY_RSLT_SUCCESS, or the error of the lookup
+ *
+ *******************************************************************************/
+cy_rslt_t dns_cache_resolve(const char *name, cy_socket_ip_address_t *address){
+
+	cy_rslt_t result;
+
+	if(strlen(name) >= DNS_CACHE_MAX_NAME){
+		// too long to keep, ask every time
+		return cy_socket_gethostbyname(name, CY_SOCKET_IP_VER_V4, address);
+	}
+
+	if(dns_cache_get(name, address, &result)){
+		return result;
+	}
+
+	// One lookup at a time. Another task may have looked the name up while
+	// this one waited, so the cache is checked again first.
+	xSemaphoreTake(dns_lookup_lock, portMAX_DELAY);
+	if(!dns_cache_get(name, address, &result)){
+		xSemaphoreTake(dns_cache_lock, portMAX_DELAY);
+		dns_cache_stats.misses++;
+		xSemaphoreGive(dns_cache_lock);
+
+		result = cy_socket_gethostbyname(name, CY_SOCKET_IP_VER_V4, address);
+		dns_cache_store(name, result, address);
+	}
+	xSemaphoreGive(dns_lookup_lock);
+
+	return result;
+}
+
+/*******************************************************************************
+ * Function Name: dns_cache_invalidate
+ *******************************************************************************
+ * Summary:
+ *  Forget a name, for example when its address stopped answering, so the
+ *  next dns_cache_resolve looks it up again.
+ *
+ *******************************************************************************/
+void dns_cache_invalidate(const char *name){
+
+	xSemaphoreTake(dns_cache_lock, portMAX_DELAY);
+	dns_cache_entry_t *entry = dns_cache_find(name);
+	if(entry != NULL){
+		entry->name[0] = '\0';
+	}
+	xSemaphoreGive(dns_cache_lock);
+}
+
+void dns_cache_get_stats(dns_cache_stats_t *stats){
+
+	xSemaphoreTake(dns_cache_lock, portMAX_DELAY);
+	*stats = dns_cache_stats;
+	xSemaphoreGive(dns_cache_lock);
+}
+
+/*******************************************************************************
+ * Function Name: dns_cache_find
+ *******************************************************************************
+ * Summary:
+ *  The entry of a name, NULL if it has none. Called with dns_cache_lock.
+ *
+ *******************************************************************************/
+static dns_cache_entry_t *dns_cache_find(const char *name){
+
+	for(uint32_t i = 0; i < DNS_CACHE_SIZE; i++){
+		if(dns_cache[i].name[0] != '\0' && strcmp(dns_cache[i].name, name) == 0){
+			return &dns_cache[i];
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+ * Function Name: dns_cache_get
+ *******************************************************************************
+ * Summary:
+ *  The result kept for a name, if its time to live has not run out. Counts
+ *  the hit and marks the name as in use.
+ *
+ * Return:
+ *  bool: true if the cache had the name, with its result in *result
+ *
+ *******************************************************************************/
+static bool dns_cache_get(const char *name, cy_socket_ip_address_t *address, cy_rslt_t *result){
+
+	xSemaphoreTake(dns_cache_lock, portMAX_DELAY);
+	dns_cache_entry_t *entry = dns_cache_find(name);
+	bool found = (entry != NULL && (xTaskGetTickCount() - entry->found) < entry->ttl);
+	if(found){
+		entry->used = true;
+		entry->last_used = xTaskGetTickCount();
+		*result = entry->result;
+		if(entry->result == CY_RSLT_SUCCESS){
+			*address = entry->address;
+			dns_cache_stats.hits++;
+		}
+		else{
+			dns_cache_stats.negative_hits++;
+		}
+	}
+	xSemaphoreGive(dns_cache_lock);
+
+	return found;
+}
+
+/*******************************************************************************
+ * Function Name: dns_cache_store
+ *******************************************************************************
+ * Summary:
+ *  Keep the result of a lookup in the entry of the name, or in a free entry,
+ *  or in place of the least recently used one.
+ *
+ *******************************************************************************/
+static void dns_cache_store(const char *name, cy_rslt_t result, const cy_socket_ip_address_t *address){
+
+	uint32_t length = strlen(name);
+	bool local = (length > 6 && strcmp(&name[length - 6], ".local") == 0);
+
+	xSemaphoreTake(dns_cache_lock, portMAX_DELAY);
+	dns_cache_entry_t *entry = dns_cache_find(name);
+	if(entry == NULL){
+		TickType_t now = xTaskGetTickCount();
+		entry = &dns_cache[0];
+		for(uint32_t i = 0; i < DNS_CACHE_SIZE; i++){
+			if(dns_cache[i].name[0] == '\0'){
+				entry = &dns_cache[i];
+				break;
+			}
+			if(now - dns_cache[i].last_used > now - entry->last_used){
+				entry = &dns_cache[i];
+			}
+		}
+		memcpy(entry->name, name, length + 1);
+		entry->used = true;
+		entry->last_used = xTaskGetTickCount();
+	}
+	entry->result = result;
+	entry->found = xTaskGetTickCount();
+	if(result == CY_RSLT_SUCCESS){
+		entry->address = *address;
+		entry->ttl = pdMS_TO_TICKS(local ? DNS_CACHE_MDNS_TTL_MS : DNS_CACHE_DNS_TTL_MS);
+	}
+	else{
+		entry->ttl = pdMS_TO_TICKS(DNS_CACHE_NEGATIVE_TTL_MS);
+		dns_cache_stats.failures++;
+	}
+	xSemaphoreGive(dns_cache_lock);
+}
+
+/*******************************************************************************
+ * Function Name: dns_cache_task
+ *******************************************************************************
+ * Summary:
+ *  Look the names in use up again before their time to live runs out. A
+ *  name is refreshed once per time to live, and only if it was asked for
+ *  since it was last looked up, so names nobody uses are left to expire. A
+ *  refresh that fails keeps the address it had until it expires.
+ *
+ * Parameters:
+ *  void *args : unused
+ *
+ *******************************************************************************/
+static void dns_cache_task(void *arg){
+
+	char name[DNS_CACHE_MAX_NAME];
+	cy_socket_ip_address_t address;
+
+	while(1){
+		vTaskDelay(pdMS_TO_TICKS(DNS_CACHE_TASK_PERIOD_MS));
+
+		for(uint32_t i = 0; i < DNS_CACHE_SIZE; i++){
+			bool due = false;
+
+			xSemaphoreTake(dns_cache_lock, portMAX_DELAY);
+			dns_cache_entry_t *entry = &dns_cache[i];
+			TickType_t age = xTaskGetTickCount() - entry->found;
+			if(entry->name[0] != '\0' && entry->used && entry->result == CY_RSLT_SUCCESS &&
+			   age >= entry->ttl / 100 * DNS_CACHE_REFRESH_PERCENT && age < entry->ttl){
+				memcpy(name, entry->name, sizeof(name));
+				entry->used = false;
+				due = true;
+			}
+			xSemaphoreGive(dns_cache_lock);
+			if(!due){
+				continue;
+			}
+
+			xSemaphoreTake(dns_lookup_lock, portMAX_DELAY);
+			cy_rslt_t result = cy_socket_gethostbyname(name, CY_SOCKET_IP_VER_V4, &address);
+			if(result == CY_RSLT_SUCCESS){
+				dns_cache_store(name, result, &address);
+			}
+			else{
+				printf("Refresh of %s failed, keeping its address\n", name);
+			}
+			xSemaphoreGive(dns_lookup_lock);
+
+			xSemaphoreTake(dns_cache_lock, portMAX_DELAY);
+			dns_cache_stats.refreshes++;
+			xSemaphoreGive(dns_cache_lock);
+		}
+	}
+}
+
+/* [] END OF FILE */
@@ -0,0 +1,72 @@
+/******************************************************************************
+* File Name:   dns_cache.h
+*
+* Description: This file contains the declarations of the host name cache
+* shared by the TCP client tasks.
+*
+* A name is looked up with cy_socket_gethostbyname (mDNS for .local names,
+* DNS for the rest) the first time it is asked for, and the address is kept
+* for the time to live of its record. A name that is not found is kept too,
+* for DNS_CACHE_NEGATIVE_TTL_MS, so a missing server is not asked for on
+* every reconnect. While a name is in use it is looked up again in the
+* background once DNS_CACHE_REFRESH_PERCENT of its time to live has passed,
+* so the tasks keep getting an answer without waiting for the network.
+*
+* cy_socket_gethostbyname does not give the TTL of the record it found, so
+* each name gets the TTL of its kind: DNS_CACHE_MDNS_TTL_MS for .local names
+* (the host record TTL of mDNS) and DNS_CACHE_DNS_TTL_MS for the others.
+*
+* Two tasks that miss on the same name at once share one lookup.
+*
+*******************************************************************************/
+
+#ifndef DNS_CACHE_H_
+#define DNS_CACHE_H_
+
+#include "cy_secure_sockets.h"
+
+/*******************************************************************************
+* Macros
+********************************************************************************/
+/* Names kept, the least recently used one is replaced. */
+#define DNS_CACHE_SIZE                     (4)
+
+/* Longest name, with its NUL. */
+#define DNS_CACHE_MAX_NAME                 (64)
+
+/* Time to live of the addresses found, see above. */
+#define DNS_CACHE_MDNS_TTL_MS              (120000)
+#define DNS_CACHE_DNS_TTL_MS               (300000)
+
+/* Time to live of a name that was not found. */
+#define DNS_CACHE_NEGATIVE_TTL_MS          (10000)
+
+/* How far into its time to live a name in use is looked up again. */
+#define DNS_CACHE_REFRESH_PERCENT          (80)
+
+/* The task that refreshes the names. */
+#define DNS_CACHE_TASK_STACK_SIZE          (2 * 1024)
+#define DNS_CACHE_TASK_PRIORITY            (1)
+#define DNS_CACHE_TASK_PERIOD_MS           (1000)
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* Counters of the cache. */
+typedef struct {
+	uint32_t hits;              // answered from the cache
+	uint32_t negative_hits;     // answered not found from the cache
+	uint32_t misses;            // had to wait for a lookup
+	uint32_t refreshes;         // looked up again in the background
+	uint32_t failures;          // lookups that found nothing
+} dns_cache_stats_t;
+
+/*******************************************************************************
+* Function Prototype
+********************************************************************************/
+cy_rslt_t dns_cache_init(void);
+cy_rslt_t dns_cache_resolve(const char *name, cy_socket_ip_address_t *address);
+void dns_cache_invalidate(const char *name);
+void dns_cache_get_stats(dns_cache_stats_t *stats);
+
+#endif /* DNS_CACHE_H_ */
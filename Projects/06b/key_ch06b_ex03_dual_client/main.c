@@ -60,6 +60,9 @@
 /* TCP client task header file. */
 #include "tcp_client.h"
 
+/* Host name cache header file. */
+#include "dns_cache.h"
+
 /*******************************************************************************
 * Macros
 ********************************************************************************/
@@ -217,7 +220,9 @@ void connect_to_wifi_ap(void *arg){
 			mac_checksum = MAC_addr[0] +  MAC_addr[1] +  MAC_addr[2] +  MAC_addr[3] +  MAC_addr[4] +  MAC_addr[5];
 
 			// Connected
-			/* Create the network tasks once the wifi is connected. */
+			/* Create the network tasks once the wifi is connected, they
+			 * share the host name cache. */
+			dns_cache_init();
 			xTaskCreate(tcp_client_task, "Network task", TCP_CLIENT_TASK_STACK_SIZE, &nonsecurity, TCP_CLIENT_TASK_PRIORITY, &client_task_handle);
 			xTaskCreate(tcp_client_task, "Secure Network task", TCP_CLIENT_TASK_STACK_SIZE, &security, TCP_CLIENT_TASK_PRIORITY, &secure_client_task_handle);
 
@@ -0,0 +1,345 @@
+/******************************************************************************
+* File Name:   tcp_async.c
+*
+* Description: This file contains the pipelined command API of the TCP
+* client, see tcp_async.h.
+*
+*******************************************************************************/
+
+/* Header file includes. */
+#include "cyhal.h"
+
+/* Standard C header file. */
+#include <stdio.h>
+#include <string.h>
+
+/* Pipelined command API header file. */
+#include "tcp_async.h"
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* A finished command, on its way to the completion task. */
+typedef struct {
+	uint32_t id;
+	cy_rslt_t result;
+	tcp_async_callback_t callback;
+	void *arg;
+	char reply[TCP_ASYNC_MAX_REPLY + 1];
+} tcp_async_completion_t;
+
+/*******************************************************************************
+* Function Prototypes
+********************************************************************************/
+static void tcp_async_task(void *arg);
+static void tcp_async_complete(tcp_async_t *client, const tcp_async_request_t *request, cy_rslt_t result, const uint8_t *reply, uint32_t length);
+static cy_rslt_t tcp_async_recv_handler(cy_socket_t socket_handle, void *arg);
+
+/*******************************************************************************
+ * Function Name: tcp_async_init
+ *******************************************************************************
+ * Summary:
+ *  Create the window, the lock and the completion task of a client. It has
+ *  no connection until tcp_async_attach.
+ *
+ * Parameters:
+ *  tcp_async_t *client: the client
+ *  const char *name: for the prints and the task
+ *
+ * Return:
+ *  cy_result result: Result of the operation
+ *
+ *******************************************************************************/
+cy_rslt_t tcp_async_init(tcp_async_t *client, const char *name){
+
+	memset(client, 0, sizeof(tcp_async_t));
+	client->name = name;
+	client->lock = xSemaphoreCreateMutex();
+	client->send_lock = xSemaphoreCreateMutex();
+	client->window = xSemaphoreCreateCounting(TCP_ASYNC_WINDOW, TCP_ASYNC_WINDOW);
+	client->completions = xQueueCreate(TCP_ASYNC_WINDOW, sizeof(tcp_async_completion_t));
+	if(client->lock == NULL || client->send_lock == NULL || client->window == NULL || client->completions == NULL){
+		printf("Failed to create the %s command window\n", name);
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	if(xTaskCreate(tcp_async_task, name, TCP_ASYNC_TASK_STACK_SIZE, client, TCP_ASYNC_TASK_PRIORITY, &client->task) != pdPASS){
+		printf("Failed to create the %s completion task\n", name);
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	return CY_RSLT_SUCCESS;
+}
+
+/*******************************************************************************
+ * Function Name: tcp_async_attach
+ *******************************************************************************
+ * Summary:
+ *  Start sending commands on a connected socket. The socket stays the
+ *  caller's to close, after tcp_async_fail.
+ *
+ * Parameters:
+ *  tcp_async_t *client: the client
+ *  cy_socket_t socket: connected socket, its receive callback is taken over
+ *
+ * Return:
+ *  cy_result result: Result of the operation
+ *
+ *******************************************************************************/
+cy_rslt_t tcp_async_attach(tcp_async_t *client, cy_socket_t socket){
+
+	cy_rslt_t result;
+	cy_socket_opt_callback_t tcp_recv_option;
+
+	xSemaphoreTake(client->lock, portMAX_DELAY);
+	client->socket = socket;
+	client->head = 0;
+	client->count = 0;
+	client->rx_length = 0;
+
+	/* Register the callback function to handle the replies from the TCP server. */
+	tcp_recv_option.callback = tcp_async_recv_handler;
+	tcp_recv_option.arg = client;
+	result = cy_socket_setsockopt(socket, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_RECEIVE_CALLBACK, &tcp_recv_option, sizeof(cy_socket_opt_callback_t));
+	if(result != CY_RSLT_SUCCESS){
+		printf("Set socket option: CY_SOCKET_SO_RECEIVE_CALLBACK failed\n");
+	}
+	client->open = (result == CY_RSLT_SUCCESS);
+	xSemaphoreGive(client->lock);
+
+	return result;
+}
+
+/*******************************************************************************
+ * Function Name: tcp_async_submit
+ *******************************************************************************
+ * Summary:
+ *  Send a command without waiting for its reply. The callback is called on
+ *  the completion task with the reply, or with the error if the connection
+ *  fails first.
+ *
+ * Parameters:
+ *  tcp_async_t *client: the client
+ *  const char *command: NUL terminated command
+ *  tcp_async_callback_t callback: called when the command is done, may be NULL
+ *  void *arg: passed on to callback
+ *  TickType_t wait: how long to wait for room in the window
+ *
+ * Return:
+ *  uint32_t: request id of the command, 0 if it was not sent and callback
+ *  will not be called
+ *
+ *******************************************************************************/
+uint32_t tcp_async_submit(tcp_async_t *client, const char *command, tcp_async_callback_t callback, void *arg, TickType_t wait){
+
+	cy_rslt_t result;
+	uint8_t frame[TCP_ASYNC_FRAME_HEADER + TCP_ASYNC_MAX_COMMAND];
+	uint32_t length = strlen(command);
+	uint32_t bytes_sent;
+
+	if(length == 0 || length > TCP_ASYNC_MAX_COMMAND || !client->open){
+		return 0;
+	}
+	if(xSemaphoreTake(client->window, wait) != pdTRUE){
+		return 0;
+	}
+
+	// The ring has to be in the order the commands go out, so the submitters
+	// take turns. The request is in the ring before it is sent, its reply
+	// can come back before cy_socket_send returns.
+	xSemaphoreTake(client->send_lock, portMAX_DELAY);
+	xSemaphoreTake(client->lock, portMAX_DELAY);
+	if(!client->open){
+		xSemaphoreGive(client->lock);
+		xSemaphoreGive(client->send_lock);
+		xSemaphoreGive(client->window);
+		return 0;
+	}
+	if(++client->next_id == 0){
+		client->next_id = 1;
+	}
+	uint32_t id = client->next_id;
+	tcp_async_request_t *request = &client->requests[(client->head + client->count) % TCP_ASYNC_WINDOW];
+	request->id = id;
+	request->sent = xTaskGetTickCount();
+	request->callback = callback;
+	request->arg = arg;
+	client->count++;
+	xSemaphoreGive(client->lock);
+
+	frame[0] = (uint8_t)(length >> 8);
+	frame[1] = (uint8_t)length;
+	memcpy(&frame[TCP_ASYNC_FRAME_HEADER], command, length);
+	result = cy_socket_send(client->socket, frame, TCP_ASYNC_FRAME_HEADER + length, CY_SOCKET_FLAGS_NONE, &bytes_sent);
+	if(result != CY_RSLT_SUCCESS){
+		// Not sent, so it is taken back unreported if it has not been failed
+		// already, and the ones before it are failed
+		xSemaphoreTake(client->lock, portMAX_DELAY);
+		bool taken = (client->count > 0 && client->requests[(client->head + client->count - 1) % TCP_ASYNC_WINDOW].id == id);
+		if(taken){
+			client->count--;
+		}
+		xSemaphoreGive(client->lock);
+		xSemaphoreGive(client->send_lock);
+		if(taken){
+			xSemaphoreGive(client->window);
+		}
+		printf("Failed to send command to %s server. Error: %d\n", client->name, (int)result);
+		tcp_async_fail(client, result);
+		return taken ? 0 : id;
+	}
+	xSemaphoreGive(client->send_lock);
+
+	return id;
+}
+
+/*******************************************************************************
+ * Function Name: tcp_async_fail
+ *******************************************************************************
+ * Summary:
+ *  Stop using the connection and fail every command in flight with result.
+ *  Called when the connection is lost, or is about to be closed.
+ *
+ *******************************************************************************/
+void tcp_async_fail(tcp_async_t *client, cy_rslt_t result){
+
+	xSemaphoreTake(client->lock, portMAX_DELAY);
+	client->open = false;
+	while(client->count > 0){
+		tcp_async_complete(client, &client->requests[client->head], result, NULL, 0);
+		client->head = (client->head + 1) % TCP_ASYNC_WINDOW;
+		client->count--;
+	}
+	xSemaphoreGive(client->lock);
+}
+
+bool tcp_async_is_open(tcp_async_t *client){
+	return client->open;
+}
+
+uint32_t tcp_async_in_flight(tcp_async_t *client){
+	return client->count;
+}
+
+/*******************************************************************************
+ * Function Name: tcp_async_complete
+ *******************************************************************************
+ * Summary:
+ *  Hand a finished command to the completion task. The queue has a place
+ *  for every slot of the window, so this never waits.
+ *
+ *******************************************************************************/
+static void tcp_async_complete(tcp_async_t *client, const tcp_async_request_t *request, cy_rslt_t result, const uint8_t *reply, uint32_t length){
+
+	tcp_async_completion_t completion;
+
+	completion.id = request->id;
+	completion.result = result;
+	completion.callback = request->callback;
+	completion.arg = request->arg;
+	memcpy(completion.reply, reply, length);
+	completion.reply[length] = '\0';
+	xQueueSend(client->completions, &completion, 0);
+}
+
+/*******************************************************************************
+ * Function Name: tcp_async_recv_handler
+ *******************************************************************************
+ * Summary:
+ *  Callback function to handle the replies from the TCP server. Each whole
+ *  reply belongs to the oldest command in flight, a partial one is kept for
+ *  the next call. The buffer holds the replies to a whole window, so the
+ *  single receive takes every reply the server has sent.
+ *
+ * Parameters:
+ *  cy_socket_t socket_handle: Connection handle for the TCP client socket
+ *  void *args : tcp_async_t of the connection
+ *
+ * Return:
+ *  cy_result result: Result of the operation
+ *
+ *******************************************************************************/
+static cy_rslt_t tcp_async_recv_handler(cy_socket_t socket_handle, void *arg){
+
+	tcp_async_t *client = arg;
+	cy_rslt_t result;
+	uint32_t bytes_received = 0;
+	uint32_t offset = 0;
+
+	result = cy_socket_recv(socket_handle, &client->rx_buffer[client->rx_length], sizeof(client->rx_buffer) - client->rx_length,
+	                        CY_SOCKET_FLAGS_NONE, &bytes_received);
+	if(result != CY_RSLT_SUCCESS || !client->open){
+		client->rx_length = 0;
+		return result;
+	}
+	client->rx_length += bytes_received;
+
+	while(client->rx_length - offset >= TCP_ASYNC_FRAME_HEADER){
+		uint32_t length = ((uint32_t)client->rx_buffer[offset] << 8) | client->rx_buffer[offset + 1];
+		if(length > TCP_ASYNC_MAX_REPLY){
+			printf("Reply from %s server is too long\n", client->name);
+			tcp_async_fail(client, CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED);
+			client->rx_length = 0;
+			return result;
+		}
+		if(client->rx_length - offset < TCP_ASYNC_FRAME_HEADER + length){
+			break;
+		}
+
+		xSemaphoreTake(client->lock, portMAX_DELAY);
+		bool expected = (client->count > 0);
+		if(expected){
+			tcp_async_complete(client, &client->requests[client->head], CY_RSLT_SUCCESS, &client->rx_buffer[offset + TCP_ASYNC_FRAME_HEADER], length);
+			client->head = (client->head + 1) % TCP_ASYNC_WINDOW;
+			client->count--;
+		}
+		xSemaphoreGive(client->lock);
+		if(!expected){
+			printf("Reply from %s server to no command\n", client->name);
+			tcp_async_fail(client, CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED);
+			client->rx_length = 0;
+			return result;
+		}
+		offset += TCP_ASYNC_FRAME_HEADER + length;
+	}
+
+	memmove(client->rx_buffer, &client->rx_buffer[offset], client->rx_length - offset);
+	client->rx_length -= offset;
+	return result;
+}
+
+/*******************************************************************************
+ * Function Name: tcp_async_task
+ *******************************************************************************
+ * Summary:
+ *  Run the completion callbacks of a client, then free the slot of the
+ *  window the command had. Between completions look for a command that has
+ *  waited too long for its reply.
+ *
+ * Parameters:
+ *  void *args : tcp_async_t of the client
+ *
+ *******************************************************************************/
+static void tcp_async_task(void *arg){
+
+	tcp_async_t *client = arg;
+	tcp_async_completion_t completion;
+
+	while(1){
+		if(xQueueReceive(client->completions, &completion, pdMS_TO_TICKS(TCP_ASYNC_TIMEOUT_MS / 4)) == pdTRUE){
+			if(completion.callback != NULL){
+				completion.callback(completion.id, completion.result, (completion.result == CY_RSLT_SUCCESS) ? completion.reply : NULL, completion.arg);
+			}
+			xSemaphoreGive(client->window);
+		}
+
+		xSemaphoreTake(client->lock, portMAX_DELAY);
+		bool expired = client->open && client->count > 0 &&
+		               (xTaskGetTickCount() - client->requests[client->head].sent) >= pdMS_TO_TICKS(TCP_ASYNC_TIMEOUT_MS);
+		xSemaphoreGive(client->lock);
+		if(expired){
+			printf("No reply from %s server\n", client->name);
+			tcp_async_fail(client, CY_RSLT_MODULE_SECURE_SOCKETS_TIMEOUT);
+		}
+	}
+}
+
+/* [] END OF FILE */
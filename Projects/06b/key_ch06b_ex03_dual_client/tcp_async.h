@@ -0,0 +1,106 @@
+/******************************************************************************
+* File Name:   tcp_async.h
+*
+* Description: This file contains the declarations of the pipelined command
+* API of the TCP client.
+*
+* A tcp_async_t sends length framed commands on one connection to the AWEP
+* server without waiting for the reply to the command before it. Up to
+* TCP_ASYNC_WINDOW commands can be in flight; tcp_async_submit blocks while
+* the window is full.
+*
+* Every command gets a request id, a sequence number of the connection. The
+* server answers the frames of a connection one at a time, in the order they
+* arrived, so replies are matched to the requests in flight oldest first and
+* no tag has to travel in the protocol. A command that gets no reply within
+* TCP_ASYNC_TIMEOUT_MS leaves the order unknown, so it and every command
+* behind it fail and the connection has to be made again.
+*
+* Each completion callback runs on the tcp_async_t's own task, never in the
+* socket callbacks and never in the task that submitted the command, so it
+* can take its time without holding up the connection.
+*
+* Only commands with short replies belong here (R, W, T, L and M batches of a
+* few commands). Watch (S) events are not requests and would break the
+* matching.
+*
+*******************************************************************************/
+
+#ifndef TCP_ASYNC_H_
+#define TCP_ASYNC_H_
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <queue.h>
+#include "cy_secure_sockets.h"
+
+/*******************************************************************************
+* Macros
+********************************************************************************/
+/* Most commands in flight on one connection. */
+#define TCP_ASYNC_WINDOW                   (8)
+
+/* Longest command and reply, without the frame header. */
+#define TCP_ASYNC_MAX_COMMAND              (64)
+#define TCP_ASYNC_MAX_REPLY                (64)
+
+/* How long a command waits for its reply before the connection is failed. */
+#define TCP_ASYNC_TIMEOUT_MS               (4000)
+
+/* The task that runs the completion callbacks. */
+#define TCP_ASYNC_TASK_STACK_SIZE          (2 * 1024)
+#define TCP_ASYNC_TASK_PRIORITY            (2)
+
+/* Size of the length in front of every command and reply. */
+#define TCP_ASYNC_FRAME_HEADER             (2)
+
+/* Room for the replies to a whole window. The server never has more to send
+ * than that, so one receive takes all of it and nothing is left in the socket
+ * without a receive callback to come for it. */
+#define TCP_ASYNC_RX_BUFFER_SIZE           (TCP_ASYNC_WINDOW * (TCP_ASYNC_FRAME_HEADER + TCP_ASYNC_MAX_REPLY))
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* Called once for every submitted command, with the reply (NUL terminated)
+ * when result is CY_RSLT_SUCCESS, NULL otherwise. */
+typedef void (*tcp_async_callback_t)(uint32_t id, cy_rslt_t result, const char *reply, void *arg);
+
+/* A command in flight. */
+typedef struct {
+	uint32_t id;
+	TickType_t sent;
+	tcp_async_callback_t callback;
+	void *arg;
+} tcp_async_request_t;
+
+/* One connection. The fields are private to tcp_async.c. */
+typedef struct {
+	const char *name;
+	cy_socket_t socket;
+	volatile bool open;                       // attached and not failed
+	SemaphoreHandle_t lock;                   // the ring
+	SemaphoreHandle_t send_lock;              // one submitter at a time
+	SemaphoreHandle_t window;                 // a count per free slot of the window
+	QueueHandle_t completions;                // to the task, never more than the window
+	TaskHandle_t task;
+	tcp_async_request_t requests[TCP_ASYNC_WINDOW]; // in flight, oldest first from head
+	uint32_t head;
+	uint32_t count;
+	uint32_t next_id;
+	uint8_t rx_buffer[TCP_ASYNC_RX_BUFFER_SIZE]; // replies not matched yet, receive callback only
+	uint32_t rx_length;
+} tcp_async_t;
+
+/*******************************************************************************
+* Function Prototype
+********************************************************************************/
+cy_rslt_t tcp_async_init(tcp_async_t *client, const char *name);
+cy_rslt_t tcp_async_attach(tcp_async_t *client, cy_socket_t socket);
+uint32_t tcp_async_submit(tcp_async_t *client, const char *command, tcp_async_callback_t callback, void *arg, TickType_t wait);
+void tcp_async_fail(tcp_async_t *client, cy_rslt_t result);
+bool tcp_async_is_open(tcp_async_t *client);
+uint32_t tcp_async_in_flight(tcp_async_t *client);
+
+#endif /* TCP_ASYNC_H_ */
@@ -56,6 +56,12 @@
 /* TCP client task header file. */
 #include "tcp_client.h"
 
+/* Pipelined command API header file. */
+#include "tcp_async.h"
+
+/* Host name cache header file. */
+#include "dns_cache.h"
+
 /*******************************************************************************
 * Macros
 ********************************************************************************/
@@ -65,6 +71,19 @@
 /* Length of the TCP data packet. */
 #define MAX_TCP_DATA_PACKET_LENGTH         (20)
 
+/* How long a button press waits for room in the window of commands in
+ * flight, see tcp_async.h. */
+#define TCP_CLIENT_SUBMIT_WAIT_MS          (1000)
+
+/* An open connection is checked with a read of our own register when it has
+ * been idle this long, well inside the idle timeout of the server (30 s, or
+ * 120 s on the secure port). This also keeps the server from closing it. */
+#define TCP_CLIENT_HEALTH_CHECK_MS         (20000)
+
+/* With no button press for this long the connection is closed, the next
+ * press opens it again. */
+#define TCP_CLIENT_MAX_IDLE_MS             (600000)
+
 /* Length of the LED ON/OFF command issued from the TCP server. */
 #define TCP_LED_CMD_LEN                    (1)
 #define LED_ON_CMD                         '1'
@@ -73,23 +92,38 @@
 #define ACK_LED_OFF                        "LED OFF ACK"
 #define MSG_INVALID_CMD                    "Invalid command"
 
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* The connection of one client task to one port of the server. Each task
+ * has its own, so the secure and non-secure tasks never wait for each other.
+ * The commands are pipelined on it by async, which tcp_disconnection_handler
+ * fails when the server closes the connection. */
+typedef struct {
+	const char *name;              // for the prints
+	bool security;
+	cy_socket_sockaddr_t address;
+	cy_socket_t socket;
+	bool open;                     // socket is created and connected
+	tcp_async_t async;             // commands in flight on socket
+	TickType_t lastUsed;           // tick of the last command or health check
+	TickType_t lastPressed;        // tick of the last button press
+} tcp_endpoint_t;
+
 /*******************************************************************************
 * Function Prototypes
 ********************************************************************************/
-cy_rslt_t create_tcp_client_socket(bool *security);
-cy_rslt_t tcp_client_recv_handler(cy_socket_t socket_handle, void *arg);
+cy_rslt_t create_tcp_client_socket(tcp_endpoint_t *endpoint);
 cy_rslt_t tcp_disconnection_handler(cy_socket_t socket_handle, void *arg);
-cy_rslt_t connect_to_tcp_server(cy_socket_sockaddr_t address, bool *security);
+cy_rslt_t connect_to_tcp_server(tcp_endpoint_t *endpoint);
+static void endpoint_close(tcp_endpoint_t *endpoint);
+static uint32_t endpoint_submit(tcp_endpoint_t *endpoint, const char *command, tcp_async_callback_t callback);
+static void led_command_done(uint32_t id, cy_rslt_t result, const char *reply, void *arg);
+static void health_check_done(uint32_t id, cy_rslt_t result, const char *reply, void *arg);
 
 /*******************************************************************************
 * Global Variables
 ********************************************************************************/
-/* TCP client socket handle */
-cy_socket_t client_handle;
-
-/* Binary semaphore handle to keep track of TCP server connection. */
-SemaphoreHandle_t connect_to_server;
-
 /* Flags to track the LED state. */
 bool led_state = CYBSP_LED_STATE_OFF;
 
@@ -116,8 +150,16 @@ void *tls_identity;
  *  Task used to establish a connection to a remote TCP server and
  *  control the LED state (ON/OFF) based on the command received from TCP server.
  *
+ *  The connection is opened on the first button press and kept open for the
+ *  presses after it, so a command costs one send instead of a TCP connect
+ *  (and a TLS handshake on the secure port). The task does not wait for the
+ *  reply, it is handled by led_command_done on the completion task of the
+ *  endpoint, so presses in quick succession are in flight together. While
+ *  the connection is idle it is checked every TCP_CLIENT_HEALTH_CHECK_MS,
+ *  and it is opened again when the server has closed it.
+ *
  * Parameters:
- *  void *args : Task parameter defined during task creation (unused).
+ *  void *args : bool, true for the secure port
  *
  * Return:
  *  void
@@ -129,18 +171,19 @@ void tcp_client_task(void *arg){
 
     cy_rslt_t result;
 
-    /* Variable to hold number of bytes sent*/
-	uint32_t bytes_sent;
-
-	/* Create a binary semaphore to keep track of TCP server connection. */
-	connect_to_server = xSemaphoreCreateBinary();
-
-    /* Give the semaphore so as to connect to TCP server.  */
-    xSemaphoreGive(connect_to_server);
+    // This task's connection to the server
+    static tcp_endpoint_t endpoints[2];
+    tcp_endpoint_t *endpoint = &endpoints[security ? 1 : 0];
+    memset(endpoint, 0, sizeof(tcp_endpoint_t));
+    endpoint->security = security;
+    endpoint->name = security ? "secure" : "non-secure";
+    result = tcp_async_init(&endpoint->async, security ? "Secure replies" : "Replies");
+    if(result != CY_RSLT_SUCCESS){
+    	CY_ASSERT(0);
+    }
 
-    // Server Address
-    cy_socket_sockaddr_t tcp_server_address;
-    result = cy_socket_gethostbyname("awep.local", CY_SOCKET_IP_VER_V4, &tcp_server_address.ip_address);
+    // Server Address, the other task may already have looked it up
+    result = dns_cache_resolve(TCP_SERVER_HOST, &endpoint->address.ip_address);
     if(result == CY_RSLT_MODULE_SECURE_SOCKETS_HOST_NOT_FOUND && !security){
     	printf("Server not found!\n");
     	CY_ASSERT(0);
@@ -157,7 +200,7 @@ void tcp_client_task(void *arg){
     if(security){
 
 		// Secure Port
-		tcp_server_address.port = SECURE_TCP_SERVER_PORT;
+		endpoint->address.port = SECURE_TCP_SERVER_PORT;
 
 		/* Initializes the global trusted RootCA certificate. This examples uses a self signed
 		 * certificate which implies that the RootCA certificate is same as the certificate of
@@ -184,41 +227,37 @@ void tcp_client_task(void *arg){
 	else{
 
 		//Non Secure Port
-		tcp_server_address.port = TCP_SERVER_PORT;
+		endpoint->address.port = TCP_SERVER_PORT;
 		vTaskDelay(20);
 		printf("Press user button 2 to send a non-secure message!\n");
 	}
 
 	while(1){
 
-		/* Wait till user button is pressed to send LED ON/OFF command to TCP server. */
-		xTaskNotifyWait(0, 0, &led_state_cmd, portMAX_DELAY);
-
-		// Semaphore to make sure both threads don't connect at the same time
-		xSemaphoreTake(connect_to_server, portMAX_DELAY);
+		/* Wait till user button is pressed to send LED ON/OFF command to TCP server.
+		 * While a connection is open wake up in time to check it. */
+		TickType_t wait = endpoint->open ? pdMS_TO_TICKS(TCP_CLIENT_HEALTH_CHECK_MS) : portMAX_DELAY;
+		if(xTaskNotifyWait(0, 0, &led_state_cmd, wait) != pdTRUE){
+			char check[MAX_TCP_DATA_PACKET_LENGTH];
 
-		/* Connect to the TCP server. If the connection fails, retry
-		 * to connect to the server for MAX_TCP_SERVER_CONN_RETRIES times.
-		 */
-		if(security){
-			printf("Connecting to secure TCP server...\n");
-		}
-		else{
-			printf("Connecting to non-secure TCP server...\n");
-		}
-		result = connect_to_tcp_server(tcp_server_address, &security);
-
-		if(result != CY_RSLT_SUCCESS){
-			printf("Failed to connect to TCP server.\n");
-			CY_ASSERT(0);
-		}
-
-		if(security){
-			printf("Connected to secure port.\n");
-		}
-		else{
-			printf("Connected to non-secure port.\n");
+			if(!tcp_async_is_open(&endpoint->async)){
+				// lost while idle, the next press reconnects
+				endpoint_close(endpoint);
+			}
+			else if(xTaskGetTickCount() - endpoint->lastPressed >= pdMS_TO_TICKS(TCP_CLIENT_MAX_IDLE_MS)){
+				printf("Closing idle %s connection\n", endpoint->name);
+				endpoint_close(endpoint);
+			}
+			else if(xTaskGetTickCount() - endpoint->lastUsed >= pdMS_TO_TICKS(TCP_CLIENT_HEALTH_CHECK_MS)){
+				// Health check, a connection that does not answer is failed by
+				// the async layer and the next press reconnects
+				snprintf(check, sizeof(check), "R%04x05", mac_checksum);
+				tcp_async_submit(&endpoint->async, check, health_check_done, endpoint, 0);
+				endpoint->lastUsed = xTaskGetTickCount();
+			}
+			continue;
 		}
+		endpoint->lastPressed = xTaskGetTickCount();
 
 		//message buffer
 		char message[MAX_TCP_DATA_PACKET_LENGTH];
@@ -231,55 +270,180 @@ void tcp_client_task(void *arg){
 			snprintf(message, sizeof(message), "W%04x050000", mac_checksum);
 		}
 
-		/* Send the command to TCP server. */
-		result = cy_socket_send(client_handle, message, MAX_TCP_DATA_PACKET_LENGTH,
-					   CY_SOCKET_FLAGS_NONE, &bytes_sent);
-		if(result == CY_RSLT_SUCCESS ){
-			if(led_state_cmd == LED_ON_CMD){
-				printf("LED ON command sent to TCP server\n");
-			}
-			else{
-				printf("LED OFF command sent to TCP server\n");
-			}
+		/* Send the command to TCP server, connecting first if there is no connection. */
+		if(endpoint_submit(endpoint, message, led_command_done) == 0){
+			printf("Failed to send command to server.\n");
+			continue;
+		}
+		if(led_state_cmd == LED_ON_CMD){
+			printf("LED ON command sent to TCP server\n");
 		}
 		else{
-			printf("Failed to send command to server. Error: %d\n", (int)result);
-			if(result == CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED){
-				/* Disconnect the socket. */
-				cy_socket_disconnect(client_handle, 0);
+			printf("LED OFF command sent to TCP server\n");
+		}
+	}
+ }
+
+/*******************************************************************************
+ * Function Name: endpoint_submit
+ *******************************************************************************
+ * Summary:
+ *  Pipeline a command on the connection of an endpoint, connecting first if
+ *  it is not open. A connection the server closed while it was idle may only
+ *  be found out by sending on it, so a command that could not be sent on a
+ *  connection that was already open is sent once more on a new one.
+ *
+ * Parameters:
+ *  tcp_endpoint_t *endpoint: the connection
+ *  const char *command: NUL terminated command
+ *  tcp_async_callback_t callback: called with the reply on the completion task
+ *
+ * Return:
+ *  uint32_t: request id of the command, 0 if it was not sent
+ *
+ *******************************************************************************/
+static uint32_t endpoint_submit(tcp_endpoint_t *endpoint, const char *command, tcp_async_callback_t callback){
+
+	uint32_t id = 0;
+	bool reused = endpoint->open && tcp_async_is_open(&endpoint->async);
+	dns_cache_stats_t dns_stats;
+
+	for(int attempt = 0; attempt < 2 && id == 0; attempt++){
+		if(!endpoint->open || !tcp_async_is_open(&endpoint->async)){
+			endpoint_close(endpoint);
+			// the server may have a new address, usually this is a cache hit
+			if(dns_cache_resolve(TCP_SERVER_HOST, &endpoint->address.ip_address) != CY_RSLT_SUCCESS){
+				printf("%s not found\n", TCP_SERVER_HOST);
+				return 0;
+			}
+			printf("Connecting to %s TCP server...\n", endpoint->name);
+			if(connect_to_tcp_server(endpoint) != CY_RSLT_SUCCESS){
+				printf("Failed to connect to TCP server.\n");
+				// look the name up again next time in case the server moved
+				dns_cache_invalidate(TCP_SERVER_HOST);
+				return 0;
+			}
+			printf("Connected to %s port.\n", endpoint->name);
+			dns_cache_get_stats(&dns_stats);
+			printf("Name cache: %u hits, %u misses, %u refreshes\n", (unsigned int)dns_stats.hits,
+					(unsigned int)dns_stats.misses, (unsigned int)dns_stats.refreshes);
+			if(tcp_async_attach(&endpoint->async, endpoint->socket) != CY_RSLT_SUCCESS){
+				endpoint_close(endpoint);
+				return 0;
 			}
 		}
 
+		id = tcp_async_submit(&endpoint->async, command, callback, endpoint, pdMS_TO_TICKS(TCP_CLIENT_SUBMIT_WAIT_MS));
+		if(id == 0 && (!reused || tcp_async_is_open(&endpoint->async))){
+			// a new connection failed, or the window stayed full
+			break;
+		}
+		reused = false;
 	}
- }
+	endpoint->lastUsed = xTaskGetTickCount();
+	return id;
+}
+
+/*******************************************************************************
+ * Function Name: led_command_done
+ *******************************************************************************
+ * Summary:
+ *  Completion callback of an LED command, runs on the completion task of the
+ *  endpoint. Sets the LED to the state the server accepted.
+ *
+ *******************************************************************************/
+static void led_command_done(uint32_t id, cy_rslt_t result, const char *reply, void *arg){
+
+	if(result != CY_RSLT_SUCCESS){
+		printf("Command %u failed. Error: %d\n", (unsigned int)id, (int)result);
+		return;
+	}
+
+	printf("message received: %s (command %u)\n", reply, (unsigned int)id);
+	if(reply[0] == 'A'){
+		printf("Write Accepted\n");
+		if(reply[10] == '1') /* LED state in response message is ON */
+		{
+			/* LED ON */
+			cyhal_gpio_write(CYBSP_USER_LED, CYBSP_LED_STATE_ON);
+		}
+		else
+		{
+			/* LED OFF */
+			cyhal_gpio_write(CYBSP_USER_LED, CYBSP_LED_STATE_OFF);
+		}
+	}
+	else if(reply[0] == 'X'){
+		printf("Write Rejected\n");
+	}
+	else{
+		printf("Invalid command\n");
+	}
+}
+
+/*******************************************************************************
+ * Function Name: health_check_done
+ *******************************************************************************
+ * Summary:
+ *  Completion callback of a health check. Any reply means the server is
+ *  still there, a failure has already failed the connection.
+ *
+ *******************************************************************************/
+static void health_check_done(uint32_t id, cy_rslt_t result, const char *reply, void *arg){
+
+	tcp_endpoint_t *endpoint = arg;
+
+	if(result != CY_RSLT_SUCCESS){
+		printf("Lost the %s connection\n", endpoint->name);
+	}
+}
+
+/*******************************************************************************
+ * Function Name: endpoint_close
+ *******************************************************************************
+ * Summary:
+ *  Fail the commands in flight, then disconnect and delete the socket of an
+ *  endpoint if it has one. Only the task of the endpoint deletes the socket,
+ *  the disconnection handler just fails the commands.
+ *
+ *******************************************************************************/
+static void endpoint_close(tcp_endpoint_t *endpoint){
+	tcp_async_fail(&endpoint->async, CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED);
+	if(endpoint->open){
+		cy_socket_disconnect(endpoint->socket, 0);
+		/* Free the resources allocated to the socket. */
+		cy_socket_delete(endpoint->socket);
+		endpoint->open = false;
+		printf("Disconnected from %s server\n", endpoint->name);
+	}
+}
 
 /*******************************************************************************
  * Function Name: create_tcp_client_socket
  *******************************************************************************
  * Summary:
- *  Function to create a socket and set the socket options
- *  to set call back function for handling incoming messages, call back
- *  function to handle disconnection.
+ *  Function to create the socket of an endpoint and set the socket option
+ *  for the call back function to handle disconnection. The receive call back
+ *  is set by tcp_async_attach once it is connected.
  *
  *******************************************************************************/
-cy_rslt_t create_tcp_client_socket(bool* security){
+cy_rslt_t create_tcp_client_socket(tcp_endpoint_t *endpoint){
 
     cy_rslt_t result;
 
     /* Variables used to set socket options. */
-    cy_socket_opt_callback_t tcp_recv_option;
     cy_socket_opt_callback_t tcp_disconnect_option;
 	
 	/* TLS authentication mode.*/
     cy_socket_tls_auth_mode_t tls_auth_mode = CY_SOCKET_TLS_VERIFY_REQUIRED;
 
     // Non-Secure specific setup
-    if(*security == false){
+    if(endpoint->security == false){
 
     	printf("Creating non-secure socket\n");
 
     	/* Create a new secure TCP socket. */
-		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TCP, &client_handle);
+		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TCP, &endpoint->socket);
 		if (result != CY_RSLT_SUCCESS){
 			printf("Failed to create socket!\n");
 			return result;
@@ -292,7 +456,7 @@ cy_rslt_t create_tcp_client_socket(bool* security){
     	printf("Creating secure socket\n");
 
     	/* Create a new secure TCP socket. */
-		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TLS, &client_handle);
+		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TLS, &endpoint->socket);
 		if (result != CY_RSLT_SUCCESS)
 		{
 			printf("Failed to create socket!\n");
@@ -300,13 +464,13 @@ cy_rslt_t create_tcp_client_socket(bool* security){
 		}
 
 		/* Set the TCP socket to use the TLS identity. */
-		result = cy_socket_setsockopt(client_handle, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_IDENTITY, tls_identity, sizeof(tls_identity));
+		result = cy_socket_setsockopt(endpoint->socket, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_IDENTITY, tls_identity, sizeof(tls_identity));
 		if(result != CY_RSLT_SUCCESS){
 			printf("Failed cy_socket_setsockopt! Error code: %d\n", (int)result);
 		}
 		
 		/* Set the TLS authentication mode. */
-		result = cy_socket_setsockopt(client_handle, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_AUTH_MODE,
+		result = cy_socket_setsockopt(endpoint->socket, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_AUTH_MODE,
 							&tls_auth_mode, sizeof(cy_socket_tls_auth_mode_t));
 		if(result != CY_RSLT_SUCCESS)
 		{
@@ -315,19 +479,10 @@ cy_rslt_t create_tcp_client_socket(bool* security){
 		}
     }
 
-    /* Register the callback function to handle messages received from TCP server. */
-	tcp_recv_option.callback = tcp_client_recv_handler;
-	tcp_recv_option.arg = security;
-	result = cy_socket_setsockopt(client_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_RECEIVE_CALLBACK, &tcp_recv_option, sizeof(cy_socket_opt_callback_t));
-	if (result != CY_RSLT_SUCCESS){
-		printf("Set socket option: CY_SOCKET_SO_RECEIVE_CALLBACK failed\n");
-		return result;
-	}
-
 	/* Register the callback function to handle disconnection. */
 	tcp_disconnect_option.callback = tcp_disconnection_handler;
-	tcp_disconnect_option.arg = NULL;
-	result = cy_socket_setsockopt(client_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_DISCONNECT_CALLBACK, &tcp_disconnect_option, sizeof(cy_socket_opt_callback_t));
+	tcp_disconnect_option.arg = endpoint;
+	result = cy_socket_setsockopt(endpoint->socket, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_DISCONNECT_CALLBACK, &tcp_disconnect_option, sizeof(cy_socket_opt_callback_t));
 	if(result != CY_RSLT_SUCCESS){
 		printf("Set socket option: CY_SOCKET_SO_DISCONNECT_CALLBACK failed\n");
 	}
@@ -339,33 +494,34 @@ cy_rslt_t create_tcp_client_socket(bool* security){
  * Function Name: connect_to_tcp_server
  *******************************************************************************
  * Summary:
- *  Function to connect to TCP server.
+ *  Function to connect an endpoint to its TCP server port.
  *
  * Parameters:
- *  cy_socket_sockaddr_t address: Address of TCP server socket
+ *  tcp_endpoint_t *endpoint: the connection, with the address of the server
  *
  * Return:
  *  cy_result result: Result of the operation
  *
  *******************************************************************************/
-cy_rslt_t connect_to_tcp_server(cy_socket_sockaddr_t address, bool *security){
+cy_rslt_t connect_to_tcp_server(tcp_endpoint_t *endpoint){
 
     cy_rslt_t result = CY_RSLT_MODULE_SECURE_SOCKETS_TIMEOUT;
     cy_rslt_t conn_result;
 
     for(uint32_t conn_retries = 0; conn_retries < MAX_TCP_SERVER_CONN_RETRIES; conn_retries++){
         /* Create a TCP socket */
-        conn_result = create_tcp_client_socket(security);
+        conn_result = create_tcp_client_socket(endpoint);
         if(conn_result != CY_RSLT_SUCCESS){
             printf("Socket creation failed!\n");
             CY_ASSERT(0);
         }
 
-        conn_result = cy_socket_connect(client_handle, &address, sizeof(cy_socket_sockaddr_t));
+        conn_result = cy_socket_connect(endpoint->socket, &endpoint->address, sizeof(cy_socket_sockaddr_t));
 
         if (conn_result == CY_RSLT_SUCCESS){
             printf("============================================================\n");
-
+            endpoint->open = true;
+            endpoint->lastUsed = xTaskGetTickCount();
             return conn_result;
         }
 
@@ -375,7 +531,7 @@ cy_rslt_t connect_to_tcp_server(cy_socket_sockaddr_t address, bool *security){
         /* The resources allocated during the socket creation (cy_socket_create)
          * should be deleted.
          */
-        cy_socket_delete(client_handle);
+        cy_socket_delete(endpoint->socket);
     }
 
      /* Stop retrying after maximum retry attempts. */
@@ -384,80 +540,18 @@ cy_rslt_t connect_to_tcp_server(cy_socket_sockaddr_t address, bool *security){
      return result;
 }
 
-/*******************************************************************************
- * Function Name: tcp_client_recv_handler
- *******************************************************************************
- * Summary:
- *  Callback function to handle incoming TCP server messages.
- *
- * Parameters:
- *  cy_socket_t socket_handle: Connection handle for the TCP client socket
- *  void *args : bool representing whether the message was received by the secure or nonsecure socket
- *
- * Return:
- *  cy_result result: Result of the operation
- *
- *******************************************************************************/
-cy_rslt_t tcp_client_recv_handler(cy_socket_t socket_handle, void *arg)
-{
-	// Secure/Unsecure var
-	bool security = (*(bool*)arg);
-
-    /* Variable to store number of bytes received. */
-    uint32_t bytes_received = 0;
-
-    char message_buffer[MAX_TCP_DATA_PACKET_LENGTH];
-    cy_rslt_t result ;
-
-    result = cy_socket_recv(socket_handle, message_buffer, MAX_TCP_DATA_PACKET_LENGTH,
-                            CY_SOCKET_FLAGS_NONE, &bytes_received);
-    printf("message received: %s\n",message_buffer);
-
-    if(message_buffer[0] == 'A')
-    {
-        printf("Write Accepted\n");
-        if(message_buffer[10] == '1') /* LED state in response message is ON */
-		{
-			/* LED ON */
-			cyhal_gpio_write(CYBSP_USER_LED, CYBSP_LED_STATE_ON);
-		}
-		else
-		{
-			/* LED OFF */
-			cyhal_gpio_write(CYBSP_USER_LED, CYBSP_LED_STATE_OFF);
-		}
-    }
-    else if(message_buffer[0] == 'X'){
-        printf("Write Rejected\n");
-    }
-    else{
-        printf("Invalid command\n");
-    }
-
-    //disconnect
-	cy_socket_disconnect(client_handle, 0);
-	/* Free the resources allocated to the socket. */
-	cy_socket_delete(client_handle);
-	xSemaphoreGive(connect_to_server);
-	if(security){
-		printf("Disconnected from Secure Server\n");
-	}
-	else{
-		printf("Disconnected from Non-Secure Server\n");
-	}
-
-    return result;
-}
-
 /*******************************************************************************
  * Function Name: tcp_disconnection_handler
  *******************************************************************************
  * Summary:
- *  Callback function to handle TCP socket disconnection event.
+ *  Callback function to handle TCP socket disconnection event. The commands
+ *  in flight are failed here. The socket belongs to the task of the
+ *  endpoint, which may be using it right now, so it is closed by the task
+ *  before it next uses it.
  *
  * Parameters:
  *  cy_socket_t socket_handle: Connection handle for the TCP client socket
- *  void *args : Parameter passed on to the function (unused)
+ *  void *args : tcp_endpoint_t of the connection
  *
  * Return:
  *  cy_result result: Result of the operation
@@ -465,20 +559,12 @@ cy_rslt_t tcp_client_recv_handler(cy_socket_t socket_handle, void *arg)
  *******************************************************************************/
 cy_rslt_t tcp_disconnection_handler(cy_socket_t socket_handle, void *arg){
 
-    cy_rslt_t result;
-
-    /* Disconnect the TCP client. */
-    result = cy_socket_disconnect(socket_handle, 0);
-
-    /* Free the resources allocated to the socket. */
-    cy_socket_delete(socket_handle);
+    tcp_endpoint_t *endpoint = arg;
 
+    tcp_async_fail(&endpoint->async, CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED);
     printf("Disconnected from the TCP server! \n");
 
-    /* Give the semaphore so as to connect to TCP server.  */
-    xSemaphoreGive(connect_to_server);
-
-    return result;
+    return CY_RSLT_SUCCESS;
 }
 
 /*******************************************************************************
@@ -70,6 +70,8 @@
 /* Change the server IP address to match the TCP server address (IP address
  * of the PC).
  */
+#define TCP_SERVER_HOST                   "awep.local"
+
 #define TCP_SERVER_PORT                   27708
 
 #define SECURE_TCP_SERVER_PORT            40508
@@ -0,0 +1,32 @@
+#ifndef BINARYPROTOCOL_H_
+#define BINARYPROTOCOL_H_
+
+#include "cyhal.h"
+#include "linkedList.h"
+
+// Binary AWEP frame, all fields little endian:
+//  byte 0     binMagic
+//  byte 1     command, 'R' or 'W' from the client, 'A', 'N', 'F' or 'X' in a reply
+//  byte 2-3   deviceId
+//  byte 4     regId
+//  byte 5-6   value (ignored for R)
+//  byte 7-8   CRC-16/CCITT of bytes 0-6
+// The magic byte is not printable and not a frame length, so the server can
+// tell a binary client from an ASCII or length framed one by its first byte.
+#define binMagic        (0xA5)
+#define binFrameLength  (9)
+
+// A decoded binary frame
+typedef struct {
+    uint8_t command;
+    dbEntry_t entry;
+} binCommand_t;
+
+//crc of a buffer
+uint16_t binCrc16(const uint8_t *data, uint32_t length);
+//decode a frame, returns false if the magic or CRC is wrong
+bool binDecode(const uint8_t *frame, binCommand_t *command);
+//encode a frame
+void binEncode(uint8_t command, const dbEntry_t *entry, uint8_t *frame);
+
+#endif
@@ -0,0 +1,51 @@
+//CLOCK eviction of the database entries, see dbEvict.h
+#include "cyhal.h"
+#include "dbEvict.h"
+
+// The bits of pool entry n
+static volatile uint8_t dbReferenced[dbPoolSize];
+static uint8_t dbPinned[dbPoolSize];
+
+// Position of the hand in the sorted index. Inserts and deletes shift the
+// index under it, which only moves the hand by an entry or so.
+static uint32_t dbHand = 0;
+
+void dbEvictTouch(const dbEntry_t *entry){
+	dbReferenced[dbPoolIndex(entry)] = 1;
+}
+
+void dbEvictPin(const dbEntry_t *entry, bool pinned){
+	dbPinned[dbPoolIndex(entry)] = pinned;
+}
+
+bool dbEvictPinned(const dbEntry_t *entry){
+	return dbPinned[dbPoolIndex(entry)] != 0;
+}
+
+void dbEvictForget(const dbEntry_t *entry){
+	dbReferenced[dbPoolIndex(entry)] = 0;
+	dbPinned[dbPoolIndex(entry)] = 0;
+}
+
+// dbEvictVictim:
+// Move the hand until it finds an entry that is neither pinned nor
+// referenced. Two turns are enough, the first clears every reference bit.
+dbEntry_t *dbEvictVictim(){
+	uint32_t count = dbGetCount(NULL);
+	for(uint32_t step = 0; step < 2 * count; step++){
+		if(dbHand >= count){
+			dbHand = 0;
+		}
+		dbEntry_t *entry = dbGetIndexed(dbHand++);
+		uint32_t n = dbPoolIndex(entry);
+		if(dbPinned[n]){
+			continue;
+		}
+		if(dbReferenced[n]){
+			dbReferenced[n] = 0;
+			continue;
+		}
+		return entry;
+	}
+	return NULL;
+}
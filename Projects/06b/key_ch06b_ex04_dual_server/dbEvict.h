@@ -0,0 +1,32 @@
+#ifndef DBEVICT_H_
+#define DBEVICT_H_
+
+#include "cyhal.h"
+#include "linkedList.h"
+
+// CLOCK eviction of the database entries.
+//
+// Every entry has a reference bit, set when it is read or written, and a
+// pinned flag. dbEvictVictim moves a hand around the sorted index: a pinned
+// entry is passed over, a referenced one has its bit cleared and is passed
+// over, and the first entry that is neither is the victim. An entry that is
+// used between two turns of the hand is never evicted, so the entries that
+// are read or written the most stay in the database, much like LRU but
+// without moving anything on a hit. A new entry starts with its bit clear, so
+// a burst of new registers does not push out the ones in use.
+//
+// The reference bits are kept apart from the pinned flags so the lock free
+// readers can set them without touching anything the writers change. The
+// other calls are made by the database writers.
+
+//mark an entry as used since the hand last passed it
+void dbEvictTouch(const dbEntry_t *entry);
+//pin or unpin an entry, a pinned entry is never the victim
+void dbEvictPin(const dbEntry_t *entry, bool pinned);
+bool dbEvictPinned(const dbEntry_t *entry);
+//clear the bits of an entry leaving the database
+void dbEvictForget(const dbEntry_t *entry);
+//the entry to evict, NULL if the database is empty or every entry is pinned
+dbEntry_t *dbEvictVictim();
+
+#endif
@@ -0,0 +1,124 @@
+//time to live of the database entries, see dbExpiry.h
+#include "cyhal.h"
+#include "dbExpiry.h"
+
+// The timers link the pool entries with 16 bit indexes, or 32 bit ones for a
+// pool too large for those
+#if dbPoolSize < 0xFFFF
+typedef uint16_t dbTimerLink_t;
+#define dbExpiryNone (0xFFFF)
+#else
+typedef uint32_t dbTimerLink_t;
+#define dbExpiryNone (0xFFFFFFFFu)
+#endif
+
+// The timer of pool entry n is dbTimers[n], linked into its slot in both
+// directions so it can be cancelled without a search
+typedef struct {
+	uint32_t due;      // second it expires
+	uint16_t seconds;  // time to live it was given, 0 when not armed
+	dbTimerLink_t next;
+	dbTimerLink_t prev;
+} dbTimer_t;
+
+static dbTimer_t dbTimers[dbPoolSize];
+static dbTimerLink_t dbWheel[dbExpirySlots]; // first timer of each slot
+static uint32_t dbWheelNext = 0;        // the next second dbExpiryRun looks at
+static uint32_t dbArmed = 0;
+static bool dbWheelReady = false;
+
+// dbExpiryInit:
+// Empty the wheel the first time it is used
+static void dbExpiryInit(){
+	if(!dbWheelReady){
+		for(uint32_t i = 0; i < dbExpirySlots; i++){
+			dbWheel[i] = dbExpiryNone;
+		}
+		dbWheelReady = true;
+	}
+}
+
+// dbExpiryUnlink:
+// Take timer n off its slot
+static void dbExpiryUnlink(uint32_t n){
+	dbTimer_t *timer = &dbTimers[n];
+	if(timer->prev == dbExpiryNone){
+		dbWheel[timer->due & (dbExpirySlots - 1)] = timer->next;
+	}
+	else{
+		dbTimers[timer->prev].next = timer->next;
+	}
+	if(timer->next != dbExpiryNone){
+		dbTimers[timer->next].prev = timer->prev;
+	}
+	timer->seconds = 0;
+	dbArmed--;
+}
+
+// dbExpiryArm:
+// Cancel the timer of an entry and start it again if seconds is not 0
+void dbExpiryArm(const dbEntry_t *entry, uint32_t seconds){
+	uint32_t n = dbPoolIndex(entry);
+	dbTimer_t *timer = &dbTimers[n];
+
+	dbExpiryInit();
+	if(timer->seconds != 0){
+		dbExpiryUnlink(n);
+	}
+	if(seconds == 0){
+		return;
+	}
+	if(seconds > dbExpiryMaxSeconds){
+		seconds = dbExpiryMaxSeconds;
+	}
+
+	// dbWheelNext has not been run yet, so due is never in a slot already passed
+	timer->due = dbWheelNext + seconds;
+	timer->seconds = (uint16_t)seconds;
+	dbTimerLink_t *slot = &dbWheel[timer->due & (dbExpirySlots - 1)];
+	timer->prev = dbExpiryNone;
+	timer->next = *slot;
+	if(*slot != dbExpiryNone){
+		dbTimers[*slot].prev = (dbTimerLink_t)n;
+	}
+	*slot = (dbTimerLink_t)n;
+	dbArmed++;
+}
+
+uint32_t dbExpirySeconds(const dbEntry_t *entry){
+	return dbTimers[dbPoolIndex(entry)].seconds;
+}
+
+// dbExpiryRun:
+// Walk the slots of the seconds up to now. After a long gap every slot is
+// due, so no slot is walked more than once a call.
+uint32_t dbExpiryRun(uint32_t now, void (*expired)(dbEntry_t *entry)){
+	uint32_t count = 0;
+
+	dbExpiryInit();
+	if((int32_t)(now - dbWheelNext) < 0){
+		return 0;
+	}
+	uint32_t steps = now - dbWheelNext + 1;
+	if(steps > dbExpirySlots){
+		steps = dbExpirySlots;
+	}
+	for(uint32_t second = dbWheelNext; steps > 0; second++, steps--){
+		dbTimerLink_t n = dbWheel[second & (dbExpirySlots - 1)];
+		while(n != dbExpiryNone){
+			dbTimerLink_t next = dbTimers[n].next;
+			if((int32_t)(now - dbTimers[n].due) >= 0){
+				dbExpiryUnlink(n);
+				expired(dbPoolEntry(n));
+				count++;
+			}
+			n = next;
+		}
+	}
+	dbWheelNext = now + 1;
+	return count;
+}
+
+uint32_t dbExpiryArmed(){
+	return dbArmed;
+}
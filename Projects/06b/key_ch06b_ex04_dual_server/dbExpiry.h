@@ -0,0 +1,35 @@
+#ifndef DBEXPIRY_H_
+#define DBEXPIRY_H_
+
+#include "cyhal.h"
+#include "linkedList.h"
+
+// Time to live of the database entries, a hashed timer wheel.
+//
+// An entry with a TTL is on the list of slot (due % dbExpirySlots) of the
+// wheel, where due is the second it expires. Arming or cancelling a timer
+// links or unlinks it in O(1), the timers are kept next to the entry pool so
+// there is nothing to allocate. dbExpiryRun walks one slot for every second
+// that has passed and expires the timers of that slot that are due, a timer
+// that is more than a turn of the wheel away is passed over until its turn
+// comes, so a tick only looks at the timers that hash to its slot.
+//
+// Times are in whole seconds, counted by the caller from when it started.
+// The caller serializes the calls, they are made under the database lock.
+#ifndef dbExpirySlots
+#define dbExpirySlots (64) // power of 2, one second each
+#endif
+
+// Longest time to live, it is kept in 16 bits
+#define dbExpiryMaxSeconds (0xFFFF)
+
+//give entry a time to live from the current second, 0 cancels it
+void dbExpiryArm(const dbEntry_t *entry, uint32_t seconds);
+//the time to live entry was last given, 0 if it has none
+uint32_t dbExpirySeconds(const dbEntry_t *entry);
+//expire the entries due by second now, expired is called for each once its timer is gone
+uint32_t dbExpiryRun(uint32_t now, void (*expired)(dbEntry_t *entry));
+//number of entries with a time to live
+uint32_t dbExpiryArmed();
+
+#endif
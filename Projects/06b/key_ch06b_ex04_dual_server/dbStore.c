@@ -0,0 +1,339 @@
+//persistence of the register database, see dbStore.h
+#include "cyhal.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "dbStore.h"
+#include "dbExpiry.h"
+#include "dbEvict.h"
+#include <string.h>
+
+#define dbStoreMagic (0x32534244u) // "DBS2"
+
+// The generation byte of a record keeps the dbChange kind in its top bits
+#define dbStoreKindShift (6)
+#define dbStoreGenerationMask ((1u << dbStoreKindShift) - 1)
+
+// Header at the start of a snapshot
+typedef struct {
+	uint32_t magic;
+	uint32_t generation; // incremented by every snapshot
+	uint32_t count;      // records after the header
+	uint32_t check;      // dbStoreCheck of the entries
+} dbStoreHeader_t;
+
+// Layout of the region
+static uint32_t dbStoreLogStart = 0; // offset of the first log page
+static uint8_t dbStoreErased = 0;    // value of an erased byte, to pad the pages
+static uint32_t dbStoreLogPages = 0; // pages in the log
+
+// The current snapshot and its generation
+static uint32_t dbStoreArea = 0;
+static uint32_t dbStoreGeneration = 0;
+
+// The log page being filled. Records before dbStoreFill are in the page.
+static uint8_t dbStorePage[dbStorePageSize];
+static uint32_t dbStoreLogPage = 0;
+static uint32_t dbStoreFill = 0;
+static bool dbStorePending = false;
+
+static dbStoreStats_t dbStoreStats;
+
+// dbStoreCheck:
+// FNV-1a hash of a buffer, continuing from hash
+static uint32_t dbStoreCheck(uint32_t hash, const uint8_t *data, uint32_t length){
+	while(length--){
+		hash ^= *data++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// dbStoreEncode:
+// Write a change of an entry as a record of the current generation
+static void dbStoreEncode(const dbEntry_t *entry, uint32_t change, uint8_t *record){
+	uint32_t value = entry->value;
+	if(change == dbChangeDelete){
+		value = 0;
+	}
+	else if(change == dbChangeExpiry){
+		value = dbExpirySeconds(entry);
+	}
+	else if(change == dbChangePin){
+		value = dbEvictPinned(entry);
+	}
+	record[0] = (uint8_t)entry->deviceId;
+	record[1] = (uint8_t)(entry->deviceId >> 8);
+	record[2] = (uint8_t)entry->regId;
+	record[3] = (uint8_t)((dbStoreGeneration & dbStoreGenerationMask) | (change << dbStoreKindShift));
+	record[4] = (uint8_t)value;
+	record[5] = (uint8_t)(value >> 8);
+	uint32_t check = dbStoreCheck(2166136261u, record, 6);
+	record[6] = (uint8_t)check;
+	record[7] = (uint8_t)(check >> 8);
+}
+
+// dbStoreDecode:
+// Read a record, returns false if it is not a record of the current
+// generation (erased, torn or left over from before the last snapshot). For
+// a time to live or pin record the value is the time to live or the flag.
+static bool dbStoreDecode(const uint8_t *record, dbEntry_t *entry, uint32_t *change){
+	uint32_t check = dbStoreCheck(2166136261u, record, 6);
+	if(record[6] != (uint8_t)check || record[7] != (uint8_t)(check >> 8) ||
+	   (record[3] & dbStoreGenerationMask) != (dbStoreGeneration & dbStoreGenerationMask)){
+		return false;
+	}
+	*change = record[3] >> dbStoreKindShift;
+	entry->deviceId = (uint32_t)(record[0] | (record[1] << 8));
+	entry->regId = record[2];
+	entry->value = (uint32_t)(record[4] | (record[5] << 8));
+	entry->next = NULL;
+	return true;
+}
+
+// dbStoreWrite:
+// Write a page to the backend and count it
+static bool dbStoreWrite(uint32_t offset, const uint8_t *page){
+	dbStoreStats.bytesWritten += dbStorePageSize;
+	return dbStoreBackend.write(offset, page);
+}
+
+// dbStoreLoad:
+// Make a recovered change to the database, the same way the server does
+static void dbStoreLoad(dbEntry_t *head, dbEntry_t *receive, uint32_t change){
+	if(change == dbChangeDelete){
+		dbFree(dbDelete(head, receive));
+	}
+	else if(change == dbChangeExpiry || change == dbChangePin){
+		dbEntry_t *entry = dbFind(head, receive);
+		if(entry != NULL && change == dbChangeExpiry){
+			dbSetExpiry(entry, receive->value);
+		}
+		else if(entry != NULL){
+			dbSetPinned(entry, receive->value != 0);
+		}
+	}
+	else if(dbFind(head, receive) != NULL){
+		dbSetValue(head, receive); // only the value is copied
+	}
+	else if(dbGetCount(head) < dbGetMax()){
+		dbEntry_t *entry = dbAlloc();
+		if(entry != NULL){
+			memcpy(entry, receive, sizeof(dbEntry_t));
+			dbSetValue(head, entry);
+		}
+	}
+}
+
+// dbStoreEraseLog:
+// Erase the log pages up to and including the page being filled
+static void dbStoreEraseLog(){
+	for(uint32_t i = 0; i <= dbStoreLogPage && i < dbStoreLogPages; i++){
+		dbStoreBackend.erase(dbStoreLogStart + i * dbStorePageSize);
+	}
+	dbStoreLogPage = 0;
+	dbStoreFill = 0;
+	memset(dbStorePage, dbStoreErased, sizeof(dbStorePage));
+}
+
+// dbStoreSnapshotPut:
+// Add a record to the snapshot being written, the page is written when it is
+// full or when entry is NULL
+static void dbStoreSnapshotPut(uint32_t base, dbStoreHeader_t *header, const dbEntry_t *entry, uint32_t change){
+	uint32_t offset = (header->count * dbStoreRecordSize) % dbStorePageSize;
+	if(entry != NULL){
+		dbStoreEncode(entry, change, &dbStorePage[offset]);
+		header->count++;
+		offset += dbStoreRecordSize;
+	}
+	if((entry != NULL && offset == dbStorePageSize) || (entry == NULL && offset != 0)){
+		uint32_t page = 1 + (header->count * dbStoreRecordSize - 1) / dbStorePageSize;
+		header->check = dbStoreCheck(header->check, dbStorePage, offset ? offset : dbStorePageSize);
+		dbStoreWrite(base + page * dbStorePageSize, dbStorePage);
+		memset(dbStorePage, dbStoreErased, sizeof(dbStorePage));
+	}
+}
+
+// dbStoreSnapshot:
+// Write the whole table to the other snapshot area and start a new log. The
+// header page is written last, until then the old snapshot and the old log
+// are still the valid state.
+static void dbStoreSnapshot(){
+	uint32_t base = (dbStoreArea ^ 1) * dbStoreSnapshotPages * dbStorePageSize;
+	uint32_t count = dbGetCount(NULL);
+	dbStoreHeader_t header = {
+		.magic = dbStoreMagic,
+		.generation = dbStoreGeneration + 1,
+		.count = 0,
+		.check = 2166136261u
+	};
+
+	// the entries are encoded with the new generation
+	dbStoreGeneration = header.generation;
+
+	memset(dbStorePage, dbStoreErased, sizeof(dbStorePage));
+	for(uint32_t i = 0; i < count; i++){
+		dbEntry_t *entry = dbGetIndexed(i);
+		dbStoreSnapshotPut(base, &header, entry, dbChangeValue);
+		if(dbExpirySeconds(entry) != 0){
+			dbStoreSnapshotPut(base, &header, entry, dbChangeExpiry);
+		}
+		if(dbEvictPinned(entry)){
+			dbStoreSnapshotPut(base, &header, entry, dbChangePin);
+		}
+	}
+	dbStoreSnapshotPut(base, &header, NULL, dbChangeValue);
+
+	memcpy(dbStorePage, &header, sizeof(header));
+	dbStoreWrite(base, dbStorePage);
+	dbStoreArea ^= 1;
+	dbStoreStats.snapshots++;
+
+	// the records in the log are all in the snapshot now
+	dbStoreEraseLog();
+}
+
+// dbStoreAppend:
+// Called by the database after every change, the caller holds off the other
+// writers. Full pages are written right away, a partly filled one waits for
+// dbStoreFlush.
+static void dbStoreAppend(const dbEntry_t *entry, uint32_t change){
+	dbStoreEncode(entry, change, &dbStorePage[dbStoreFill]);
+	dbStoreFill += dbStoreRecordSize;
+	dbStorePending = true;
+	dbStoreStats.loggedRecords++;
+	dbStoreStats.bytesLogged += dbStoreRecordSize;
+
+	if(dbStoreFill == dbStorePageSize){
+		dbStoreFlush();
+		if(dbStoreLogPage + 1 < dbStoreLogPages){
+			dbStoreLogPage++;
+			dbStoreFill = 0;
+			memset(dbStorePage, dbStoreErased, sizeof(dbStorePage));
+		}
+		else{
+			dbStoreSnapshot(); // the log is full
+		}
+	}
+}
+
+// dbStoreFlush:
+// Write the page being filled, an erase and a program of the whole page.
+// Rewriting a partly filled page again later is the cost of group commit, it
+// shows up in bytesWritten.
+void dbStoreFlush(){
+	if(dbStorePending){
+		dbStoreWrite(dbStoreLogStart + dbStoreLogPage * dbStorePageSize, dbStorePage);
+		dbStoreStats.flushes++;
+		dbStorePending = false;
+	}
+}
+
+bool dbStoreDirty(){
+	return dbStorePending;
+}
+
+const dbStoreStats_t *dbStoreGetStats(){
+	return &dbStoreStats;
+}
+
+// dbStoreReadHeader:
+// Read the header of a snapshot area, returns false if it is not a complete
+// snapshot
+static bool dbStoreReadHeader(uint32_t area, dbStoreHeader_t *header){
+	uint32_t base = area * dbStoreSnapshotPages * dbStorePageSize;
+	if(!dbStoreBackend.read(base, header, sizeof(*header)) || header->magic != dbStoreMagic || header->count > dbStoreSnapshotRecords){
+		return false;
+	}
+	// the entries must match the check, a torn snapshot has no header yet but
+	// an old header may be left in front of newer entries
+	uint32_t check = 2166136261u;
+	for(uint32_t done = 0; done < header->count * dbStoreRecordSize; done += dbStorePageSize){
+		uint32_t length = header->count * dbStoreRecordSize - done;
+		if(length > dbStorePageSize){
+			length = dbStorePageSize;
+		}
+		if(!dbStoreBackend.read(base + dbStorePageSize + done, dbStorePage, length)){
+			return false;
+		}
+		check = dbStoreCheck(check, dbStorePage, length);
+	}
+	return check == header->check;
+}
+
+// dbStoreRecover:
+// Load the newest complete snapshot, then replay the log records of its
+// generation. The log ends at the first record that is not.
+bool dbStoreRecover(dbEntry_t *head){
+	TickType_t start = xTaskGetTickCount();
+	uint32_t size;
+	dbStoreHeader_t header[2];
+	bool valid[2];
+
+	if(!dbStoreBackend.open(&size, &dbStoreErased) || size < (2 * dbStoreSnapshotPages + 2) * dbStorePageSize){
+		return false;
+	}
+	dbStoreLogStart = 2 * dbStoreSnapshotPages * dbStorePageSize;
+	dbStoreLogPages = (size - dbStoreLogStart) / dbStorePageSize;
+
+	valid[0] = dbStoreReadHeader(0, &header[0]);
+	valid[1] = dbStoreReadHeader(1, &header[1]);
+	if(!valid[0] && !valid[1]){
+		// nothing stored yet, start with an empty snapshot and log
+		dbStoreArea = 1;
+		dbStoreGeneration = 0;
+		dbStoreLogPage = dbStoreLogPages - 1; // erase the whole log
+		dbStoreSnapshot();
+		dbStoreStats.recoveryTicks = xTaskGetTickCount() - start;
+		dbSetLogger(dbStoreAppend);
+		return true;
+	}
+	dbStoreArea = (valid[1] && (!valid[0] || header[1].generation > header[0].generation)) ? 1 : 0;
+	dbStoreGeneration = header[dbStoreArea].generation;
+
+	// the snapshot entries, in order
+	uint32_t base = (dbStoreArea * dbStoreSnapshotPages + 1) * dbStorePageSize;
+	dbEntry_t receive;
+	uint32_t change;
+	for(uint32_t i = 0; i < header[dbStoreArea].count; i++){
+		if((i * dbStoreRecordSize) % dbStorePageSize == 0){
+			dbStoreBackend.read(base + i * dbStoreRecordSize, dbStorePage, dbStorePageSize);
+		}
+		if(dbStoreDecode(&dbStorePage[(i * dbStoreRecordSize) % dbStorePageSize], &receive, &change)){
+			dbStoreLoad(head, &receive, change);
+			dbStoreStats.recoveredEntries++;
+		}
+	}
+
+	// the log, the page the log ends in stays in dbStorePage to be filled
+	dbStoreLogPage = 0;
+	dbStoreFill = 0;
+	bool end = false;
+	while(!end){
+		dbStoreBackend.read(dbStoreLogStart + dbStoreLogPage * dbStorePageSize, dbStorePage, dbStorePageSize);
+		for(dbStoreFill = 0; dbStoreFill < dbStorePageSize; dbStoreFill += dbStoreRecordSize){
+			if(!dbStoreDecode(&dbStorePage[dbStoreFill], &receive, &change)){
+				end = true;
+				break;
+			}
+			dbStoreLoad(head, &receive, change);
+			dbStoreStats.replayedRecords++;
+		}
+		if(!end){
+			if(dbStoreLogPage + 1 < dbStoreLogPages){
+				dbStoreLogPage++;
+			}
+			else{
+				dbStoreSnapshot(); // the log was left full
+				end = true;
+			}
+		}
+	}
+	if(dbStoreFill < dbStorePageSize){
+		// clear whatever is after the end of the log in this page
+		memset(&dbStorePage[dbStoreFill], dbStoreErased, dbStorePageSize - dbStoreFill);
+	}
+
+	dbStoreStats.recoveryTicks = xTaskGetTickCount() - start;
+	dbSetLogger(dbStoreAppend);
+	return true;
+}
@@ -0,0 +1,82 @@
+#ifndef DBSTORE_H_
+#define DBSTORE_H_
+
+#include "cyhal.h"
+#include "linkedList.h"
+
+// Persistence of the register database.
+//
+// Every change to the database is appended to a write log. Appends are
+// collected in a page buffer, a page is written when it fills and a partly
+// filled one when dbStoreFlush is called, so a burst of writes costs a single
+// page write (group commit). Every page write is an erase and a program of
+// the whole page. When the log is full the whole table is written as a
+// snapshot and the log starts over (compaction). At startup dbStoreRecover
+// loads the newest snapshot and replays the log written after it.
+//
+// A change is durable once its page is full or the dbStoreFlush after it
+// returns. The server flushes every TCP_SERVER_DB_SYNC_MS, so a reset can
+// lose the changes of that long even though their clients got a reply.
+//
+// The region of the backend is laid out in pages as
+//  snapshot A | snapshot B | log
+// The two snapshots are used in turn so the previous one is still valid
+// until the new one is complete.
+//
+// Records are 8 bytes so deviceId and value are stored as 16 bits and regId
+// as 8 bits, the range of the AWEP commands. A record is one of the
+// dbChange kinds: a value, a delete, or a time to live or pinned flag in
+// place of the value. A snapshot holds a value record for every entry and a
+// time to live and a pin record after each entry that has them. The time an entry had left is not stored,
+// after a restart it gets its whole time to live again.
+
+// Size of a backend page. Pages are the unit of every backend write.
+#ifndef dbStorePageSize
+#define dbStorePageSize (512)
+#endif
+
+// Size of one log record or snapshot entry
+#define dbStoreRecordSize (8)
+
+// Most records in a snapshot, every entry with a time to live and pinned
+#define dbStoreSnapshotRecords (3 * dbMax)
+
+// Pages of one snapshot, a header page then the records
+#define dbStoreSnapshotPages (1 + (dbStoreSnapshotRecords * dbStoreRecordSize + dbStorePageSize - 1) / dbStorePageSize)
+
+// A storage backend. Offsets are from the start of the region the backend
+// owns, writes and erases are a whole page at a page aligned offset. A write
+// erases the page before it programs it.
+typedef struct {
+	bool (*open)(uint32_t *size, uint8_t *erased); // size of the region in bytes, value of an erased byte
+	bool (*read)(uint32_t offset, void *data, uint32_t length);
+	bool (*write)(uint32_t offset, const void *page);
+	bool (*erase)(uint32_t offset);
+} dbStoreBackend_t;
+
+// The backend of this build, internal flash on target or a file on a host
+// (see dbStoreBackend.c)
+extern const dbStoreBackend_t dbStoreBackend;
+
+// Counters for the cost of persistence
+typedef struct {
+	uint32_t recoveryTicks;    // time taken by dbStoreRecover
+	uint32_t recoveredEntries; // records loaded from the snapshot
+	uint32_t replayedRecords;  // log records replayed after the snapshot
+	uint32_t loggedRecords;    // changes appended to the log
+	uint32_t flushes;          // log pages written, full or group commit
+	uint32_t snapshots;        // compactions
+	uint32_t bytesLogged;      // size of the appended records
+	uint32_t bytesWritten;     // bytes written to the backend, logs and snapshots
+} dbStoreStats_t;
+
+//open the backend and rebuild the database from it, returns false if there is no storage
+bool dbStoreRecover(dbEntry_t *head);
+//write the buffered log records, the caller must hold off the database writers
+void dbStoreFlush();
+//true if there are log records that are not written yet
+bool dbStoreDirty();
+//persistence counters
+const dbStoreStats_t *dbStoreGetStats();
+
+#endif
@@ -0,0 +1,106 @@
+//storage backends of the register database persistence
+//
+// On target the database is kept in the last flash block reported by the
+// HAL, the work flash on PSoC 6. Defining DB_STORE_FILE as a file name
+// builds the file backend instead, for running the server on a host.
+#include "cyhal.h"
+#include "dbStore.h"
+#include <string.h>
+
+#ifndef DB_STORE_FILE
+
+static cyhal_flash_t dbFlash;
+static uint32_t dbFlashBase;
+
+static bool dbFlashOpen(uint32_t *size, uint8_t *erased){
+	cyhal_flash_info_t info;
+	if(cyhal_flash_init(&dbFlash) != CY_RSLT_SUCCESS){
+		return false;
+	}
+	cyhal_flash_get_info(&dbFlash, &info);
+	const cyhal_flash_block_info_t *block = &info.blocks[info.block_count - 1];
+	if(block->page_size != dbStorePageSize){
+		return false;
+	}
+	dbFlashBase = block->start_address;
+	*size = block->size;
+	*erased = block->erase_value; // 0x00 on PSoC 6
+	return true;
+}
+
+static bool dbFlashRead(uint32_t offset, void *data, uint32_t length){
+	return cyhal_flash_read(&dbFlash, dbFlashBase + offset, (uint8_t *)data, length) == CY_RSLT_SUCCESS;
+}
+
+static bool dbFlashWrite(uint32_t offset, const void *page){
+	// erases the page and programs it
+	return cyhal_flash_write(&dbFlash, dbFlashBase + offset, (const uint32_t *)page) == CY_RSLT_SUCCESS;
+}
+
+static bool dbFlashErase(uint32_t offset){
+	return cyhal_flash_erase(&dbFlash, dbFlashBase + offset) == CY_RSLT_SUCCESS;
+}
+
+const dbStoreBackend_t dbStoreBackend = {
+	.open = dbFlashOpen,
+	.read = dbFlashRead,
+	.write = dbFlashWrite,
+	.erase = dbFlashErase
+};
+
+#else
+
+#include <stdio.h>
+
+// Size of the file, the same as the PSoC 6 work flash
+#ifndef DB_STORE_FILE_SIZE
+#define DB_STORE_FILE_SIZE (32 * 1024)
+#endif
+
+// Value of an erased byte, the same as the PSoC 6 flash
+#ifndef DB_STORE_FILE_ERASED
+#define DB_STORE_FILE_ERASED (0x00)
+#endif
+
+static FILE *dbFile;
+
+static bool dbFileOpen(uint32_t *size, uint8_t *erased){
+	dbFile = fopen(DB_STORE_FILE, "r+b");
+	if(dbFile == NULL){
+		dbFile = fopen(DB_STORE_FILE, "w+b"); // first run
+	}
+	*size = DB_STORE_FILE_SIZE;
+	*erased = DB_STORE_FILE_ERASED;
+	return dbFile != NULL;
+}
+
+static bool dbFileRead(uint32_t offset, void *data, uint32_t length){
+	memset(data, DB_STORE_FILE_ERASED, length); // past the end of the file reads as erased
+	if(fseek(dbFile, offset, SEEK_SET) != 0){
+		return false;
+	}
+	fread(data, 1, length, dbFile);
+	return true;
+}
+
+static bool dbFileWrite(uint32_t offset, const void *page){
+	if(fseek(dbFile, offset, SEEK_SET) != 0 || fwrite(page, 1, dbStorePageSize, dbFile) != dbStorePageSize){
+		return false;
+	}
+	return fflush(dbFile) == 0;
+}
+
+static bool dbFileErase(uint32_t offset){
+	uint8_t page[dbStorePageSize];
+	memset(page, DB_STORE_FILE_ERASED, sizeof(page));
+	return dbFileWrite(offset, page);
+}
+
+const dbStoreBackend_t dbStoreBackend = {
+	.open = dbFileOpen,
+	.read = dbFileRead,
+	.write = dbFileWrite,
+	.erase = dbFileErase
+};
+
+#endif
@@ -0,0 +1,979 @@
+/* Host build: load generator for the AWEP servers.
+ *
+ * Each thread keeps one connection to the server (a new one per command
+ * with -P legacy) and sends R and W commands to keys chosen uniformly or
+ * with a Zipf skew. Latency is kept in a log-linear histogram per thread
+ * and the merged percentiles are printed at the end of each phase.
+ *
+ * Closed loop (the default) keeps -q commands in flight per connection and
+ * sends the next one as soon as a reply comes back. Open loop (-R) sends on
+ * a fixed schedule and measures each command from the time it should have
+ * been sent, so a stalled server shows up in the latency instead of just
+ * slowing the client down.
+ *
+ * With -s the key space is filled in steps, one phase per step, to show how
+ * the server copes as the database fills toward dbMax.
+ *
+ * With -w one more connection watches every register of the first devices
+ * while the threads run, and counts the events pushed to it. A reply that
+ * takes longer than BENCH_REPLY_TIMEOUT_S counts as a stall and the bench
+ * exits with 1, so a server that stops answering under writes to watched
+ * registers fails instead of hanging.
+ *
+ *   ./awep_bench -t 4 -d 10 -r 90 -z 0.99
+ *   ./awep_bench -P binary -q 16 -k 400 -s 4
+ *   ./awep_bench -P legacy -p 27708 -R 200
+ *   ./awep_bench -P batch -r 0 -w 8 -k 128
+ *
+ * Built by `make awep_bench`, TLS (-T) needs `make TLS=1`. */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "binaryProtocol.h"
+
+#ifdef HOST_TLS
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+#endif
+
+/* Most threads and commands in flight per connection. */
+#define BENCH_MAX_THREADS   (64)
+#define BENCH_MAX_DEPTH     (64)
+/* Commands in one M batch, as TCP_BATCH_MAX_ENTRIES on the server. */
+#define BENCH_MAX_BATCH     (32)
+/* Watches of one session, as TCP_SESSION_MAX_WATCHES on the server. */
+#define BENCH_MAX_WATCHES   (8)
+/* Longest wait for a reply before the server counts as stalled. */
+#define BENCH_REPLY_TIMEOUT_S (5)
+
+/* Latency histogram: 32 linear sub-buckets per power of 2 microseconds,
+ * which keeps every value within about 3%. */
+#define HIST_SUB_BITS       (5)
+#define HIST_SUB_COUNT      (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS        ((32 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef enum {
+	protoFramed,     // 2 byte length framed ASCII, one session
+	protoBatch,      // framed M commands of -b entries
+	protoBinary,     // binaryProtocol.h frames
+	protoLegacy      // one printable command per connection, as the 06a servers
+} benchProto_t;
+
+typedef enum {
+	resultOk,        // A
+	resultNotFound,  // N
+	resultFull,      // F
+	resultError,     // X, or a reply that makes no sense
+	resultCount
+} benchResult_t;
+
+static const char *protoNames[] = {"framed", "batch", "binary", "legacy"};
+
+static const char *resultNames[resultCount] = {"ok", "not_found", "full", "error"};
+
+typedef struct {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} benchHist_t;
+
+typedef struct {
+	const char *host;
+	const char *port;
+	benchProto_t proto;
+	int threads;
+	int depth;           // closed loop commands in flight
+	int batch;           // entries per M command
+	double duration;     // seconds per phase
+	int readPercent;
+	double theta;        // Zipf skew, 0 is uniform
+	uint32_t keys;
+	int steps;           // fill phases, 1 measures the whole key space once
+	double rate;         // open loop commands per second over all threads, 0 is closed loop
+	int watches;         // devices watched by the watch connection, 0 for none
+	bool tls;
+	const char *caFile;
+	const char *certFile;
+	const char *keyFile;
+} benchConfig_t;
+
+static benchConfig_t config = {
+	.host = "127.0.0.1",
+	.port = "27708",
+	.proto = protoFramed,
+	.threads = 4,
+	.depth = 1,
+	.batch = 8,
+	.duration = 5.0,
+	.readPercent = 50,
+	.theta = 0.0,
+	.keys = 400,
+	.steps = 1,
+	.rate = 0.0,
+	.tls = false,
+};
+
+/* Key chooser for one phase, shared read only by the threads. */
+typedef struct {
+	uint32_t keys;
+	double theta;
+	double zetan;
+	double alpha;
+	double eta;
+	double halfPowTheta;
+} benchZipf_t;
+
+typedef struct {
+	int fd;
+#ifdef HOST_TLS
+	bool tls;
+	mbedtls_ssl_context ssl;
+#endif
+} benchConn_t;
+
+typedef struct {
+	int id;
+	pthread_t thread;
+	uint64_t random;
+	benchHist_t hist;
+	uint64_t commands;   // R and W, an M counts each of its entries
+	uint64_t results[resultCount];
+	uint64_t connectErrors;
+	uint64_t stalls;     // replies that took longer than BENCH_REPLY_TIMEOUT_S
+	benchConn_t conn;
+#ifdef HOST_TLS
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context drbg;
+	mbedtls_ssl_config sslConfig;
+#endif
+} benchThread_t;
+
+static benchThread_t threads[BENCH_MAX_THREADS];
+/* The -w connection, its commands count the E and O frames pushed to it and
+ * its results[resultOk] the registers in them. */
+static benchThread_t watcher;
+static benchZipf_t zipf;
+static atomic_bool running;
+static pthread_barrier_t startBarrier;
+
+#ifdef HOST_TLS
+static mbedtls_x509_crt caCert;
+static mbedtls_x509_crt clientCert;
+static mbedtls_pk_context clientKey;
+#endif
+
+static uint64_t nowNs(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t benchRandom(uint64_t *state){
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+static double benchUniform(uint64_t *state){
+	return (benchRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Gray et al. "Quickly generating billion-record synthetic databases", the
+ * same generator YCSB uses. theta 0.99 sends about half of the commands to
+ * 1% of a 400 key space. */
+static void zipfInit(benchZipf_t *z, uint32_t keys, double theta){
+	z->keys = keys;
+	z->theta = theta;
+	if(theta <= 0.0){
+		return;
+	}
+	double zeta2 = 1.0 + pow(0.5, theta);
+	z->zetan = 0.0;
+	for(uint32_t i = 1; i <= keys; i++){
+		z->zetan += 1.0 / pow((double)i, theta);
+	}
+	z->alpha = 1.0 / (1.0 - theta);
+	z->eta = (1.0 - pow(2.0 / keys, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+	z->halfPowTheta = pow(0.5, theta);
+}
+
+static uint32_t zipfNext(const benchZipf_t *z, uint64_t *state){
+	double u = benchUniform(state);
+	if(z->theta <= 0.0){
+		return (uint32_t)(u * z->keys);
+	}
+	double uz = u * z->zetan;
+	if(uz < 1.0){
+		return 0;
+	}
+	if(uz < 1.0 + z->halfPowTheta){
+		return 1;
+	}
+	uint32_t key = (uint32_t)(z->keys * pow(z->eta * u - z->eta + 1.0, z->alpha));
+	return (key < z->keys) ? key : z->keys - 1;
+}
+
+/* Keys are spread over devices of 16 registers each. */
+static void keyEntry(uint32_t key, uint32_t value, dbEntry_t *entry){
+	entry->deviceId = (key >> 4) & 0xFFFF;
+	entry->regId = key & 0x0F;
+	entry->value = value & 0xFFFF;
+	entry->next = NULL;
+}
+
+static uint32_t histIndex(uint64_t us){
+	if(us < HIST_SUB_COUNT){
+		return (uint32_t)us;
+	}
+	if(us > UINT32_MAX){
+		us = UINT32_MAX;
+	}
+	uint32_t shift = (31 - __builtin_clz((uint32_t)us)) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + (uint32_t)(us >> shift) - HIST_SUB_COUNT;
+}
+
+/* Upper edge of a bucket in microseconds */
+static uint64_t histValue(uint32_t index){
+	if(index < HIST_SUB_COUNT){
+		return index;
+	}
+	uint32_t shift = (index >> HIST_SUB_BITS) - 1;
+	uint64_t low = (uint64_t)((index & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT) << shift;
+	return low + (1ull << shift) - 1;
+}
+
+static void histRecord(benchHist_t *hist, uint64_t ns){
+	uint64_t us = ns / 1000;
+	hist->counts[histIndex(us)]++;
+	hist->total++;
+	if(us > hist->max){
+		hist->max = us;
+	}
+}
+
+static uint64_t histPercentile(const benchHist_t *hist, double percent){
+	if(hist->total == 0){
+		return 0;
+	}
+	uint64_t target = (uint64_t)ceil(hist->total * percent / 100.0);
+	uint64_t seen = 0;
+	for(uint32_t i = 0; i < HIST_BUCKETS; i++){
+		seen += hist->counts[i];
+		if(seen >= target){
+			uint64_t value = histValue(i);
+			return (value < hist->max) ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+/*******************************************************************************
+ * Connections
+ ******************************************************************************/
+
+static bool connOpen(benchThread_t *thread){
+	benchConn_t *conn = &thread->conn;
+	struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+	struct addrinfo *address;
+	if(getaddrinfo(config.host, config.port, &hints, &address) != 0){
+		return false;
+	}
+	conn->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+	if(conn->fd < 0 || connect(conn->fd, address->ai_addr, address->ai_addrlen) != 0){
+		if(conn->fd >= 0){
+			close(conn->fd);
+		}
+		freeaddrinfo(address);
+		return false;
+	}
+	freeaddrinfo(address);
+	int one = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct timeval timeout = {.tv_sec = BENCH_REPLY_TIMEOUT_S, .tv_usec = 0};
+	setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+#ifdef HOST_TLS
+	conn->tls = config.tls;
+	if(conn->tls){
+		mbedtls_ssl_init(&conn->ssl);
+		if(mbedtls_ssl_setup(&conn->ssl, &thread->sslConfig) != 0){
+			close(conn->fd);
+			return false;
+		}
+		mbedtls_ssl_set_bio(&conn->ssl, &conn->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+		int ret;
+		while((ret = mbedtls_ssl_handshake(&conn->ssl)) != 0){
+			if(ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE){
+				mbedtls_ssl_free(&conn->ssl);
+				close(conn->fd);
+				return false;
+			}
+		}
+	}
+#endif
+	return true;
+}
+
+static void connClose(benchConn_t *conn){
+#ifdef HOST_TLS
+	if(conn->tls){
+		mbedtls_ssl_close_notify(&conn->ssl);
+		mbedtls_ssl_free(&conn->ssl);
+	}
+#endif
+	close(conn->fd);
+	conn->fd = -1;
+}
+
+static bool connWrite(benchConn_t *conn, const uint8_t *data, size_t length){
+	while(length > 0){
+		ssize_t sent;
+#ifdef HOST_TLS
+		if(conn->tls){
+			sent = mbedtls_ssl_write(&conn->ssl, data, length);
+			if(sent == MBEDTLS_ERR_SSL_WANT_WRITE){
+				continue;
+			}
+		}
+		else
+#endif
+		sent = send(conn->fd, data, length, MSG_NOSIGNAL);
+		if(sent <= 0){
+			if(sent < 0 && errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+/* Read up to length bytes, returns how many or <= 0 when the connection is gone */
+static ssize_t connReadSome(benchConn_t *conn, uint8_t *data, size_t length){
+	for(;;){
+		ssize_t got;
+#ifdef HOST_TLS
+		if(conn->tls){
+			got = mbedtls_ssl_read(&conn->ssl, data, length);
+			if(got == MBEDTLS_ERR_SSL_WANT_READ){
+				continue;
+			}
+			if(got == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY){
+				return 0;
+			}
+			return got;
+		}
+#endif
+		got = recv(conn->fd, data, length, 0);
+		if(got < 0 && errno == EINTR){
+			continue;
+		}
+		return got;
+	}
+}
+
+static bool connRead(benchConn_t *conn, uint8_t *data, size_t length){
+	while(length > 0){
+		ssize_t got = connReadSome(conn, data, length);
+		if(got <= 0){
+			return false;
+		}
+		data += got;
+		length -= got;
+	}
+	return true;
+}
+
+/*******************************************************************************
+ * Commands
+ ******************************************************************************/
+
+static benchResult_t resultOf(char code){
+	switch(code){
+		case 'A': return resultOk;
+		case 'N': return resultNotFound;
+		case 'F': return resultFull;
+		default:  return resultError;
+	}
+}
+
+/* Build one R or W in ASCII, returns its length */
+static int asciiCommand(benchThread_t *thread, char *text, uint32_t forceKey, bool forceWrite){
+	uint32_t key = forceWrite ? forceKey : zipfNext(&zipf, &thread->random);
+	bool write = forceWrite || (int)(benchRandom(&thread->random) % 100) >= config.readPercent;
+	dbEntry_t entry;
+	keyEntry(key, (uint32_t)benchRandom(&thread->random), &entry);
+	if(write){
+		return sprintf(text, "W%04X%02X%04X", (unsigned)entry.deviceId, (unsigned)entry.regId, (unsigned)entry.value);
+	}
+	return sprintf(text, "R%04X%02X", (unsigned)entry.deviceId, (unsigned)entry.regId);
+}
+
+/* Build the next request for the protocol in use. Returns its length, and
+ * how many R/W commands it carries in *commands. */
+static size_t buildRequest(benchThread_t *thread, uint8_t *request, int *commands){
+	if(config.proto == protoBinary){
+		uint32_t key = zipfNext(&zipf, &thread->random);
+		bool write = (int)(benchRandom(&thread->random) % 100) >= config.readPercent;
+		dbEntry_t entry;
+		keyEntry(key, (uint32_t)benchRandom(&thread->random), &entry);
+		binEncode(write ? 'W' : 'R', &entry, request);
+		*commands = 1;
+		return binFrameLength;
+	}
+	if(config.proto == protoLegacy){
+		*commands = 1;
+		return asciiCommand(thread, (char *)request, 0, false);
+	}
+	char *text = (char *)&request[2];
+	size_t length;
+	if(config.proto == protoBatch){
+		text[0] = 'M';
+		length = 1;
+		for(int i = 0; i < config.batch; i++){
+			length += asciiCommand(thread, &text[length], 0, false);
+		}
+		*commands = config.batch;
+	}
+	else{
+		length = asciiCommand(thread, text, 0, false);
+		*commands = 1;
+	}
+	request[0] = (uint8_t)(length >> 8);
+	request[1] = (uint8_t)length;
+	return length + 2;
+}
+
+/* Read one reply and count its results */
+static bool readReply(benchThread_t *thread){
+	uint8_t reply[2 + 1 + BENCH_MAX_BATCH * 11 + 64];
+
+	if(config.proto == protoBinary){
+		if(!connRead(&thread->conn, reply, binFrameLength)){
+			return false;
+		}
+		binCommand_t command;
+		if(!binDecode(reply, &command)){
+			thread->results[resultError]++;
+			return false; // out of sync, give up on the connection
+		}
+		thread->results[resultOf((char)command.command)]++;
+		return true;
+	}
+
+	if(config.proto == protoLegacy){
+		// a fixed size packet with the reply text at the front, then a close
+		size_t have = 0;
+		while(have < 11){
+			ssize_t got = connReadSome(&thread->conn, &reply[have], sizeof(reply) - have);
+			if(got <= 0){
+				break;
+			}
+			have += got;
+		}
+		thread->results[have > 0 ? resultOf((char)reply[0]) : resultError]++;
+		return have > 0;
+	}
+
+	if(!connRead(&thread->conn, reply, 2)){
+		return false;
+	}
+	size_t length = ((size_t)reply[0] << 8) | reply[1];
+	if(length == 0 || length > sizeof(reply) - 2 || !connRead(&thread->conn, &reply[2], length)){
+		return false;
+	}
+	if(config.proto == protoBatch && reply[2] == 'M'){
+		for(size_t offset = 3; offset + 11 <= length + 2; offset += 11){
+			thread->results[resultOf((char)reply[offset])]++;
+		}
+	}
+	else{
+		thread->results[resultOf((char)reply[2])]++;
+	}
+	return true;
+}
+
+/* One command on its own connection, for -P legacy */
+static bool legacyCommand(benchThread_t *thread, uint64_t startNs){
+	uint8_t request[32];
+	int commands;
+	size_t length = buildRequest(thread, request, &commands);
+	if(!connOpen(thread)){
+		thread->connectErrors++;
+		return false;
+	}
+	bool ok = connWrite(&thread->conn, request, length) && readReply(thread);
+	connClose(&thread->conn);
+	histRecord(&thread->hist, nowNs() - startNs);
+	thread->commands += commands;
+	return ok;
+}
+
+/* Closed loop: keep config.depth requests in flight on one connection. */
+static void runClosed(benchThread_t *thread){
+	uint64_t sentAt[BENCH_MAX_DEPTH];
+	int commandsOf[BENCH_MAX_DEPTH];
+	uint8_t request[2 + 1 + BENCH_MAX_BATCH * 11];
+
+	if(config.proto == protoLegacy){
+		while(atomic_load_explicit(&running, memory_order_relaxed)){
+			legacyCommand(thread, nowNs());
+		}
+		return;
+	}
+
+	while(atomic_load_explicit(&running, memory_order_relaxed)){
+		if(!connOpen(thread)){
+			thread->connectErrors++;
+			usleep(10000);
+			continue;
+		}
+		// replies come back in order, so the in flight requests are a ring
+		uint32_t head = 0;
+		uint32_t tail = 0;
+		bool ok = true;
+		while(ok && atomic_load_explicit(&running, memory_order_relaxed)){
+			while(ok && head - tail < (uint32_t)config.depth){
+				size_t length = buildRequest(thread, request, &commandsOf[head % BENCH_MAX_DEPTH]);
+				sentAt[head % BENCH_MAX_DEPTH] = nowNs();
+				ok = connWrite(&thread->conn, request, length);
+				head++;
+			}
+			if(ok && (ok = readReply(thread))){
+				histRecord(&thread->hist, nowNs() - sentAt[tail % BENCH_MAX_DEPTH]);
+				thread->commands += commandsOf[tail % BENCH_MAX_DEPTH];
+				tail++;
+			}
+		}
+		// drain what is still in flight so it is not lost from the counts
+		while(ok && tail != head && (ok = readReply(thread))){
+			histRecord(&thread->hist, nowNs() - sentAt[tail % BENCH_MAX_DEPTH]);
+			thread->commands += commandsOf[tail % BENCH_MAX_DEPTH];
+			tail++;
+		}
+		if(!ok && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			thread->stalls++;
+		}
+		connClose(&thread->conn);
+	}
+}
+
+/* Open loop: send on a fixed schedule and charge every wait to the command
+ * that should have gone out, which avoids coordinated omission. */
+static void runOpen(benchThread_t *thread){
+	uint64_t interval = (uint64_t)(1e9 * config.threads / config.rate);
+	uint64_t next = nowNs() + benchRandom(&thread->random) % interval; // spread the threads out
+	uint8_t request[2 + 1 + BENCH_MAX_BATCH * 11];
+	bool connected = false;
+
+	while(atomic_load_explicit(&running, memory_order_relaxed)){
+		uint64_t now = nowNs();
+		if(now < next){
+			struct timespec pause = {.tv_sec = 0, .tv_nsec = (long)(next - now)};
+			if(pause.tv_nsec >= 1000000000){
+				pause.tv_sec = pause.tv_nsec / 1000000000;
+				pause.tv_nsec %= 1000000000;
+			}
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		if(config.proto == protoLegacy){
+			legacyCommand(thread, next);
+		}
+		else{
+			if(!connected && !(connected = connOpen(thread))){
+				thread->connectErrors++;
+				next += interval;
+				continue;
+			}
+			int commands;
+			size_t length = buildRequest(thread, request, &commands);
+			if(connWrite(&thread->conn, request, length) && readReply(thread)){
+				histRecord(&thread->hist, nowNs() - next);
+				thread->commands += commands;
+			}
+			else{
+				if(errno == EAGAIN || errno == EWOULDBLOCK){
+					thread->stalls++;
+				}
+				connClose(&thread->conn);
+				connected = false;
+			}
+		}
+		next += interval;
+	}
+	if(connected){
+		connClose(&thread->conn);
+	}
+}
+
+static void *benchThread(void *arg){
+	benchThread_t *thread = arg;
+	pthread_barrier_wait(&startBarrier);
+	if(config.rate > 0.0){
+		runOpen(thread);
+	}
+	else{
+		runClosed(thread);
+	}
+	return NULL;
+}
+
+/* The -w connection: watch every register of devices 0 to config.watches - 1,
+ * which hold the first 16 keys each, then count the frames pushed until the
+ * phase ends. The socket timeout wakes it up when nothing changes. */
+static void *watchThread(void *arg){
+	benchThread_t *thread = arg;
+	uint8_t frame[2 + 1 + 32 * 10];
+	bool ok = connOpen(thread);
+	if(!ok){
+		thread->connectErrors++;
+	}
+	for(int device = 0; ok && device < config.watches; device++){
+		int length = sprintf((char *)&frame[2], "S%04X", (unsigned)device);
+		frame[0] = 0;
+		frame[1] = (uint8_t)length;
+		ok = connWrite(&thread->conn, frame, length + 2) && connRead(&thread->conn, frame, 2) &&
+		     frame[1] == length && connRead(&thread->conn, &frame[2], length) && frame[2] == 'S';
+	}
+	pthread_barrier_wait(&startBarrier);
+	while(ok && atomic_load_explicit(&running, memory_order_relaxed)){
+		ssize_t got = connReadSome(&thread->conn, frame, 2);
+		if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			continue; // no changes for a while
+		}
+		size_t length = ((size_t)frame[0] << 8) | frame[1];
+		ok = (got == 2 || (got == 1 && connRead(&thread->conn, &frame[1], 1))) &&
+		     length > 0 && length <= sizeof(frame) - 2 && connRead(&thread->conn, &frame[2], length);
+		if(ok){
+			thread->commands++;
+			if(frame[2] == 'E'){
+				thread->results[resultOk] += (length - 1) / 10;
+			}
+			else if(frame[2] == 'O'){
+				thread->results[resultFull]++;
+			}
+			else{
+				thread->results[resultError]++;
+			}
+		}
+		else if(errno == EAGAIN || errno == EWOULDBLOCK){
+			thread->stalls++; // a frame cut short
+		}
+	}
+	if(thread->conn.fd >= 0){
+		connClose(&thread->conn);
+	}
+	return NULL;
+}
+
+/* Write keys first to last once, on one connection */
+static bool fillKeys(uint32_t first, uint32_t last){
+	benchThread_t *thread = &threads[0];
+	uint8_t request[32];
+	if(first >= last){
+		return true;
+	}
+	if(config.proto == protoLegacy){
+		for(uint32_t key = first; key < last; key++){
+			if(!connOpen(thread)){
+				return false;
+			}
+			size_t length = asciiCommand(thread, (char *)request, key, true);
+			bool ok = connWrite(&thread->conn, request, length) && readReply(thread);
+			connClose(&thread->conn);
+			if(!ok){
+				return false;
+			}
+		}
+	}
+	else{
+		if(!connOpen(thread)){
+			return false;
+		}
+		for(uint32_t key = first; key < last; key++){
+			size_t length;
+			if(config.proto == protoBinary){
+				dbEntry_t entry;
+				keyEntry(key, key, &entry);
+				binEncode('W', &entry, request);
+				length = binFrameLength;
+			}
+			else{
+				// a plain framed W, a batch session takes those too
+				length = asciiCommand(thread, (char *)&request[2], key, true);
+				request[0] = 0;
+				request[1] = (uint8_t)length;
+				length += 2;
+			}
+			bool ok = connWrite(&thread->conn, request, length) && readReply(thread);
+			if(!ok){
+				connClose(&thread->conn);
+				return false;
+			}
+		}
+		connClose(&thread->conn);
+	}
+	memset(thread->results, 0, sizeof(thread->results));
+	return true;
+}
+
+/* Run one phase, returns the number of stalls */
+static uint64_t runPhase(uint32_t keys){
+	zipfInit(&zipf, keys, config.theta);
+	for(int i = 0; i < config.threads; i++){
+		benchThread_t *thread = &threads[i];
+		memset(&thread->hist, 0, sizeof(thread->hist));
+		memset(thread->results, 0, sizeof(thread->results));
+		thread->commands = 0;
+		thread->connectErrors = 0;
+		thread->stalls = 0;
+	}
+	memset(watcher.results, 0, sizeof(watcher.results));
+	watcher.commands = 0;
+	watcher.connectErrors = 0;
+	watcher.stalls = 0;
+
+	atomic_store(&running, true);
+	pthread_barrier_init(&startBarrier, NULL, config.threads + 1 + (config.watches > 0 ? 1 : 0));
+	for(int i = 0; i < config.threads; i++){
+		pthread_create(&threads[i].thread, NULL, benchThread, &threads[i]);
+	}
+	if(config.watches > 0){
+		pthread_create(&watcher.thread, NULL, watchThread, &watcher);
+	}
+	pthread_barrier_wait(&startBarrier);
+	uint64_t start = nowNs();
+	usleep((useconds_t)(config.duration * 1e6));
+	atomic_store(&running, false);
+	for(int i = 0; i < config.threads; i++){
+		pthread_join(threads[i].thread, NULL);
+	}
+	if(config.watches > 0){
+		pthread_join(watcher.thread, NULL);
+	}
+	double elapsed = (nowNs() - start) / 1e9;
+	pthread_barrier_destroy(&startBarrier);
+
+	benchHist_t *hist = calloc(1, sizeof(*hist));
+	uint64_t commands = 0;
+	uint64_t results[resultCount] = {0};
+	uint64_t stalls = 0;
+	uint64_t connectErrors = watcher.connectErrors;
+	for(int i = 0; i < config.threads; i++){
+		benchThread_t *thread = &threads[i];
+		for(uint32_t b = 0; b < HIST_BUCKETS; b++){
+			hist->counts[b] += thread->hist.counts[b];
+		}
+		hist->total += thread->hist.total;
+		if(thread->hist.max > hist->max){
+			hist->max = thread->hist.max;
+		}
+		commands += thread->commands;
+		for(int r = 0; r < resultCount; r++){
+			results[r] += thread->results[r];
+		}
+		connectErrors += thread->connectErrors;
+		stalls += thread->stalls;
+	}
+	stalls += watcher.stalls;
+
+	printf("%6u %10.0f %10.0f %8llu %8llu %8llu %8llu %8llu",
+		(unsigned)keys, commands / elapsed, hist->total / elapsed,
+		(unsigned long long)histPercentile(hist, 50.0),
+		(unsigned long long)histPercentile(hist, 99.0),
+		(unsigned long long)histPercentile(hist, 99.9),
+		(unsigned long long)hist->max,
+		(unsigned long long)connectErrors);
+	for(int r = 0; r < resultCount; r++){
+		printf(" %s=%llu", resultNames[r], (unsigned long long)results[r]);
+	}
+	if(config.watches > 0){
+		printf(" events=%llu registers=%llu overflows=%llu",
+			(unsigned long long)watcher.commands, (unsigned long long)watcher.results[resultOk],
+			(unsigned long long)watcher.results[resultFull]);
+	}
+	if(stalls > 0){
+		printf(" stalls=%llu", (unsigned long long)stalls);
+	}
+	printf("\n");
+	fflush(stdout);
+	free(hist);
+	return stalls;
+}
+
+#ifdef HOST_TLS
+static bool tlsSetup(void){
+	mbedtls_x509_crt_init(&caCert);
+	mbedtls_x509_crt_init(&clientCert);
+	mbedtls_pk_init(&clientKey);
+	if(config.caFile && mbedtls_x509_crt_parse_file(&caCert, config.caFile) != 0){
+		fprintf(stderr, "cannot load %s\n", config.caFile);
+		return false;
+	}
+	if(config.certFile && mbedtls_x509_crt_parse_file(&clientCert, config.certFile) != 0){
+		fprintf(stderr, "cannot load %s\n", config.certFile);
+		return false;
+	}
+	if(config.keyFile && mbedtls_pk_parse_keyfile(&clientKey, config.keyFile, NULL) != 0){
+		fprintf(stderr, "cannot load %s\n", config.keyFile);
+		return false;
+	}
+	for(int i = 0; i <= config.threads; i++){
+		benchThread_t *thread = (i < config.threads) ? &threads[i] : &watcher; // and the -w connection
+		mbedtls_entropy_init(&thread->entropy);
+		mbedtls_ctr_drbg_init(&thread->drbg);
+		mbedtls_ssl_config_init(&thread->sslConfig);
+		if(mbedtls_ctr_drbg_seed(&thread->drbg, mbedtls_entropy_func, &thread->entropy, NULL, 0) != 0 ||
+		   mbedtls_ssl_config_defaults(&thread->sslConfig, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0){
+			return false;
+		}
+		mbedtls_ssl_conf_rng(&thread->sslConfig, mbedtls_ctr_drbg_random, &thread->drbg);
+		if(config.caFile){
+			mbedtls_ssl_conf_authmode(&thread->sslConfig, MBEDTLS_SSL_VERIFY_REQUIRED);
+			mbedtls_ssl_conf_ca_chain(&thread->sslConfig, &caCert, NULL);
+		}
+		else{
+			mbedtls_ssl_conf_authmode(&thread->sslConfig, MBEDTLS_SSL_VERIFY_NONE);
+		}
+		if(config.certFile && config.keyFile &&
+		   mbedtls_ssl_conf_own_cert(&thread->sslConfig, &clientCert, &clientKey) != 0){
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+static void usage(const char *name){
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -h host      server address (127.0.0.1)\n"
+		"  -p port      server port (27708)\n"
+		"  -P proto     framed, batch, binary or legacy (framed)\n"
+		"  -t threads   connections, one per thread (4)\n"
+		"  -q depth     closed loop commands in flight per connection (1)\n"
+		"  -b entries   commands per M with -P batch (8)\n"
+		"  -d seconds   length of each phase (5)\n"
+		"  -r percent   reads, the rest are writes (50)\n"
+		"  -z theta     Zipf skew of the keys, 0 is uniform, below 1 (0)\n"
+		"  -k keys      size of the key space (400)\n"
+		"  -s steps     fill the key space in this many phases (1)\n"
+		"  -R rate      open loop commands per second over all threads\n"
+		"  -w devices   watch every register of this many devices meanwhile (0)\n"
+		"  -T           use TLS\n"
+		"  -A file      CA certificate to check the server with\n"
+		"  -C file      client certificate\n"
+		"  -K file      client private key\n",
+		name);
+}
+
+int main(int argc, char **argv){
+	int option;
+	while((option = getopt(argc, argv, "h:p:P:t:q:b:d:r:z:k:s:R:w:TA:C:K:")) != -1){
+		switch(option){
+			case 'h': config.host = optarg; break;
+			case 'p': config.port = optarg; break;
+			case 'P':
+				if(strcmp(optarg, "framed") == 0) config.proto = protoFramed;
+				else if(strcmp(optarg, "batch") == 0) config.proto = protoBatch;
+				else if(strcmp(optarg, "binary") == 0) config.proto = protoBinary;
+				else if(strcmp(optarg, "legacy") == 0) config.proto = protoLegacy;
+				else { usage(argv[0]); return 1; }
+				break;
+			case 't': config.threads = atoi(optarg); break;
+			case 'q': config.depth = atoi(optarg); break;
+			case 'b': config.batch = atoi(optarg); break;
+			case 'd': config.duration = atof(optarg); break;
+			case 'r': config.readPercent = atoi(optarg); break;
+			case 'z': config.theta = atof(optarg); break;
+			case 'k': config.keys = (uint32_t)strtoul(optarg, NULL, 0); break;
+			case 's': config.steps = atoi(optarg); break;
+			case 'R': config.rate = atof(optarg); break;
+			case 'w': config.watches = atoi(optarg); break;
+			case 'T': config.tls = true; break;
+			case 'A': config.caFile = optarg; break;
+			case 'C': config.certFile = optarg; break;
+			case 'K': config.keyFile = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(config.threads < 1 || config.threads > BENCH_MAX_THREADS ||
+	   config.depth < 1 || config.depth > BENCH_MAX_DEPTH ||
+	   config.batch < 1 || config.batch > BENCH_MAX_BATCH ||
+	   config.keys < 1 || config.keys > 0x100000 || config.steps < 1 ||
+	   config.theta < 0.0 || config.theta >= 1.0 ||
+	   config.readPercent < 0 || config.readPercent > 100 ||
+	   config.watches < 0 || config.watches > BENCH_MAX_WATCHES ||
+	   (config.watches > 0 && config.proto == protoLegacy)){
+		usage(argv[0]);
+		return 1;
+	}
+	if(config.proto == protoLegacy || config.rate > 0.0){
+		config.depth = 1; // one command at a time on these
+	}
+#ifdef HOST_TLS
+	if(config.tls && !tlsSetup()){
+		return 1;
+	}
+#else
+	if(config.tls){
+		fprintf(stderr, "built without HOST_TLS, rebuild with make TLS=1\n");
+		return 1;
+	}
+#endif
+
+	for(int i = 0; i < config.threads; i++){
+		threads[i].id = i;
+		threads[i].random = 0x9E3779B97F4A7C15ull * (i + 1);
+		threads[i].conn.fd = -1;
+	}
+	watcher.conn.fd = -1;
+
+	printf("# %s:%s proto=%s threads=%d depth=%d reads=%d%% theta=%.2f %s\n",
+		config.host, config.port, protoNames[config.proto], config.threads, config.depth,
+		config.readPercent, config.theta,
+		config.rate > 0.0 ? "open loop" : "closed loop");
+	printf("%6s %10s %10s %8s %8s %8s %8s %8s results\n",
+		"keys", "cmds/s", "reqs/s", "p50_us", "p99_us", "p999_us", "max_us", "conn_err");
+
+	uint32_t filled = 0;
+	uint64_t stalls = 0;
+	for(int step = 1; step <= config.steps; step++){
+		uint32_t keys = (uint32_t)(((uint64_t)config.keys * step) / config.steps);
+		if(keys == 0){
+			continue;
+		}
+		// write the new keys first so the reads of this phase find them
+		if(!fillKeys(filled, keys)){
+			fprintf(stderr, "filling keys %u to %u failed\n", (unsigned)filled, (unsigned)keys);
+			return 1;
+		}
+		filled = keys;
+		stalls += runPhase(keys);
+	}
+	return (stalls > 0) ? 1 : 0;
+}
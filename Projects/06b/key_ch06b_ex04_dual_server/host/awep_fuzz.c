@@ -0,0 +1,69 @@
+/* Host build: libFuzzer target of the AWEP command parser.
+ *
+ * Each input is one command as it arrives in a frame, not NUL terminated.
+ * It goes through textParse on its own and then through processCommand
+ * with the reply buffer of a framed session and, when it is short enough,
+ * with the buffers of a one-shot command. tcp_server.c is included so the
+ * static processCommand can be called, the database is the server's own,
+ * without storage. AddressSanitizer catches reads past the input and
+ * writes past the reply, the checks below catch replies that are not NUL
+ * terminated or start with a letter the server never sends.
+ *
+ *   make awep_fuzz
+ *   ./awep_fuzz -max_len=400 corpus/
+ *
+ * Needs clang, libFuzzer is not part of gcc. */
+#include "tcp_server.c"
+
+// main_host.c is left out for the main of libFuzzer
+cy_wcm_ip_address_t ip_address;
+
+static bool fuzzReady = false;
+
+/* The reply must end within its buffer and be one the clients know. */
+static void fuzzCheckReply(const char *reply, uint32_t size){
+	if(memchr(reply, '\0', size) == NULL){
+		__builtin_trap();
+	}
+	if(strchr("AXLM", reply[0]) == NULL || reply[0] == '\0'){
+		__builtin_trap();
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+	tcp_session_t *session = &sessions[0];
+	textCommand_t command;
+	char oneShot[MAX_TCP_RECV_BUFFER_SIZE];
+
+	if(!fuzzReady){
+		tcp_server_init();
+		fuzzReady = true;
+	}
+	// longer frames are refused before they are parsed
+	if(size > TCP_SESSION_BUFFER_SIZE - TCP_SESSION_FRAME_HEADER){
+		return 0;
+	}
+
+	// a command that parses has the length of its letter
+	if(textParse((const char *)data, size, &command) == textOk &&
+	   (size != textCommandLength(command.command) || command.command != (char)data[0])){
+		__builtin_trap();
+	}
+
+	session->socket = (cy_socket_t)session; // in use, never sent to
+	session->log[0] = '\0';
+	session->logLength = 0;
+
+	char *reply = (char *)&session->reply[TCP_SESSION_FRAME_HEADER];
+	uint32_t replySize = sizeof(session->reply) - TCP_SESSION_FRAME_HEADER;
+	memset(reply, 0xA5, replySize);
+	processCommand((const char *)data, size, reply, replySize, session);
+	fuzzCheckReply(reply, replySize);
+
+	if(size <= MAX_TCP_RECV_BUFFER_SIZE){
+		memset(oneShot, 0xA5, sizeof(oneShot));
+		processCommand((const char *)data, size, oneShot, sizeof(oneShot), session);
+		fuzzCheckReply(oneShot, sizeof(oneShot));
+	}
+	return 0;
+}
@@ -0,0 +1,112 @@
+/* Host build: microbenchmark of the register lookups in linkedList.c.
+ *
+ * Fills the database to dbMax registers, 16 to a device as awep_bench does,
+ * then times dbFind of registers that are there and of registers that are
+ * not, dbRead, and dbSetValue of a register that is already there, in a
+ * random order so the table is not walked in cache order.
+ *
+ * dbMax and dbTableBits are fixed when linkedList.c is compiled, so there is
+ * one binary per size:
+ *
+ *   ./awep_lookup_bench_400
+ *   ./awep_lookup_bench_4096 1000000
+ *   ./awep_lookup_bench_65536
+ *
+ * Built by `make awep_lookup_bench`. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "linkedList.h"
+
+/* Keys looked up, a random order of the registers in the database. */
+static uint32_t benchKeys[dbMax];
+
+static dbEntry_t benchHead = { .next = NULL, .deviceId = 0, .regId = 0 };
+
+static void keyEntry(uint32_t key, uint32_t value, dbEntry_t *entry){
+	entry->deviceId = (key >> 4) & 0xFFFF;
+	entry->regId = key & 0x0F;
+	entry->value = value & 0xFFFF;
+	entry->next = NULL;
+}
+
+static uint64_t benchRandom(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static double benchSeconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void benchReport(const char *name, uint32_t count, double seconds){
+	printf("%-22s %8.1f ns/op\n", name, seconds * 1e9 / count);
+}
+
+int main(int argc, char **argv){
+	uint32_t count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 10000000;
+	uint64_t random = 0x9E3779B97F4A7C15ull;
+	volatile uint32_t sink = 0;
+	dbEntry_t entry;
+
+	/* in key order, so every insert goes at the end of the sorted index */
+	for(uint32_t key = 0; key < dbMax; key++){
+		dbEntry_t *stored = dbAlloc();
+		keyEntry(key, key, stored);
+		dbWriteBegin();
+		dbSetValue(&benchHead, stored);
+		dbWriteEnd();
+		benchKeys[key] = key;
+	}
+	if(dbGetCount(&benchHead) != dbMax){
+		printf("filled %u of %u registers\n", (unsigned)dbGetCount(&benchHead), (unsigned)dbMax);
+		return 1;
+	}
+	for(uint32_t i = dbMax - 1; i > 0; i--){
+		uint32_t j = benchRandom(&random) % (i + 1);
+		uint32_t key = benchKeys[i];
+		benchKeys[i] = benchKeys[j];
+		benchKeys[j] = key;
+	}
+	printf("%u registers, %u slots\n", (unsigned)dbMax, (unsigned)dbTableSize);
+
+	double start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		keyEntry(benchKeys[i % dbMax], 0, &entry);
+		sink += (dbFind(&benchHead, &entry) != NULL);
+	}
+	benchReport("dbFind hit", count, benchSeconds() - start);
+
+	/* the deviceIds past the last one in the database */
+	start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		keyEntry(benchKeys[i % dbMax] + dbMax + 16, 0, &entry);
+		sink += (dbFind(&benchHead, &entry) != NULL);
+	}
+	benchReport("dbFind miss", count, benchSeconds() - start);
+
+	start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		uint32_t value;
+		keyEntry(benchKeys[i % dbMax], 0, &entry);
+		sink += dbRead(entry.deviceId, entry.regId, &value) + value;
+	}
+	benchReport("dbRead", count, benchSeconds() - start);
+
+	start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		keyEntry(benchKeys[i % dbMax], i, &entry);
+		dbWriteBegin();
+		dbSetValue(&benchHead, &entry);
+		dbWriteEnd();
+	}
+	benchReport("dbSetValue update", count, benchSeconds() - start);
+
+	return (sink == 0xFFFFFFFF);
+}
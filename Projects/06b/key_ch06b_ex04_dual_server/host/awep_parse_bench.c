@@ -0,0 +1,118 @@
+/* Host build: microbenchmark of the AWEP text parser.
+ *
+ * Times the decode of R, W, T and L commands and the format of a register
+ * reply with textProtocol.c against the isxdigit/sscanf/sprintf code the
+ * server used before, and checks that both give the same answers.
+ *
+ *   ./awep_parse_bench            10 million of each
+ *   ./awep_parse_bench 1000000
+ *
+ * Built by `make awep_parse_bench`. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+#include "textProtocol.h"
+
+static const char *benchCommands[] = {
+	"R00A101", "W00A1017F3C", "T1234AB00FF003C", "L00A10101",
+	"Rzz0000", "W00A1",
+};
+#define BENCH_COMMAND_COUNT (sizeof(benchCommands) / sizeof(benchCommands[0]))
+
+/* The old decode: strlen, isxdigit over the command, then sscanf. */
+static textStatus_t sscanfParse(const char *text, textCommand_t *command){
+	uint32_t length = strlen(text);
+	if(length > textMaxCommandLength){
+		return textIllegalLength;
+	}
+	if(length == 0 || textCommandLength(text[0]) != length){
+		return textIllegalCommand;
+	}
+	for(uint32_t i = 1; i < length; i++){
+		if(!isxdigit((int)text[i])){
+			return textIllegalCharacter;
+		}
+	}
+	unsigned int deviceId, regId, value = 0, extra = 0;
+	switch(text[0]){
+	case 'R': sscanf(&text[1], "%4x%2x", &deviceId, &regId); break;
+	case 'W': sscanf(&text[1], "%4x%2x%4x", &deviceId, &regId, &value); break;
+	case 'T': sscanf(&text[1], "%4x%2x%4x%4x", &deviceId, &regId, &value, &extra); break;
+	default:  sscanf(&text[1], "%4x%2x%2x", &deviceId, &regId, &extra); break;
+	}
+	command->command = text[0];
+	command->entry.deviceId = deviceId;
+	command->entry.regId = regId;
+	command->entry.value = value;
+	command->extra = extra;
+	return textOk;
+}
+
+static double benchSeconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void benchReport(const char *name, uint32_t count, double seconds){
+	printf("%-22s %8.1f ns/op\n", name, seconds * 1e9 / count);
+}
+
+int main(int argc, char **argv){
+	uint32_t count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 10000000;
+	textCommand_t a, b;
+	volatile uint32_t sink = 0;
+	char out[32];
+
+	/* both decoders have to agree before the times mean anything */
+	for(uint32_t i = 0; i < BENCH_COMMAND_COUNT; i++){
+		const char *text = benchCommands[i];
+		textStatus_t fast = textParse(text, strlen(text), &a);
+		textStatus_t slow = sscanfParse(text, &b);
+		if(fast != slow || (fast == textOk && (a.entry.deviceId != b.entry.deviceId ||
+				a.entry.regId != b.entry.regId || a.entry.value != b.entry.value || a.extra != b.extra))){
+			printf("mismatch on %s\n", text);
+			return 1;
+		}
+	}
+
+	uint32_t lengths[BENCH_COMMAND_COUNT];
+	for(uint32_t i = 0; i < BENCH_COMMAND_COUNT; i++){
+		lengths[i] = strlen(benchCommands[i]);
+	}
+
+	double start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		uint32_t n = i % BENCH_COMMAND_COUNT;
+		sink += textParse(benchCommands[n], lengths[n], &a) + a.entry.regId;
+	}
+	benchReport("textParse", count, benchSeconds() - start);
+
+	start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		uint32_t n = i % BENCH_COMMAND_COUNT;
+		sink += sscanfParse(benchCommands[n], &b) + b.entry.regId;
+	}
+	benchReport("isxdigit+sscanf", count, benchSeconds() - start);
+
+	dbEntry_t entry = { .deviceId = 0x00A1, .regId = 0x01, .value = 0x7F3C, .next = NULL };
+	start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		entry.value = i & 0xFFFF;
+		sink += *textPutEntry(out, &entry);
+	}
+	benchReport("textPutEntry", count, benchSeconds() - start);
+
+	start = benchSeconds();
+	for(uint32_t i = 0; i < count; i++){
+		entry.value = i & 0xFFFF;
+		sink += sprintf(out, "%04X%02X%04X", (unsigned int)entry.deviceId, (unsigned int)entry.regId, (unsigned int)entry.value);
+	}
+	benchReport("sprintf", count, benchSeconds() - start);
+
+	return (sink == 0xFFFFFFFF);
+}
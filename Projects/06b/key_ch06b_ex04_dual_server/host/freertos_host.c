@@ -0,0 +1,84 @@
+/* Host build: the FreeRTOS calls of the server on POSIX threads. */
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+struct hostTask {
+	pthread_t thread;
+	void (*code)(void *);
+	void *arg;
+};
+
+struct hostMutex {
+	pthread_mutex_t mutex;
+};
+
+static void *hostTaskStart(void *arg){
+	struct hostTask *task = arg;
+	task->code(task->arg);
+	return NULL;
+}
+
+BaseType_t xTaskCreate(void (*code)(void *), const char *name, uint32_t stackDepth, void *arg, UBaseType_t priority, TaskHandle_t *handle){
+	(void)name;
+	(void)stackDepth;
+	(void)priority;
+	struct hostTask *task = malloc(sizeof(*task));
+	if(task == NULL){
+		return pdFAIL;
+	}
+	task->code = code;
+	task->arg = arg;
+	if(pthread_create(&task->thread, NULL, hostTaskStart, task) != 0){
+		free(task);
+		return pdFAIL;
+	}
+	if(handle != NULL){
+		*handle = task;
+	}
+	return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks){
+	struct timespec delay = {
+		.tv_sec = ticks / 1000,
+		.tv_nsec = (long)(ticks % 1000) * 1000000L
+	};
+	while(nanosleep(&delay, &delay) != 0 && errno == EINTR){
+	}
+}
+
+TickType_t xTaskGetTickCount(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (TickType_t)(now.tv_sec * 1000u + now.tv_nsec / 1000000);
+}
+
+void vTaskStartScheduler(void){
+	for(;;){
+		vTaskDelay(1000);
+	}
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void){
+	struct hostMutex *mutex = malloc(sizeof(*mutex));
+	if(mutex != NULL){
+		pthread_mutex_init(&mutex->mutex, NULL);
+	}
+	return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks){
+	if(ticks == portMAX_DELAY){
+		return pthread_mutex_lock(&mutex->mutex) == 0 ? pdTRUE : pdFALSE;
+	}
+	return pthread_mutex_trylock(&mutex->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex){
+	return pthread_mutex_unlock(&mutex->mutex) == 0 ? pdTRUE : pdFALSE;
+}
@@ -0,0 +1,24 @@
+/* Host build: FreeRTOS types mapped onto POSIX threads, see freertos_host.c.
+ * The tick is 1 ms of CLOCK_MONOTONIC. */
+#ifndef HOST_FREERTOS_H_
+#define HOST_FREERTOS_H_
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef struct hostTask *TaskHandle_t;
+typedef struct hostMutex *SemaphoreHandle_t;
+
+#define pdTRUE                 (1)
+#define pdFALSE                (0)
+#define pdPASS                 (1)
+#define pdFAIL                 (0)
+#define portMAX_DELAY          (0xFFFFFFFFu)
+#define portTICK_PERIOD_MS     (1)
+#define configTICK_RATE_HZ     (1000)
+#define configMAX_PRIORITIES   (7)
+#define pdMS_TO_TICKS(ms)      ((TickType_t)(ms))
+
+#endif
@@ -0,0 +1 @@
+/* Host build: printf already goes to stdout. */
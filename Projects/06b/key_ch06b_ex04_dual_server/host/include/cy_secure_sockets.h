@@ -0,0 +1,78 @@
+/* Host build: the cy_secure_sockets API used by the server, implemented on
+ * BSD sockets and epoll in secure_sockets_host.c. */
+#ifndef HOST_CY_SECURE_SOCKETS_H_
+#define HOST_CY_SECURE_SOCKETS_H_
+
+#include "cyhal.h"
+
+typedef void *cy_socket_t;
+
+typedef enum {
+	CY_SOCKET_IP_VER_V4 = 4
+} cy_socket_ip_version_t;
+
+/* v4 is in network byte order, the same as lwIP */
+typedef struct {
+	cy_socket_ip_version_t version;
+	union {
+		uint32_t v4;
+	} ip;
+} cy_socket_ip_address_t;
+
+typedef struct {
+	uint16_t port;
+	cy_socket_ip_address_t ip_address;
+} cy_socket_sockaddr_t;
+
+typedef cy_rslt_t (*cy_socket_callback_t)(cy_socket_t socket_handle, void *arg);
+
+typedef struct {
+	cy_socket_callback_t callback;
+	void *arg;
+} cy_socket_opt_callback_t;
+
+typedef enum {
+	CY_SOCKET_TLS_VERIFY_NONE,
+	CY_SOCKET_TLS_VERIFY_OPTIONAL,
+	CY_SOCKET_TLS_VERIFY_REQUIRED
+} cy_socket_tls_auth_mode_t;
+
+#define CY_SOCKET_DOMAIN_AF_INET                 (0)
+#define CY_SOCKET_TYPE_STREAM                    (1)
+#define CY_SOCKET_IPPROTO_TCP                    (1)
+#define CY_SOCKET_IPPROTO_TLS                    (2)
+
+#define CY_SOCKET_SOL_SOCKET                     (1)
+#define CY_SOCKET_SOL_TLS                        (2)
+
+#define CY_SOCKET_SO_RCVTIMEO                    (1)
+#define CY_SOCKET_SO_CONNECT_REQUEST_CALLBACK    (2)
+#define CY_SOCKET_SO_RECEIVE_CALLBACK            (3)
+#define CY_SOCKET_SO_DISCONNECT_CALLBACK         (4)
+#define CY_SOCKET_SO_TLS_IDENTITY                (5)
+#define CY_SOCKET_SO_TLS_AUTH_MODE               (6)
+
+#define CY_SOCKET_FLAGS_NONE                     (0)
+
+#define CY_RSLT_MODULE_SECURE_SOCKETS_BASE       ((cy_rslt_t)0x10000u)
+#define CY_RSLT_MODULE_SECURE_SOCKETS_BADARG     (CY_RSLT_MODULE_SECURE_SOCKETS_BASE + 1)
+#define CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM      (CY_RSLT_MODULE_SECURE_SOCKETS_BASE + 2)
+#define CY_RSLT_MODULE_SECURE_SOCKETS_TIMEOUT    (CY_RSLT_MODULE_SECURE_SOCKETS_BASE + 3)
+#define CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED     (CY_RSLT_MODULE_SECURE_SOCKETS_BASE + 4)
+#define CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR (CY_RSLT_MODULE_SECURE_SOCKETS_BASE + 5)
+#define CY_RSLT_MODULE_SECURE_SOCKETS_TLS_ERROR  (CY_RSLT_MODULE_SECURE_SOCKETS_BASE + 6)
+#define CY_RSLT_MODULE_SECURE_SOCKETS_OPTION_NOT_SUPPORTED (CY_RSLT_MODULE_SECURE_SOCKETS_BASE + 7)
+
+cy_rslt_t cy_socket_init(void);
+cy_rslt_t cy_socket_create(int domain, int type, int protocol, cy_socket_t *handle);
+cy_rslt_t cy_socket_setsockopt(cy_socket_t handle, int level, int optname, const void *optval, uint32_t optlen);
+cy_rslt_t cy_socket_bind(cy_socket_t handle, cy_socket_sockaddr_t *address, uint32_t address_length);
+cy_rslt_t cy_socket_listen(cy_socket_t handle, int backlog);
+cy_rslt_t cy_socket_connect(cy_socket_t handle, cy_socket_sockaddr_t *address, uint32_t address_length);
+cy_rslt_t cy_socket_accept(cy_socket_t handle, cy_socket_sockaddr_t *address, uint32_t *address_length, cy_socket_t *socket);
+cy_rslt_t cy_socket_send(cy_socket_t handle, const void *buffer, uint32_t length, int flags, uint32_t *bytes_sent);
+cy_rslt_t cy_socket_recv(cy_socket_t handle, void *buffer, uint32_t length, int flags, uint32_t *bytes_received);
+cy_rslt_t cy_socket_disconnect(cy_socket_t handle, uint32_t timeout);
+cy_rslt_t cy_socket_delete(cy_socket_t handle);
+
+#endif
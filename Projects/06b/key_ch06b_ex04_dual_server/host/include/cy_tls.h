@@ -0,0 +1,10 @@
+/* Host build: TLS identities for the secure listener, on mbedTLS. */
+#ifndef HOST_CY_TLS_H_
+#define HOST_CY_TLS_H_
+
+#include "cyhal.h"
+
+cy_rslt_t cy_tls_create_identity(const char *certificate_data, const uint32_t certificate_len, const char *private_key, uint32_t private_key_len, void **tls_identity);
+cy_rslt_t cy_tls_load_global_root_ca_certificates(const char *trusted_ca_certificates, const uint32_t cert_length);
+
+#endif
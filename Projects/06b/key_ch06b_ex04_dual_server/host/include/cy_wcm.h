@@ -0,0 +1,9 @@
+/* Host build: only the address type, the host is already on the network. */
+#ifndef HOST_CY_WCM_H_
+#define HOST_CY_WCM_H_
+
+#include "cy_secure_sockets.h"
+
+typedef cy_socket_ip_address_t cy_wcm_ip_address_t;
+
+#endif
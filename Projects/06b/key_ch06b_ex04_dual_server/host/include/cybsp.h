@@ -0,0 +1,8 @@
+/* Host build: the board definitions the server uses. */
+#ifndef HOST_CYBSP_H_
+#define HOST_CYBSP_H_
+
+#define CYBSP_LED_STATE_ON   (0)
+#define CYBSP_LED_STATE_OFF  (1)
+
+#endif
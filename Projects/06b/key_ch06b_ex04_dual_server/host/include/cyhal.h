@@ -0,0 +1,21 @@
+/* Host build: the parts of the PSoC 6 HAL and device headers the server uses. */
+#ifndef HOST_CYHAL_H_
+#define HOST_CYHAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef uint32_t cy_rslt_t;
+typedef uint8_t uint8;
+
+#define CY_RSLT_SUCCESS ((cy_rslt_t)0u)
+
+/* A failed assert stops the host server instead of hanging the core. */
+#define CY_ASSERT(x) do{ if(!(x)){ fprintf(stderr, "CY_ASSERT failed %s:%d\n", __FILE__, __LINE__); abort(); } }while(0)
+
+#define __DMB() __sync_synchronize()
+
+#endif
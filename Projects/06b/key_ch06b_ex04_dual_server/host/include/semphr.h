@@ -0,0 +1,11 @@
+#ifndef HOST_SEMPHR_H_
+#define HOST_SEMPHR_H_
+
+#include "FreeRTOS.h"
+
+/* Only mutexes are used by the server, waiting for ever or not at all. */
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex);
+
+#endif
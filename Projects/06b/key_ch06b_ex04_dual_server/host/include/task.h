@@ -0,0 +1,13 @@
+#ifndef HOST_TASK_H_
+#define HOST_TASK_H_
+
+#include "FreeRTOS.h"
+
+/* Every task is a thread, the priority and stack depth are ignored. */
+BaseType_t xTaskCreate(void (*code)(void *), const char *name, uint32_t stackDepth, void *arg, UBaseType_t priority, TaskHandle_t *handle);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+/* Threads start running in xTaskCreate, this only waits for them. */
+void vTaskStartScheduler(void);
+
+#endif
@@ -0,0 +1,48 @@
+/* Host build: starts the AWEP server the way main.c does on target, minus
+ * the board, Wi-Fi and mDNS. The server listens on every interface. */
+#include "cyhal.h"
+#include <FreeRTOS.h>
+#include <task.h>
+#include "cy_secure_sockets.h"
+#include "cy_wcm.h"
+#include "tcp_server.h"
+#include "replication.h"
+
+/* IP address the server binds to, 0 is any */
+cy_wcm_ip_address_t ip_address;
+
+// args to pass to the two tasks. One task for secure, one for non-secure
+static bool security = true;
+static bool noSecurity = false;
+
+int main(void){
+
+	cy_rslt_t result;
+
+	result = cy_socket_init();
+	if(result != CY_RSLT_SUCCESS){
+		printf("Secure Socket initialization failed!\n");
+		return 1;
+	}
+
+	/* Initialize the resources shared by the server tasks. */
+	tcp_server_init();
+
+	/* Load the saved registers before the server tasks start. */
+	tcp_server_restore();
+
+	xTaskCreate(tcp_server_task, "non-secure network task", 0, &noSecurity, 1, NULL);
+#ifdef HOST_TLS
+	xTaskCreate(tcp_server_task, "secure Network task", 0, &security, 1, NULL);
+#else
+	(void)security;
+	printf("Built without HOST_TLS, only the non-secure port is served\n");
+#endif
+
+#ifdef TCP_REPLICATION_PEER
+	xTaskCreate(replication_task, "replication task", 0, NULL, 1, NULL);
+#endif
+
+	vTaskStartScheduler();
+	return 0;
+}
@@ -0,0 +1,513 @@
+/* Host build: cy_secure_sockets on BSD sockets.
+ *
+ * Like the library on target, one worker thread waits for socket events and
+ * runs the callbacks: connect on a listening socket that has a client
+ * waiting, receive on a client socket with data, disconnect when the client
+ * has closed. Accepted sockets take the callbacks and receive timeout of the
+ * listening socket.
+ *
+ * With HOST_TLS defined, CY_SOCKET_IPPROTO_TLS sockets use mbedTLS and the
+ * handshake is done in cy_socket_accept, as on target. */
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "cy_secure_sockets.h"
+#include "cy_tls.h"
+
+#ifdef HOST_TLS
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+#endif
+
+/* Most file descriptors the shim can track. */
+#define HOST_MAX_FD (1024)
+
+typedef struct {
+	int fd;
+	bool tls;
+	cy_socket_opt_callback_t connect;
+	cy_socket_opt_callback_t receive;
+	cy_socket_opt_callback_t disconnect;
+	uint32_t recvTimeout;              // ms, 0 waits for ever
+#ifdef HOST_TLS
+	void *identity;                    // listening socket
+	cy_socket_tls_auth_mode_t authMode;
+	mbedtls_ssl_config *config;        // listening socket, shared by its clients
+	mbedtls_ssl_context ssl;           // client socket
+#endif
+} hostSocket_t;
+
+/* The sockets by file descriptor, so an event for a socket that has just
+ * been deleted finds nothing. Held by the worker while it runs a callback
+ * and by cy_socket_delete. Recursive, as callbacks delete sockets. */
+static hostSocket_t *hostSockets[HOST_MAX_FD];
+static pthread_mutex_t hostLock;
+static int hostEpoll = -1;
+
+#ifdef HOST_TLS
+typedef struct {
+	mbedtls_x509_crt certificate;
+	mbedtls_pk_context key;
+} hostIdentity_t;
+
+static mbedtls_x509_crt hostRootCa;
+static bool hostRootCaLoaded = false;
+static mbedtls_entropy_context hostEntropy;
+static mbedtls_ctr_drbg_context hostDrbg;
+#endif
+
+/* hostBuffered:
+ * Data already read from the socket by TLS, which epoll cannot see */
+static bool hostBuffered(hostSocket_t *sock){
+#ifdef HOST_TLS
+	return sock->tls && mbedtls_ssl_get_bytes_avail(&sock->ssl) > 0;
+#else
+	(void)sock;
+	return false;
+#endif
+}
+
+/* hostWorker:
+ * Run the callbacks, one event at a time */
+static void *hostWorker(void *arg){
+	(void)arg;
+	for(;;){
+		struct epoll_event event;
+		if(epoll_wait(hostEpoll, &event, 1, -1) != 1){
+			continue;
+		}
+		pthread_mutex_lock(&hostLock);
+		int fd = event.data.fd;
+		hostSocket_t *sock = hostSockets[fd];
+		if(sock != NULL && sock->connect.callback != NULL){
+			sock->connect.callback(sock, sock->connect.arg);
+		}
+		else if(sock != NULL){
+			char peek;
+			if(!hostBuffered(sock) && recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == 0){
+				if(sock->disconnect.callback != NULL){
+					sock->disconnect.callback(sock, sock->disconnect.arg);
+				}
+			}
+			else if(sock->receive.callback != NULL){
+				do{
+					sock->receive.callback(sock, sock->receive.arg);
+				}while(hostSockets[fd] == sock && hostBuffered(sock));
+			}
+		}
+		pthread_mutex_unlock(&hostLock);
+	}
+	return NULL;
+}
+
+cy_rslt_t cy_socket_init(void){
+	pthread_mutexattr_t attributes;
+	pthread_t worker;
+
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&hostLock, &attributes);
+
+	hostEpoll = epoll_create1(0);
+	if(hostEpoll < 0){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+	}
+#ifdef HOST_TLS
+	mbedtls_entropy_init(&hostEntropy);
+	mbedtls_ctr_drbg_init(&hostDrbg);
+	if(mbedtls_ctr_drbg_seed(&hostDrbg, mbedtls_entropy_func, &hostEntropy, NULL, 0) != 0){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_TLS_ERROR;
+	}
+#endif
+	if(pthread_create(&worker, NULL, hostWorker, NULL) != 0){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	return CY_RSLT_SUCCESS;
+}
+
+/* hostAdd:
+ * Track a new socket, NULL if there is no room */
+static hostSocket_t *hostAdd(int fd, bool tls){
+	if(fd < 0 || fd >= HOST_MAX_FD){
+		if(fd >= 0){
+			close(fd);
+		}
+		return NULL;
+	}
+	hostSocket_t *sock = calloc(1, sizeof(*sock));
+	if(sock == NULL){
+		close(fd);
+		return NULL;
+	}
+	sock->fd = fd;
+	sock->tls = tls;
+	pthread_mutex_lock(&hostLock);
+	hostSockets[fd] = sock;
+	pthread_mutex_unlock(&hostLock);
+	return sock;
+}
+
+/* hostWatch:
+ * Start giving the worker the events of a socket */
+static cy_rslt_t hostWatch(hostSocket_t *sock){
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLRDHUP,
+		.data.fd = sock->fd
+	};
+	return epoll_ctl(hostEpoll, EPOLL_CTL_ADD, sock->fd, &event) == 0 ? CY_RSLT_SUCCESS : CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+}
+
+/* hostSetTimeout:
+ * Apply a receive timeout in ms to a socket */
+static void hostSetTimeout(int fd, uint32_t ms){
+	struct timeval timeout = {
+		.tv_sec = ms / 1000,
+		.tv_usec = (ms % 1000) * 1000
+	};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+cy_rslt_t cy_socket_create(int domain, int type, int protocol, cy_socket_t *handle){
+	(void)domain;
+	(void)type;
+#ifndef HOST_TLS
+	if(protocol == CY_SOCKET_IPPROTO_TLS){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_OPTION_NOT_SUPPORTED;
+	}
+#endif
+	hostSocket_t *sock = hostAdd(socket(AF_INET, SOCK_STREAM, 0), protocol == CY_SOCKET_IPPROTO_TLS);
+	*handle = sock;
+	if(sock == NULL){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	int reuse = 1;
+	setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	return CY_RSLT_SUCCESS;
+}
+
+cy_rslt_t cy_socket_setsockopt(cy_socket_t handle, int level, int optname, const void *optval, uint32_t optlen){
+	hostSocket_t *sock = handle;
+	(void)optlen;
+
+	if(level == CY_SOCKET_SOL_SOCKET){
+		switch(optname){
+			case CY_SOCKET_SO_RCVTIMEO:
+				sock->recvTimeout = *(const uint32_t *)optval;
+				hostSetTimeout(sock->fd, sock->recvTimeout);
+				return CY_RSLT_SUCCESS;
+			case CY_SOCKET_SO_CONNECT_REQUEST_CALLBACK:
+				sock->connect = *(const cy_socket_opt_callback_t *)optval;
+				return CY_RSLT_SUCCESS;
+			case CY_SOCKET_SO_RECEIVE_CALLBACK:
+				sock->receive = *(const cy_socket_opt_callback_t *)optval;
+				return CY_RSLT_SUCCESS;
+			case CY_SOCKET_SO_DISCONNECT_CALLBACK:
+				sock->disconnect = *(const cy_socket_opt_callback_t *)optval;
+				return CY_RSLT_SUCCESS;
+			default:
+				break;
+		}
+	}
+#ifdef HOST_TLS
+	else if(level == CY_SOCKET_SOL_TLS && sock->tls){
+		switch(optname){
+			case CY_SOCKET_SO_TLS_IDENTITY:
+				sock->identity = (void *)optval; // the identity itself, not a pointer to it
+				return CY_RSLT_SUCCESS;
+			case CY_SOCKET_SO_TLS_AUTH_MODE:
+				sock->authMode = *(const cy_socket_tls_auth_mode_t *)optval;
+				return CY_RSLT_SUCCESS;
+			default:
+				break;
+		}
+	}
+#endif
+	return CY_RSLT_MODULE_SECURE_SOCKETS_OPTION_NOT_SUPPORTED;
+}
+
+cy_rslt_t cy_socket_bind(cy_socket_t handle, cy_socket_sockaddr_t *address, uint32_t address_length){
+	hostSocket_t *sock = handle;
+	struct sockaddr_in bindAddress = {
+		.sin_family = AF_INET,
+		.sin_port = htons(address->port),
+		.sin_addr.s_addr = address->ip_address.ip.v4
+	};
+	(void)address_length;
+	return bind(sock->fd, (struct sockaddr *)&bindAddress, sizeof(bindAddress)) == 0 ? CY_RSLT_SUCCESS : CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+}
+
+/* A client socket is not given to the worker, it is used with blocking
+ * sends and receives. TLS client sockets are not needed by the server. */
+cy_rslt_t cy_socket_connect(cy_socket_t handle, cy_socket_sockaddr_t *address, uint32_t address_length){
+	hostSocket_t *sock = handle;
+	struct sockaddr_in peerAddress = {
+		.sin_family = AF_INET,
+		.sin_port = htons(address->port),
+		.sin_addr.s_addr = address->ip_address.ip.v4
+	};
+	(void)address_length;
+	if(sock->tls){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_OPTION_NOT_SUPPORTED;
+	}
+	return connect(sock->fd, (struct sockaddr *)&peerAddress, sizeof(peerAddress)) == 0 ? CY_RSLT_SUCCESS : CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+}
+
+#ifdef HOST_TLS
+/* hostTlsVerify:
+ * Ignore certificate dates. The target has no calendar time
+ * (MBEDTLS_HAVE_TIME_DATE is off in mbedtls_user_config.h), so the example
+ * certificates are accepted there whatever their dates are. */
+static int hostTlsVerify(void *context, mbedtls_x509_crt *certificate, int depth, uint32_t *flags){
+	(void)context;
+	(void)certificate;
+	(void)depth;
+	*flags &= ~(uint32_t)(MBEDTLS_X509_BADCERT_EXPIRED | MBEDTLS_X509_BADCERT_FUTURE);
+	return 0;
+}
+
+/* hostTlsConfig:
+ * Set up the server side TLS configuration of a listening socket */
+static cy_rslt_t hostTlsConfig(hostSocket_t *sock){
+	static const int authModes[] = {
+		[CY_SOCKET_TLS_VERIFY_NONE] = MBEDTLS_SSL_VERIFY_NONE,
+		[CY_SOCKET_TLS_VERIFY_OPTIONAL] = MBEDTLS_SSL_VERIFY_OPTIONAL,
+		[CY_SOCKET_TLS_VERIFY_REQUIRED] = MBEDTLS_SSL_VERIFY_REQUIRED
+	};
+	hostIdentity_t *identity = sock->identity;
+
+	if(identity == NULL){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_BADARG;
+	}
+	sock->config = calloc(1, sizeof(*sock->config));
+	if(sock->config == NULL){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	mbedtls_ssl_config_init(sock->config);
+	if(mbedtls_ssl_config_defaults(sock->config, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0 ||
+	   mbedtls_ssl_conf_own_cert(sock->config, &identity->certificate, &identity->key) != 0){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_TLS_ERROR;
+	}
+	mbedtls_ssl_conf_rng(sock->config, mbedtls_ctr_drbg_random, &hostDrbg);
+	mbedtls_ssl_conf_authmode(sock->config, authModes[sock->authMode]);
+	mbedtls_ssl_conf_verify(sock->config, hostTlsVerify, NULL);
+	if(hostRootCaLoaded){
+		mbedtls_ssl_conf_ca_chain(sock->config, &hostRootCa, NULL);
+	}
+	return CY_RSLT_SUCCESS;
+}
+
+static int hostTlsSend(void *context, const unsigned char *buffer, size_t length){
+	ssize_t sent = send(((hostSocket_t *)context)->fd, buffer, length, MSG_NOSIGNAL);
+	return (sent < 0) ? MBEDTLS_ERR_SSL_INTERNAL_ERROR : (int)sent;
+}
+
+static int hostTlsRecv(void *context, unsigned char *buffer, size_t length){
+	ssize_t received = recv(((hostSocket_t *)context)->fd, buffer, length, 0);
+	if(received < 0){
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_TIMEOUT : MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+	}
+	return (received == 0) ? MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY : (int)received;
+}
+#endif
+
+cy_rslt_t cy_socket_listen(cy_socket_t handle, int backlog){
+	hostSocket_t *sock = handle;
+#ifdef HOST_TLS
+	if(sock->tls){
+		cy_rslt_t result = hostTlsConfig(sock);
+		if(result != CY_RSLT_SUCCESS){
+			return result;
+		}
+	}
+#endif
+	if(listen(sock->fd, backlog) != 0){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+	}
+	return hostWatch(sock);
+}
+
+cy_rslt_t cy_socket_accept(cy_socket_t handle, cy_socket_sockaddr_t *address, uint32_t *address_length, cy_socket_t *socket_handle){
+	hostSocket_t *listener = handle;
+	struct sockaddr_in peer;
+	socklen_t peerLength = sizeof(peer);
+
+	hostSocket_t *sock = hostAdd(accept(listener->fd, (struct sockaddr *)&peer, &peerLength), listener->tls);
+	if(sock == NULL){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+	}
+	sock->receive = listener->receive;
+	sock->disconnect = listener->disconnect;
+	sock->recvTimeout = listener->recvTimeout;
+	hostSetTimeout(sock->fd, sock->recvTimeout);
+
+	address->port = ntohs(peer.sin_port);
+	address->ip_address.version = CY_SOCKET_IP_VER_V4;
+	address->ip_address.ip.v4 = peer.sin_addr.s_addr;
+	*address_length = sizeof(*address);
+
+#ifdef HOST_TLS
+	if(sock->tls){
+		int result;
+		mbedtls_ssl_init(&sock->ssl);
+		mbedtls_ssl_setup(&sock->ssl, listener->config);
+		mbedtls_ssl_set_bio(&sock->ssl, sock, hostTlsSend, hostTlsRecv, NULL);
+		while((result = mbedtls_ssl_handshake(&sock->ssl)) != 0){
+			if(result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE){
+				cy_socket_delete(sock);
+				return CY_RSLT_MODULE_SECURE_SOCKETS_TLS_ERROR;
+			}
+		}
+	}
+#endif
+
+	*socket_handle = sock;
+	return hostWatch(sock);
+}
+
+cy_rslt_t cy_socket_send(cy_socket_t handle, const void *buffer, uint32_t length, int flags, uint32_t *bytes_sent){
+	hostSocket_t *sock = handle;
+	const uint8_t *data = buffer;
+	uint32_t sent = 0;
+	(void)flags;
+
+	while(sent < length){
+		ssize_t result;
+#ifdef HOST_TLS
+		if(sock->tls){
+			result = mbedtls_ssl_write(&sock->ssl, &data[sent], length - sent);
+			if(result == MBEDTLS_ERR_SSL_WANT_WRITE){
+				continue;
+			}
+		}
+		else
+#endif
+		{
+			result = send(sock->fd, &data[sent], length - sent, MSG_NOSIGNAL);
+		}
+		if(result < 0){
+			*bytes_sent = sent;
+			return CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+		}
+		sent += (uint32_t)result;
+	}
+	*bytes_sent = sent;
+	return CY_RSLT_SUCCESS;
+}
+
+cy_rslt_t cy_socket_recv(cy_socket_t handle, void *buffer, uint32_t length, int flags, uint32_t *bytes_received){
+	hostSocket_t *sock = handle;
+	ssize_t result;
+	(void)flags;
+
+	*bytes_received = 0;
+	if(length == 0){
+		return CY_RSLT_SUCCESS;
+	}
+#ifdef HOST_TLS
+	if(sock->tls){
+		result = mbedtls_ssl_read(&sock->ssl, buffer, length);
+		if(result == MBEDTLS_ERR_SSL_TIMEOUT || result == MBEDTLS_ERR_SSL_WANT_READ){
+			return CY_RSLT_MODULE_SECURE_SOCKETS_TIMEOUT;
+		}
+		if(result == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || result == 0){
+			return CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED;
+		}
+		if(result < 0){
+			return CY_RSLT_MODULE_SECURE_SOCKETS_TLS_ERROR;
+		}
+		*bytes_received = (uint32_t)result;
+		return CY_RSLT_SUCCESS;
+	}
+#endif
+	result = recv(sock->fd, buffer, length, 0);
+	if(result == 0){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED;
+	}
+	if(result < 0){
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? CY_RSLT_MODULE_SECURE_SOCKETS_TIMEOUT : CY_RSLT_MODULE_SECURE_SOCKETS_TCPIP_ERROR;
+	}
+	*bytes_received = (uint32_t)result;
+	return CY_RSLT_SUCCESS;
+}
+
+cy_rslt_t cy_socket_disconnect(cy_socket_t handle, uint32_t timeout){
+	hostSocket_t *sock = handle;
+	(void)timeout;
+#ifdef HOST_TLS
+	if(sock->tls){
+		mbedtls_ssl_close_notify(&sock->ssl);
+	}
+#endif
+	shutdown(sock->fd, SHUT_RDWR);
+	return CY_RSLT_SUCCESS;
+}
+
+cy_rslt_t cy_socket_delete(cy_socket_t handle){
+	hostSocket_t *sock = handle;
+
+	pthread_mutex_lock(&hostLock);
+	hostSockets[sock->fd] = NULL;
+	epoll_ctl(hostEpoll, EPOLL_CTL_DEL, sock->fd, NULL);
+	close(sock->fd);
+#ifdef HOST_TLS
+	if(sock->tls){
+		mbedtls_ssl_free(&sock->ssl);
+	}
+#endif
+	free(sock);
+	pthread_mutex_unlock(&hostLock);
+	return CY_RSLT_SUCCESS;
+}
+
+cy_rslt_t cy_tls_create_identity(const char *certificate_data, const uint32_t certificate_len, const char *private_key, uint32_t private_key_len, void **tls_identity){
+#ifdef HOST_TLS
+	hostIdentity_t *identity = calloc(1, sizeof(*identity));
+	if(identity == NULL){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_NOMEM;
+	}
+	mbedtls_x509_crt_init(&identity->certificate);
+	mbedtls_pk_init(&identity->key);
+	// PEM lengths include the terminating NUL for mbedTLS
+	if(mbedtls_x509_crt_parse(&identity->certificate, (const unsigned char *)certificate_data, certificate_len + 1) != 0 ||
+#if MBEDTLS_VERSION_MAJOR >= 3
+	   mbedtls_pk_parse_key(&identity->key, (const unsigned char *)private_key, private_key_len + 1, NULL, 0, mbedtls_ctr_drbg_random, &hostDrbg) != 0){
+#else
+	   mbedtls_pk_parse_key(&identity->key, (const unsigned char *)private_key, private_key_len + 1, NULL, 0) != 0){
+#endif
+		free(identity);
+		return CY_RSLT_MODULE_SECURE_SOCKETS_TLS_ERROR;
+	}
+	*tls_identity = identity;
+	return CY_RSLT_SUCCESS;
+#else
+	(void)certificate_data;
+	(void)certificate_len;
+	(void)private_key;
+	(void)private_key_len;
+	*tls_identity = NULL;
+	return CY_RSLT_MODULE_SECURE_SOCKETS_OPTION_NOT_SUPPORTED;
+#endif
+}
+
+cy_rslt_t cy_tls_load_global_root_ca_certificates(const char *trusted_ca_certificates, const uint32_t cert_length){
+#ifdef HOST_TLS
+	mbedtls_x509_crt_init(&hostRootCa);
+	if(mbedtls_x509_crt_parse(&hostRootCa, (const unsigned char *)trusted_ca_certificates, cert_length + 1) != 0){
+		return CY_RSLT_MODULE_SECURE_SOCKETS_TLS_ERROR;
+	}
+	hostRootCaLoaded = true;
+	return CY_RSLT_SUCCESS;
+#else
+	(void)trusted_ca_certificates;
+	(void)cert_length;
+	return CY_RSLT_MODULE_SECURE_SOCKETS_OPTION_NOT_SUPPORTED;
+#endif
+}
@@ -1,54 +1,296 @@
-//simple linked list implementation
+//simple register database implementation
+//
+// The entries are indexed by an open addressing hash table (linear probing)
+// keyed on deviceId/regId. The slot array is preallocated so finding or
+// inserting an entry is O(1) and never has to walk the whole database.
+//
+// Readers use a sequence lock: dbSequence is odd while a write is in
+// progress, a read that overlaps a write is simply done again.
 #include "cyhal.h"
+#include "FreeRTOS.h"
+#include "task.h"
 #include "linkedList.h"
+#include "dbExpiry.h"
+#include "dbEvict.h"
+#include <string.h>
 
-#define dbMax (400)
 uint32_t dbGetMax()
 {
     return dbMax ;
 }
 
-// dbFind:
-// Search the database for specific deviceId/regId combination
-dbEntry_t *dbFind(dbEntry_t *head, dbEntry_t *find){
-	dbEntry_t *rval = NULL;
-	//loop through linked list and check if any entries match
-	while(head != NULL){
-		if(head->deviceId == find->deviceId && head->regId == find->regId){
-			rval = head;
-			return rval;
+// The hash table slots. An empty slot is NULL.
+static dbEntry_t *dbTable[dbTableSize];
+
+// Number of entries currently stored in the table
+static uint32_t dbCount = 0;
+
+// The entries sorted by deviceId then regId, for reading a range of devices
+static dbEntry_t *dbIndex[dbMax];
+
+// The entry pool. Free entries are chained through their next pointer.
+static dbEntry_t dbPool[dbPoolSize];
+static dbEntry_t *dbFreeList = NULL;
+static uint32_t dbPoolUsed = 0; // entries handed out by dbAlloc
+static uint32_t dbPoolPeak = 0; // high water mark of dbPoolUsed
+static uint32_t dbPoolFresh = 0; // entries that have never been handed out
+
+// Called after every change, NULL if nothing is persisted
+static void (*dbLogger)(const dbEntry_t *entry, uint32_t change) = NULL;
+
+// Incremented at the start and end of every write
+static volatile uint32_t dbSequence = 0;
+
+// dbHash:
+// Mix the deviceId/regId into an index into the table
+static inline uint32_t dbHash(uint32_t deviceId, uint32_t regId){
+	uint32_t key = (deviceId << 8) ^ regId;
+	key *= 0x9E3779B1u; // Fibonacci hashing, the top bits are the best mixed
+	return key >> (32 - dbTableBits);
+}
+
+// dbSlot:
+// Return the slot that holds the deviceId/regId combination or the empty
+// slot where it would be inserted
+static dbEntry_t **dbSlot(uint32_t deviceId, uint32_t regId){
+	uint32_t index = dbHash(deviceId, regId);
+	//the table is never full (dbMax < dbTableSize) so this always terminates
+	while(dbTable[index] != NULL){
+		if(dbTable[index]->deviceId == deviceId && dbTable[index]->regId == regId){
+			break;
 		}
-		head = head->next;
+		index = (index + 1) & (dbTableSize - 1);
 	}
-	return rval;
+	return &dbTable[index];
+}
 
+// dbLowerBound:
+// Return the position in dbIndex of the first entry at or after deviceId/regId
+static uint32_t dbLowerBound(uint32_t deviceId, uint32_t regId){
+	uint32_t low = 0;
+	uint32_t high = dbCount;
+	while(low < high){
+		uint32_t mid = (low + high) / 2;
+		dbEntry_t *entry = dbIndex[mid];
+		if(entry->deviceId < deviceId || (entry->deviceId == deviceId && entry->regId < regId)){
+			low = mid + 1;
+		}
+		else{
+			high = mid;
+		}
+	}
+	return low;
+}
+
+// dbFind:
+// Search the database for specific deviceId/regId combination
+dbEntry_t *dbFind(dbEntry_t *head, dbEntry_t *find){
+	(void)head; // the table is global, head is kept for compatibility
+	return *dbSlot(find->deviceId, find->regId);
 }
 
 // dbSetValue
 // searches the database, if newValue is not found then it inserts it or
 // overwrite the value if it is found
 void dbSetValue(dbEntry_t *head, dbEntry_t *newValue){
-    dbEntry_t *found = dbFind(head, newValue);
-    if(found) // if it is already in the database
+    (void)head;
+    dbEntry_t **slot = dbSlot(newValue->deviceId, newValue->regId);
+    if(*slot) // if it is already in the database
     {
-        found->value = newValue->value;
+        (*slot)->value = newValue->value;
+        dbEvictTouch(*slot);
+        if(dbLogger){
+            dbLogger(*slot, dbChangeValue);
+        }
     }
-    else // add it to the linked list
+    else if(dbCount < dbMax) // add it to the table and the sorted index
     {
-        while(head->next != NULL){
-        	head = head->next;
+        uint32_t position = dbLowerBound(newValue->deviceId, newValue->regId);
+        memmove(&dbIndex[position + 1], &dbIndex[position], (dbCount - position) * sizeof(dbIndex[0]));
+        dbIndex[position] = newValue;
+        newValue->next = NULL;
+        *slot = newValue;
+        dbCount++;
+        if(dbLogger){
+            dbLogger(newValue, dbChangeValue);
         }
-        head->next = newValue;
     }
 }
 
-//get number of entries in the list
+// dbDelete:
+// Remove an entry from the table and the sorted index. The entries after it
+// in its probe run are shifted back into the hole instead of leaving a
+// tombstone, so a lookup still stops at the first empty slot and deletes
+// never make the probe runs longer.
+dbEntry_t *dbDelete(dbEntry_t *head, dbEntry_t *find){
+	(void)head;
+	dbEntry_t **slot = dbSlot(find->deviceId, find->regId);
+	dbEntry_t *entry = *slot;
+	if(entry == NULL){
+		return NULL;
+	}
+
+	uint32_t hole = slot - dbTable;
+	uint32_t index = (hole + 1) & (dbTableSize - 1);
+	while(dbTable[index] != NULL){
+		// an entry can fill the hole if the hole is between its home slot and where it is
+		uint32_t home = dbHash(dbTable[index]->deviceId, dbTable[index]->regId);
+		if(((index - home) & (dbTableSize - 1)) >= ((index - hole) & (dbTableSize - 1))){
+			dbTable[hole] = dbTable[index];
+			hole = index;
+		}
+		index = (index + 1) & (dbTableSize - 1);
+	}
+	dbTable[hole] = NULL;
+
+	uint32_t position = dbLowerBound(entry->deviceId, entry->regId);
+	memmove(&dbIndex[position], &dbIndex[position + 1], (dbCount - position - 1) * sizeof(dbIndex[0]));
+	dbCount--;
+
+	dbExpiryArm(entry, 0);
+	dbEvictForget(entry);
+	if(dbLogger){
+		dbLogger(entry, dbChangeDelete);
+	}
+	return entry;
+}
+
+// dbSetExpiry:
+// Start or cancel the timer of an entry in the database
+void dbSetExpiry(dbEntry_t *entry, uint32_t seconds){
+	dbExpiryArm(entry, seconds);
+	if(dbLogger){
+		dbLogger(entry, dbChangeExpiry);
+	}
+}
+
+// dbSetPinned:
+// Pin or unpin an entry in the database
+void dbSetPinned(dbEntry_t *entry, bool pinned){
+	dbEvictPin(entry, pinned);
+	if(dbLogger){
+		dbLogger(entry, dbChangePin);
+	}
+}
+
+//get number of entries in the database
 uint32_t dbGetCount(dbEntry_t *head){
-    uint32_t count = 1;
-    while(head->next != NULL){
-    	head = head->next;
-    	count++;
-    }
-    return count;
+    (void)head;
+    return dbCount;
+}
+
+// dbFindRange:
+// Find the entries with a deviceId from firstDeviceId to lastDeviceId. Returns
+// how many there are and sets first to the position of the first one, they
+// are then read in order with dbGetIndexed
+uint32_t dbFindRange(uint32_t firstDeviceId, uint32_t lastDeviceId, uint32_t *first){
+	*first = dbLowerBound(firstDeviceId, 0);
+	if(lastDeviceId < firstDeviceId){
+		return 0;
+	}
+	uint32_t end = (lastDeviceId == UINT32_MAX) ? dbCount : dbLowerBound(lastDeviceId + 1, 0);
+	return end - *first;
+}
+
+// dbGetIndexed:
+// Return the entry at a position of the sorted index
+dbEntry_t *dbGetIndexed(uint32_t position){
+	return (position < dbCount) ? dbIndex[position] : NULL;
+}
+
+// dbSetLogger:
+// Set the function that persists the changes
+void dbSetLogger(void (*logger)(const dbEntry_t *entry, uint32_t change)){
+	dbLogger = logger;
+}
 
+// dbAlloc:
+// Take an entry from the pool, returns NULL if the pool is empty
+dbEntry_t *dbAlloc(){
+	dbEntry_t *entry = NULL;
+	if(dbFreeList != NULL){ // reuse a freed entry
+		entry = dbFreeList;
+		dbFreeList = entry->next;
+	}
+	else if(dbPoolFresh < dbPoolSize){ // hand out the pool in order the first time through
+		entry = &dbPool[dbPoolFresh++];
+	}
+	else{
+		return NULL;
+	}
+	entry->next = NULL;
+	dbPoolUsed++;
+	if(dbPoolUsed > dbPoolPeak){
+		dbPoolPeak = dbPoolUsed;
+	}
+	return entry;
+}
+
+// dbFree:
+// Return an entry to the pool
+void dbFree(dbEntry_t *entry){
+	if(entry == NULL){
+		return;
+	}
+	entry->next = dbFreeList;
+	dbFreeList = entry;
+	dbPoolUsed--;
+}
+
+uint32_t dbPoolInUse(){
+	return dbPoolUsed;
+}
+
+uint32_t dbPoolHighWater(){
+	return dbPoolPeak;
+}
+
+uint32_t dbPoolIndex(const dbEntry_t *entry){
+	return entry - dbPool;
+}
+
+dbEntry_t *dbPoolEntry(uint32_t index){
+	return &dbPool[index];
+}
+
+// dbWriteBegin:
+// Mark the start of a change, the caller must hold off all other writers
+void dbWriteBegin(){
+	dbSequence++;
+	__DMB(); // the odd sequence is visible before any of the changes
+}
+
+// dbWriteEnd:
+// Mark the end of a change
+void dbWriteEnd(){
+	__DMB(); // the changes are visible before the even sequence
+	dbSequence++;
+}
+
+// dbRead:
+// Read a deviceId/regId without locking, retrying if a write got in the way
+bool dbRead(uint32_t deviceId, uint32_t regId, uint32_t *value){
+	uint32_t sequence;
+	bool found;
+	uint32_t result = 0;
+	for(;;){
+		sequence = dbSequence;
+		if(sequence & 1){
+			vTaskDelay(1); // let the writer finish, it may be a lower priority
+			continue;
+		}
+		__DMB();
+		dbEntry_t *entry = *dbSlot(deviceId, regId);
+		found = (entry != NULL);
+		if(found){
+			result = entry->value;
+			dbEvictTouch(entry);
+		}
+		__DMB();
+		if(sequence == dbSequence){
+			break;
+		}
+	}
+	*value = result;
+	return found;
 }
@@ -3,7 +3,28 @@
 
 #include "cyhal.h"
 
-// the dbEntry is the structure that is stored in the linked list.
+// Maximum number of entries in the database
+#ifndef dbMax
+#define dbMax (400)
+#endif
+
+// Size of the hash table, must be a power of 2 and larger than dbMax so
+// that the table never fills up (keep the load factor at or below 1/2)
+#ifndef dbTableBits
+#define dbTableBits (10)
+#endif
+#define dbTableSize (1u << dbTableBits)
+
+#if (dbMax * 2) > dbTableSize
+#error "dbTableBits is too small for dbMax"
+#endif
+
+// Number of entries in the entry pool
+#ifndef dbPoolSize
+#define dbPoolSize (dbMax)
+#endif
+
+// the dbEntry is the structure that is stored in the database.
 typedef struct dbEntry {
     uint32_t deviceId;
     uint32_t regId;
@@ -11,13 +32,49 @@ typedef struct dbEntry {
     struct dbEntry *next;
 } dbEntry_t;
 
+// The changes passed to the logger
+#define dbChangeValue  (0) // dbSetValue stored the value of the entry
+#define dbChangeDelete (1) // dbDelete removed the entry
+#define dbChangeExpiry (2) // dbSetExpiry gave the entry a time to live, or took it away
+#define dbChangePin    (3) // dbSetPinned pinned or unpinned the entry
+
 //Find Function
 struct dbEntry *dbFind(struct dbEntry *head, struct dbEntry *find);
 //setvalue function
 void dbSetValue(struct dbEntry *head, struct dbEntry *newValue);
+//remove an entry, returns it for dbFree or NULL if it is not in the database
+dbEntry_t *dbDelete(dbEntry_t *head, dbEntry_t *find);
+//give an entry in the database a time to live in seconds, 0 for none, see dbExpiry.h
+void dbSetExpiry(dbEntry_t *entry, uint32_t seconds);
+//keep an entry in the database from being evicted, see dbEvict.h
+void dbSetPinned(dbEntry_t *entry, bool pinned);
 //getmax function
 uint32_t dbGetMax();
 //getcount function
 uint32_t dbGetCount(dbEntry_t *head);
+//range functions, entries are in order of deviceId then regId
+uint32_t dbFindRange(uint32_t firstDeviceId, uint32_t lastDeviceId, uint32_t *first);
+dbEntry_t *dbGetIndexed(uint32_t position);
+
+//pool functions, entries come from a fixed array instead of the heap
+dbEntry_t *dbAlloc();
+void dbFree(dbEntry_t *entry);
+//number of pool entries in use and the most that have ever been in use
+uint32_t dbPoolInUse();
+uint32_t dbPoolHighWater();
+//position of an entry in the pool and the entry at a position
+uint32_t dbPoolIndex(const dbEntry_t *entry);
+dbEntry_t *dbPoolEntry(uint32_t index);
+
+//persistence hook, logger is called after every change with one of the dbChange kinds
+void dbSetLogger(void (*logger)(const dbEntry_t *entry, uint32_t change));
+
+//concurrency functions. Writers are serialized by the caller and bracket their
+//changes with dbWriteBegin/dbWriteEnd, readers use dbRead and never block them.
+void dbWriteBegin();
+void dbWriteEnd();
+//read the value of a deviceId/regId, returns false if it is not in the database.
+//Reads and writes mark the entry as used for the eviction, see dbEvict.h
+bool dbRead(uint32_t deviceId, uint32_t regId, uint32_t *value);
 
 #endif
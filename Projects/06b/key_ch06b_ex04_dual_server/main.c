@@ -52,6 +52,9 @@
 /* TCP server task header file. */
 #include "tcp_server.h"
 
+/* Write mirroring to a follower */
+#include "replication.h"
+
 /* Cypress secure socket header file */
 #include "cy_secure_sockets.h"
 #include "cy_tls.h"
@@ -70,6 +73,7 @@
 /* RTOS related macros for TCP server task. */
 #define TCP_SERVER_TASK_STACK_SIZE                (1024 * 5)
 #define CONNECT_TO_WIFI_TASK_STACK_SIZE           (1024)
+#define REPLICATION_TASK_STACK_SIZE               (1024 * 2)
 #define TCP_SERVER_TASK_PRIORITY                  (1)
 #define CONNECT_TO_WIFI_TASK_PRIORITY			  (2)
 
@@ -137,6 +141,9 @@ int main(){
 	}
 	printf("Secure Socket initialized\n");
 
+	/* Initialize the resources shared by the server tasks. */
+	tcp_server_init();
+
     /* Create connect to wifi task. */
     xTaskCreate(connect_to_wifi_ap_task, "connect to WiFi task", CONNECT_TO_WIFI_TASK_STACK_SIZE, NULL, CONNECT_TO_WIFI_TASK_PRIORITY, &connect_to_wifi_task_handle);
 
@@ -178,6 +185,9 @@ void connect_to_wifi_ap_task(void *arg){
     }
     printf("Wi-Fi Connection Manager initialized.\r\n");
 
+    /* Load the saved registers before the server tasks start. */
+    tcp_server_restore();
+
      /* Set the Wi-Fi SSID, password and security type. */
     memset(&wifi_conn_param, 0, sizeof(cy_wcm_connect_params_t));
     memcpy(wifi_conn_param.ap_credentials.SSID, WIFI_SSID, sizeof(WIFI_SSID));
@@ -211,6 +221,10 @@ void connect_to_wifi_ap_task(void *arg){
             /* Create the network tasks. */
             xTaskCreate(tcp_server_task, "non-secure network task", TCP_SERVER_TASK_STACK_SIZE, &noSecurity, TCP_SERVER_TASK_PRIORITY, &server_task_handle);
         	xTaskCreate(tcp_server_task, "secure Network task", TCP_SERVER_TASK_STACK_SIZE, &security, TCP_SERVER_TASK_PRIORITY, &secure_server_task_handle);
+#ifdef TCP_REPLICATION_PEER
+        	/* Ship the database changes to the follower. */
+        	xTaskCreate(replication_task, "replication task", REPLICATION_TASK_STACK_SIZE, NULL, TCP_SERVER_TASK_PRIORITY, NULL);
+#endif
 
             while(true){
                 	vTaskDelay(1);
@@ -0,0 +1,106 @@
+//token bucket rate limiting of the clients, see rateLimit.h
+#include "cyhal.h"
+#include "rateLimit.h"
+
+// A client and its bucket. Tokens are kept in thousandths so a refill of
+// less than one token per ms is not lost.
+typedef struct {
+	uint32_t address;
+	uint32_t milliTokens;
+	uint32_t refilledMs;  // when milliTokens was last brought up to date
+	uint32_t seenMs;      // last rateTake, for the LRU eviction
+	bool inUse;
+} rateClient_t;
+
+static rateClient_t rateTable[rateClients];
+static uint32_t rateTokensPerSecond = 0; // one token per second is one milliToken per ms
+static uint32_t rateBurstMilli = 0;
+static rateStats_t rateStats;
+
+// rateConfigure:
+// Set the refill rate and the bucket size in tokens
+void rateConfigure(uint32_t tokensPerSecond, uint32_t burst){
+	rateTokensPerSecond = tokensPerSecond;
+	rateBurstMilli = burst * 1000;
+}
+
+// rateRefill:
+// Bring the bucket of a client up to date
+static void rateRefill(rateClient_t *client, uint32_t nowMs){
+	uint32_t elapsed = nowMs - client->refilledMs;
+	uint32_t room = rateBurstMilli - client->milliTokens;
+	if(elapsed >= room / rateTokensPerSecond){
+		client->milliTokens = rateBurstMilli; // full, and no overflow however long it has been
+	}
+	else{
+		client->milliTokens += elapsed * rateTokensPerSecond;
+	}
+	client->refilledMs = nowMs;
+}
+
+// rateFind:
+// The entry of an address, or the one to give it: a free entry or else the
+// least recently seen client whose bucket is full again. Dropping a full
+// bucket loses nothing, the client gets the same full bucket if it comes
+// back. NULL if every client in the table is still short of tokens.
+static rateClient_t *rateFind(uint32_t address, uint32_t nowMs){
+	rateClient_t *oldest = NULL;
+	for(uint32_t i = 0; i < rateClients; i++){
+		rateClient_t *client = &rateTable[i];
+		if(client->inUse && client->address == address){
+			rateRefill(client, nowMs);
+			return client;
+		}
+		if(!client->inUse){
+			if(oldest == NULL || oldest->inUse){
+				oldest = client;
+			}
+			continue;
+		}
+		rateRefill(client, nowMs);
+		if(client->milliTokens == rateBurstMilli && (oldest == NULL ||
+		   (oldest->inUse && (nowMs - client->seenMs) > (nowMs - oldest->seenMs)))){
+			oldest = client;
+		}
+	}
+	if(oldest == NULL){
+		return NULL;
+	}
+	if(oldest->inUse){
+		rateStats.evictions++;
+	}
+	oldest->inUse = true;
+	oldest->address = address;
+	oldest->milliTokens = rateBurstMilli;
+	oldest->refilledMs = nowMs;
+	return oldest;
+}
+
+// rateTake:
+// Refill the bucket of a client for the time since it was last seen, then
+// take the tokens if they are there. A client that finds the table full of
+// clients short of tokens has no bucket yet and is turned away.
+bool rateTake(uint32_t address, uint32_t cost, uint32_t nowMs){
+	if(rateTokensPerSecond == 0){
+		return true;
+	}
+	rateClient_t *client = rateFind(address, nowMs);
+	if(client == NULL){
+		rateStats.limited++;
+		rateStats.tableFull++;
+		return false;
+	}
+	client->seenMs = nowMs;
+
+	if(client->milliTokens < cost * 1000){
+		rateStats.limited++;
+		return false;
+	}
+	client->milliTokens -= cost * 1000;
+	rateStats.allowed++;
+	return true;
+}
+
+const rateStats_t *rateGetStats(){
+	return &rateStats;
+}
@@ -0,0 +1,43 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#include "cyhal.h"
+
+// Token bucket rate limiting of the clients, keyed on their IPv4 address.
+//
+// Every client address has a bucket of up to rateBurst tokens, refilled at
+// rateTokensPerSecond. Accepting a connection or receiving data takes tokens
+// and a client whose bucket is empty is turned away. The buckets are kept in
+// a table of rateClients entries, a new address takes the entry of the least
+// recently seen client whose bucket has filled up again. A client is never
+// dropped while it is short of tokens, so it cannot get a full bucket back by
+// making way for other addresses. While every entry is short of tokens new
+// addresses are turned away.
+//
+// The server takes the tokens of a connection once it is accepted, on the
+// secure port after the TLS handshake. The limit bounds what a client costs
+// after the handshake, not the handshakes themselves.
+//
+// Times are in ms so the table does not depend on the tick rate. The caller
+// serializes the calls.
+#ifndef rateClients
+#define rateClients (16)
+#endif
+
+// Counters of the table
+typedef struct {
+	uint32_t allowed;    // rateTake calls that had the tokens
+	uint32_t limited;    // rateTake calls that did not
+	uint32_t evictions;  // clients dropped from the table for a new one
+	uint32_t tableFull;  // new addresses turned away, no entry could be dropped
+} rateStats_t;
+
+//set the refill rate and bucket size, a rate of 0 turns limiting off
+void rateConfigure(uint32_t tokensPerSecond, uint32_t burst);
+//take cost tokens from the bucket of address at time nowMs, false if it has too few,
+//called for a connection after its TLS handshake
+bool rateTake(uint32_t address, uint32_t cost, uint32_t nowMs);
+//counters of the table
+const rateStats_t *rateGetStats();
+
+#endif
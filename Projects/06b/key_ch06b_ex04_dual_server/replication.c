@@ -0,0 +1,323 @@
+//write mirroring to a follower server, see replication.h
+#include "cyhal.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "cy_secure_sockets.h"
+#include "tcp_server.h"
+#include "replication.h"
+#include "dbExpiry.h"
+#include "textProtocol.h"
+#include <stdio.h>
+#include <string.h>
+
+// Only a leader has anything to do
+#ifdef TCP_REPLICATION_PEER
+
+// Size of the length at the start of every frame
+#define replFrameHeader (2)
+
+// The database writers, held while the ring or the database is read
+extern SemaphoreHandle_t dbMutex;
+
+// A change waiting for the follower, in the range of the AWEP commands
+typedef struct {
+	uint16_t deviceId;
+	uint16_t value;
+	uint8_t regId;
+	char op;
+} replRecord_t;
+
+// The newest changes. Change n is in replRing[n % TCP_REPLICATION_LOG_SIZE]
+// and the newest is replNext - 1, the first change is 1.
+static replRecord_t replRing[TCP_REPLICATION_LOG_SIZE];
+static uint32_t replNext = 1;
+
+// Connection to the follower, NULL when there is none
+static cy_socket_t replSocket = NULL;
+
+// The frame being sent, the longest is a P
+static uint8_t replFrame[replFrameHeader + 1 + 8 + replBatchEntries * replEntryLength + 1];
+
+// replLog:
+// Number a change and keep it in the ring, the oldest change is overwritten
+void replLog(const dbEntry_t *entry, char op){
+	replRecord_t *record = &replRing[replNext % TCP_REPLICATION_LOG_SIZE];
+	record->deviceId = (uint16_t)entry->deviceId;
+	record->regId = (uint8_t)entry->regId;
+	record->op = op;
+	if(op == replOpWrite){
+		record->value = (uint16_t)entry->value;
+	}
+	else if(op == replOpExpiry){
+		record->value = (uint16_t)dbExpirySeconds(entry);
+	}
+	else{
+		record->value = 0;
+	}
+	replNext++;
+}
+
+// replOldest:
+// The oldest change still in the ring when the next one is next
+static uint32_t replOldest(uint32_t next){
+	return (next > TCP_REPLICATION_LOG_SIZE) ? next - TCP_REPLICATION_LOG_SIZE : 1;
+}
+
+// replConnect:
+// Open the connection to the follower
+static bool replConnect(){
+	cy_socket_sockaddr_t address = {
+		.port = TCP_REPLICATION_PEER_PORT,
+		.ip_address = {
+			.version = CY_SOCKET_IP_VER_V4,
+			.ip.v4 = TCP_REPLICATION_PEER
+		}
+	};
+	uint32_t timeout = TCP_REPLICATION_ACK_TIMEOUT_MS;
+
+	if(cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TCP, &replSocket) != CY_RSLT_SUCCESS){
+		replSocket = NULL;
+		return false;
+	}
+	if(cy_socket_setsockopt(replSocket, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_RCVTIMEO, &timeout, sizeof(timeout)) != CY_RSLT_SUCCESS ||
+	   cy_socket_connect(replSocket, &address, sizeof(address)) != CY_RSLT_SUCCESS){
+		cy_socket_delete(replSocket);
+		replSocket = NULL;
+		return false;
+	}
+	return true;
+}
+
+// replDisconnect:
+// Close the connection to the follower
+static void replDisconnect(){
+	if(replSocket != NULL){
+		cy_socket_disconnect(replSocket, 0);
+		cy_socket_delete(replSocket);
+		replSocket = NULL;
+	}
+}
+
+// replRecv:
+// Receive exactly length bytes from the follower
+static bool replRecv(uint8_t *data, uint32_t length){
+	uint32_t bytes_received;
+	while(length > 0){
+		if(cy_socket_recv(replSocket, data, length, CY_SOCKET_FLAGS_NONE, &bytes_received) != CY_RSLT_SUCCESS){
+			return false;
+		}
+		data += bytes_received;
+		length -= bytes_received;
+	}
+	return true;
+}
+
+// replExchange:
+// Send the length bytes of command in replFrame and read the position the
+// follower answers with
+static bool replExchange(uint32_t length, uint32_t *position){
+	uint8_t reply[replFrameHeader + 20];
+	uint32_t bytes_sent;
+
+	replFrame[0] = (uint8_t)(length >> 8);
+	replFrame[1] = (uint8_t)length;
+	if(cy_socket_send(replSocket, replFrame, replFrameHeader + length, CY_SOCKET_FLAGS_NONE, &bytes_sent) != CY_RSLT_SUCCESS){
+		return false;
+	}
+
+	if(!replRecv(reply, replFrameHeader)){
+		return false;
+	}
+	uint32_t replyLength = ((uint32_t)reply[0] << 8) | reply[1];
+	if(replyLength >= sizeof(reply) - replFrameHeader || !replRecv(&reply[replFrameHeader], replyLength)){
+		return false;
+	}
+	reply[replFrameHeader + replyLength] = '\0';
+	if(replyLength != 9 || reply[replFrameHeader] != 'Y'){
+		// not a follower, or it does not take this server as its leader
+		printf("Replication refused: %s\n", (char *)&reply[replFrameHeader]);
+		return false;
+	}
+	return textHex((const char *)&reply[replFrameHeader + 1], 8, position);
+}
+
+// replCopy:
+// Start a copy with a Z, send every register of the database a batch at a
+// time, then the change the copy holds. Changes made during the copy are shipped after it from
+// the ring, if the ring wrapped in the meantime the follower is left with no
+// position and the copy is made again.
+static bool replCopy(uint32_t *position){
+	char *text = (char *)&replFrame[replFrameHeader];
+	uint32_t deviceId = 0; // the last register sent
+	uint32_t regId = 0;
+	bool started = false;
+	bool more = true;
+
+	xSemaphoreTake(dbMutex, portMAX_DELAY);
+	uint32_t upTo = replNext - 1;
+	xSemaphoreGive(dbMutex);
+
+	text[0] = 'Z';
+	if(!replExchange(1, position)){
+		return false;
+	}
+
+	while(more){
+		char *next = text;
+		*next++ = 'C';
+
+		// carry on after the last register sent, the writers may have moved it in the index
+		xSemaphoreTake(dbMutex, portMAX_DELAY);
+		uint32_t first;
+		uint32_t count = dbFindRange(deviceId, UINT32_MAX, &first);
+		uint32_t i = 0;
+		while(started && i < count && dbGetIndexed(first + i)->deviceId == deviceId && dbGetIndexed(first + i)->regId <= regId){
+			i++;
+		}
+		// a register with a time to live takes two changes
+		for(uint32_t n = 0; i < count && n + 2 <= replBatchEntries; i++, n++){
+			dbEntry_t *entry = dbGetIndexed(first + i);
+			*next++ = replOpWrite;
+			next = textPutEntry(next, entry);
+			if(dbExpirySeconds(entry) != 0){
+				*next++ = replOpExpiry;
+				next = textPutHex(next, entry->deviceId, 4);
+				next = textPutHex(next, entry->regId, 2);
+				next = textPutHex(next, dbExpirySeconds(entry), 4);
+				n++;
+			}
+			deviceId = entry->deviceId;
+			regId = entry->regId;
+			started = true;
+		}
+		more = (i < count);
+		xSemaphoreGive(dbMutex);
+
+		if(next - text > 1 && !replExchange(next - text, position)){
+			return false;
+		}
+	}
+
+	xSemaphoreTake(dbMutex, portMAX_DELAY);
+	bool kept = (replOldest(replNext) <= upTo + 1);
+	xSemaphoreGive(dbMutex);
+	if(!kept){
+		*position = replNoPosition;
+		return true;
+	}
+	text[0] = 'K';
+	textPutHex(&text[1], upTo, 8);
+	return replExchange(9, position);
+}
+
+// replShip:
+// Send the changes after the position of the follower, up to a batch
+static bool replShip(uint32_t *position){
+	char *text = (char *)&replFrame[replFrameHeader];
+	char *next = text;
+	uint32_t first = *position + 1;
+
+	xSemaphoreTake(dbMutex, portMAX_DELAY);
+	if(first < replOldest(replNext)){
+		// overwritten since the caller looked, the next pass makes a full copy
+		xSemaphoreGive(dbMutex);
+		return true;
+	}
+	uint32_t count = replNext - first;
+	if(count > replBatchEntries){
+		count = replBatchEntries;
+	}
+	*next++ = 'P';
+	next = textPutHex(next, first, 8);
+	for(uint32_t n = first; n < first + count; n++){
+		replRecord_t *record = &replRing[n % TCP_REPLICATION_LOG_SIZE];
+		*next++ = record->op;
+		next = textPutHex(next, record->deviceId, 4);
+		next = textPutHex(next, record->regId, 2);
+		next = textPutHex(next, record->value, 4);
+	}
+	xSemaphoreGive(dbMutex);
+
+	return replExchange(next - text, position);
+}
+
+/*******************************************************************************
+ * Function Name: replication_task
+ *******************************************************************************
+ * Summary:
+ *  Keep a connection to the follower and ship it the changes of the database.
+ *  A write never waits for the follower, the changes are sent from the ring
+ *  as the follower takes them, as many as fit in a frame at a time.
+ *
+ * Parameters:
+ *  void *args : Task parameter defined during task creation (unused)
+ *
+ *******************************************************************************/
+void replication_task(void *arg){
+	(void)arg;
+
+	// where the follower is, and if it has had a full copy since this server started
+	uint32_t position = replNoPosition;
+	bool copied = false;
+	TickType_t lastExchange = 0;
+
+	printf("Replicating to %d.%d.%d.%d port %d\n", (uint8)TCP_REPLICATION_PEER, (uint8)(TCP_REPLICATION_PEER >> 8),
+			(uint8)(TCP_REPLICATION_PEER >> 16), (uint8)(TCP_REPLICATION_PEER >> 24), TCP_REPLICATION_PEER_PORT);
+
+	while(true){
+		bool ok = true;
+
+		if(replSocket == NULL){
+			replFrame[replFrameHeader] = 'Y';
+			if(!replConnect()){
+				vTaskDelay(pdMS_TO_TICKS(TCP_REPLICATION_RETRY_MS));
+				continue;
+			}
+			ok = replExchange(1, &position);
+			if(ok){
+				printf("Replication connected, the follower has change %d\n", (int)position);
+			}
+		}
+
+		xSemaphoreTake(dbMutex, portMAX_DELAY);
+		uint32_t next = replNext;
+		xSemaphoreGive(dbMutex);
+
+		if(!ok){
+			// nothing to do but reconnect
+		}
+		else if(!copied || position == replNoPosition || position >= next || position + 1 < replOldest(next)){
+			TickType_t start = xTaskGetTickCount();
+			ok = replCopy(&position);
+			copied = ok && position != replNoPosition;
+			if(copied){
+				printf("Replication copy sent in %d ms, up to change %d\n",
+						(int)((xTaskGetTickCount() - start) * portTICK_PERIOD_MS), (int)position);
+			}
+			lastExchange = xTaskGetTickCount();
+		}
+		else if(position + 1 < next){
+			ok = replShip(&position);
+			lastExchange = xTaskGetTickCount();
+		}
+		else if((xTaskGetTickCount() - lastExchange) >= pdMS_TO_TICKS(TCP_REPLICATION_HEARTBEAT_MS)){
+			// keep the follower from closing the idle connection
+			replFrame[replFrameHeader] = 'Y';
+			ok = replExchange(1, &position);
+			lastExchange = xTaskGetTickCount();
+		}
+		else{
+			// up to date, let the next changes collect into one batch
+			vTaskDelay(pdMS_TO_TICKS(TCP_REPLICATION_BATCH_MS));
+		}
+
+		if(!ok){
+			printf("Replication connection lost, reconnecting\n");
+			replDisconnect();
+			vTaskDelay(pdMS_TO_TICKS(TCP_REPLICATION_RETRY_MS));
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef REPLICATION_H_
+#define REPLICATION_H_
+
+#include "cyhal.h"
+#include "linkedList.h"
+
+// Write mirroring from a leader server to a follower.
+//
+// The leader numbers every change to its database and keeps the newest
+// TCP_REPLICATION_LOG_SIZE of them in a ring. replication_task ships them in
+// batches over one connection to the non-secure port of the follower, as
+// length framed commands like any other session client:
+//  Y                            hello, also sent when there is nothing to ship
+//  PSSSSSSSSoDDDDRRVVVV...      changes S, S+1, ... one oDDDDRRVVVV each
+//  Z                            a full copy starts
+//  CoDDDDRRVVVV...              part of a full copy of the database
+//  KSSSSSSSS                    the full copy holds every change up to S
+// where the o of each change is one of the replOp kinds.
+// The follower answers each of them with
+//  YSSSSSSSS                    the last change it has, FFFFFFFF for none
+// so after a disconnect the leader carries on from where the follower is.
+// The follower only knows where it is once it has had a full copy since it
+// started, and the leader makes a full copy when it has not sent one since
+// it started or when the follower has fallen further behind than the ring.
+//
+// The follower keeps the registers it has while a full copy comes in, so its
+// clients can still read them, and at the K removes every register that was
+// not in the copy since the Z. That drops what the leader lost in a reset or
+// deleted in changes that fell out of the ring.
+
+// Position of a follower that has no full copy
+#define replNoPosition (0xFFFFFFFFu)
+
+// The kinds of change
+#define replOpWrite  'W' // VVVV is the value
+#define replOpExpiry 'L' // VVVV is the time to live in seconds, 0 for none
+#define replOpDelete 'E' // the register expired, VVVV is 0
+
+// Changes in one P or C frame, each is oDDDDRRVVVV
+#define replBatchEntries (31)
+#define replEntryLength (11)
+
+//number a change of one of the replOp kinds and keep it for the follower, the caller must hold off the database writers
+void replLog(const dbEntry_t *entry, char op);
+//ship the changes to the follower, runs for ever
+void replication_task(void *arg);
+
+#endif
@@ -0,0 +1,95 @@
+//lock free counters and histograms of the server, see serverStats.h
+#include "cyhal.h"
+#include "serverStats.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+static const char *statsCommandNames[statsCmdCount] = {
+	"R", "W", "M", "D", "S", "binary", "Q"
+};
+
+static const char *statsErrorNames[statsErrCount] = {
+	"length", "command", "character", "full", "not_found", "frame"
+};
+
+// statsAdd:
+// Add to a counter, safe against the other tasks adding at the same time
+void statsAdd(uint32_t *counter, uint32_t amount){
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+// statsRecord:
+// Count a time in the log2 bucket it belongs to
+void statsRecord(uint32_t *histogram, uint32_t ms){
+	uint32_t bucket = 0;
+	while(ms > 0 && bucket < statsBuckets - 1){
+		ms >>= 1;
+		bucket++;
+	}
+	statsAdd(&histogram[bucket], 1);
+}
+
+// statsAppend:
+// printf onto the end of the JSON. The length keeps counting after the
+// buffer is full so the caller can tell it was too small.
+static void statsAppend(char *buffer, uint32_t size, uint32_t *length, const char *format, ...) __attribute__((format(printf, 4, 5)));
+static void statsAppend(char *buffer, uint32_t size, uint32_t *length, const char *format, ...){
+	va_list args;
+	uint32_t room = (*length < size) ? size - *length : 0;
+	va_start(args, format);
+	int written = vsnprintf(room ? &buffer[*length] : NULL, room, format, args);
+	va_end(args);
+	if(written > 0){
+		*length += written;
+	}
+}
+
+// statsHistogram:
+// Append ,"name":[bucket,...]
+static void statsHistogram(char *buffer, uint32_t size, uint32_t *length, const char *name, const uint32_t *histogram){
+	statsAppend(buffer, size, length, ",\"%s\":[", name);
+	for(uint32_t i = 0; i < statsBuckets; i++){
+		statsAppend(buffer, size, length, i ? ",%u" : "%u", (unsigned int)histogram[i]);
+	}
+	statsAppend(buffer, size, length, "]");
+}
+
+// statsJson:
+// Write the stats of a listener and of the server as one JSON object
+uint32_t statsJson(const serverStats_t *stats, const statsServer_t *server, uint32_t port, char *buffer, uint32_t size){
+	uint32_t length = 0;
+
+	if(size > 0){
+		buffer[0] = '\0';
+	}
+	statsAppend(buffer, size, &length, "{\"port\":%u,\"connections\":%u,\"refused\":%u,\"reused\":%u,\"handshake_ms_total\":%u",
+			(unsigned int)port, (unsigned int)stats->connections, (unsigned int)stats->refused,
+			(unsigned int)stats->reused, (unsigned int)stats->handshakeMs);
+
+	statsAppend(buffer, size, &length, ",\"rate_limited\":{\"connections\":%u,\"receives\":%u,\"table_full\":%u,\"evictions\":%u}",
+			(unsigned int)stats->limitedConnections, (unsigned int)stats->limitedReceives,
+			(unsigned int)server->rateTableFull, (unsigned int)server->rateEvictions);
+
+	statsAppend(buffer, size, &length, ",\"cache\":{\"hits\":%u,\"misses\":%u,\"evictions\":%u}",
+			(unsigned int)stats->cacheHits, (unsigned int)stats->cacheMisses, (unsigned int)stats->evictions);
+
+	statsAppend(buffer, size, &length, ",\"pool\":{\"in_use\":%u,\"size\":%u,\"high_water\":%u}",
+			(unsigned int)server->poolInUse, (unsigned int)server->poolSize, (unsigned int)server->poolHighWater);
+
+	statsAppend(buffer, size, &length, ",\"commands\":{");
+	for(uint32_t i = 0; i < statsCmdCount; i++){
+		statsAppend(buffer, size, &length, "%s\"%s\":%u", i ? "," : "", statsCommandNames[i], (unsigned int)stats->commands[i]);
+	}
+	statsAppend(buffer, size, &length, "},\"errors\":{");
+	for(uint32_t i = 0; i < statsErrCount; i++){
+		statsAppend(buffer, size, &length, "%s\"%s\":%u", i ? "," : "", statsErrorNames[i], (unsigned int)stats->errors[i]);
+	}
+	statsAppend(buffer, size, &length, "}");
+
+	statsHistogram(buffer, size, &length, "handshake_ms_log2", stats->handshake);
+	statsHistogram(buffer, size, &length, "first_response_ms_log2", stats->firstResponse);
+	statsHistogram(buffer, size, &length, "latency_ms_log2", stats->latency);
+	statsAppend(buffer, size, &length, "}");
+
+	return length;
+}
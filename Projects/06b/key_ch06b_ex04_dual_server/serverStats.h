@@ -0,0 +1,74 @@
+#ifndef SERVERSTATS_H_
+#define SERVERSTATS_H_
+
+#include "cyhal.h"
+
+// Counters and latency histograms of one listener.
+//
+// Every field is only ever incremented, with an atomic add, so the receive
+// callbacks and the server tasks update them without a lock. A reader may
+// see one counter a little ahead of another, which is fine for statistics.
+//
+// The histograms have log2 buckets of milliseconds: bucket 0 counts times
+// under 1 ms, bucket n counts 2^(n-1) to 2^n - 1 ms and the last bucket
+// counts everything longer.
+#define statsBuckets (16)
+
+// Kinds of command
+typedef enum {
+	statsCmdRead,    // R
+	statsCmdWrite,   // W, T and L
+	statsCmdBatch,   // M
+	statsCmdRange,   // D
+	statsCmdWatch,   // S and U
+	statsCmdBinary,  // binary frames
+	statsCmdStats,   // Q
+	statsCmdCount
+} statsCommand_t;
+
+// Kinds of error reply
+typedef enum {
+	statsErrLength,    // X illegal length
+	statsErrCommand,   // X illegal command
+	statsErrCharacter, // X illegal character
+	statsErrFull,      // X Database Full or F
+	statsErrNotFound,  // X Not Found or N
+	statsErrFrame,     // binary frame with a bad CRC or command
+	statsErrCount
+} statsError_t;
+
+typedef struct {
+	uint32_t connections;                // clients accepted
+	uint32_t refused;                    // clients refused, no free session
+	uint32_t limitedConnections;         // clients closed at accept, over their rate limit
+	uint32_t limitedReceives;            // clients closed on a receive, over their rate limit
+	uint32_t reused;                     // connections that served more than one command, a handshake saved
+	uint32_t cacheHits;                  // reads of a register in the database
+	uint32_t cacheMisses;                // reads of a register that is not
+	uint32_t evictions;                  // registers evicted for a write of a new one
+	uint32_t handshakeMs;                // total time spent accepting
+	uint32_t commands[statsCmdCount];
+	uint32_t errors[statsErrCount];
+	uint32_t handshake[statsBuckets];    // accept, the TLS handshake on the secure port
+	uint32_t firstResponse[statsBuckets]; // accept to the first response
+	uint32_t latency[statsBuckets];      // receive to response
+} serverStats_t;
+
+// Counters of the whole server rather than of one listener, copied out by
+// the caller of statsJson
+typedef struct {
+	uint32_t rateEvictions;              // rate limit entries dropped for a new client address
+	uint32_t rateTableFull;              // new client addresses turned away, no rate limit entry free
+	uint32_t poolInUse;                  // register entries taken from the pool
+	uint32_t poolSize;                   // entries in the pool
+	uint32_t poolHighWater;              // most entries ever in use at once
+} statsServer_t;
+
+//add to a counter
+void statsAdd(uint32_t *counter, uint32_t amount);
+//count a time in a histogram
+void statsRecord(uint32_t *histogram, uint32_t ms);
+//write the stats as a JSON object, returns the length the whole object needs like snprintf
+uint32_t statsJson(const serverStats_t *stats, const statsServer_t *server, uint32_t port, char *buffer, uint32_t size);
+
+#endif
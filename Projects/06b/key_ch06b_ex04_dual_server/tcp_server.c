@@ -35,7 +35,6 @@
 * system or application assumes all risk of such use and in doing so agrees to
 * indemnify Cypress against all liability.
 *******************************************************************************/
-
 /* Header file includes */
 #include "cyhal.h"
 #include "cybsp.h"
@@ -53,6 +52,7 @@
 /* Standard C header file */
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 
 /* TCP server task header file. */
 #include "tcp_server.h"
@@ -60,8 +60,29 @@
 /* Linked list */
 #include "linkedList.h"
 
-/* isxdigit() */
-#include <ctype.h>
+/* Binary commands */
+#include "binaryProtocol.h"
+
+/* Database persistence */
+#include "dbStore.h"
+
+/* Register TTLs */
+#include "dbExpiry.h"
+
+/* Eviction when the database is full */
+#include "dbEvict.h"
+
+/* Counters and latency histograms */
+#include "serverStats.h"
+
+/* Write mirroring between servers */
+#include "replication.h"
+
+/* Per client rate limiting */
+#include "rateLimit.h"
+
+/* ASCII command parsing and formatting */
+#include "textProtocol.h"
 
 /* Wi-Fi connection manager header files */
 #include "cy_wcm.h"
@@ -70,15 +91,107 @@
 * Macros
 ********************************************************************************/
 /* RTOS related macros for TCP server task. */
+/* How often the server tasks look for idle sessions. */
+#define TCP_SERVER_SESSION_POLL_MS                (100)
 
+/* Size of the length at the start of every session frame. */
+#define TCP_SESSION_FRAME_HEADER                  (2)
+
+/* What a session client has sent so far. */
+#define SESSION_MODE_NEW                          (0)   // nothing yet
+#define SESSION_MODE_FRAMED                       (1)   // length framed ASCII commands
+#define SESSION_MODE_BINARY                       (2)   // binary frames, see binaryProtocol.h
+
+/* A follower only takes changes from its leader. */
+#ifdef TCP_REPLICATION_LEADER
+#define TCP_READ_ONLY                             (true)
+#else
+#define TCP_READ_ONLY                             (false)
+#endif
+
+/* regId of a watch on every register of a device. */
+#define TCP_WATCH_ALL_REGISTERS                   (0xFFFFFFFFu)
+
+/* Size of the connection information print of a session. */
+#define SESSION_LOG_SIZE                          (100)
+
+/*******************************************************************************
+* Typedefs
+********************************************************************************/
+/* One listening socket, the secure or the non-secure port. */
+typedef struct {
+	bool security;             // secure or non-secure port
+	cy_socket_t server_handle; // listening socket
+	cy_socket_t client_handle; // client socket being accepted
+	uint32_t port;             // port number, for the stats
+	serverStats_t stats;       // counters and histograms of the port
+} tcp_listener_t;
+
+/* A watched register, or every register of a device. */
+typedef struct {
+	uint32_t deviceId;
+	uint32_t regId;            // TCP_WATCH_ALL_REGISTERS for the whole device
+} tcp_watch_t;
+
+/* A changed register waiting to be pushed, with its value after the change,
+ * 0 once it has been deleted. */
+typedef struct {
+	uint32_t deviceId;
+	uint32_t regId;
+	uint32_t value;
+} tcp_event_t;
+
+/* The context of one client connection. Everything a receive callback needs
+ * is here, so the two listeners never share buffers. */
+typedef struct {
+	cy_socket_t socket;        // client socket, NULL when the session is free
+	bool security;             // accepted on the secure or non-secure port
+	uint32_t peerAddress;      // IPv4 address of the client
+	uint8_t mode;              // SESSION_MODE_xxx
+	bool busy;                 // a receive callback is using the session
+	TickType_t lastActivity;   // tick count of the last receive
+	TickType_t acceptTick;     // tick count when the client was accepted
+	bool responded;            // a reply has been sent to the client
+	uint32_t rxLength;         // bytes of partial frame in rxBuffer
+	uint8_t rxBuffer[TCP_SESSION_BUFFER_SIZE];
+	uint8_t reply[TCP_SESSION_FRAME_HEADER + TCP_MAX_BATCH_LENGTH + 1]; // frame header, reply and NUL
+	char log[SESSION_LOG_SIZE];  // connection information print
+	uint32_t logLength;        // characters in log before its NUL
+	uint32_t commands;         // commands received, for the reused count
+	uint32_t watchCount;       // watches in use
+	tcp_watch_t watches[TCP_SESSION_MAX_WATCHES];
+	uint32_t eventCount;       // changed registers waiting to be pushed
+	bool eventOverflow;        // changes were lost, the client must read again
+	tcp_event_t events[TCP_SESSION_MAX_EVENTS];
+} tcp_session_t;
 
 /*******************************************************************************
 * Function Prototypes
 ********************************************************************************/
-cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, cy_socket_sockaddr_t* server_addr, cy_socket_t* client_handle);
+cy_rslt_t create_tcp_server_socket(tcp_listener_t *listener, cy_socket_sockaddr_t* server_addr);
 cy_rslt_t tcp_connection_handler(cy_socket_t socket_handle, void *arg);
 cy_rslt_t tcp_receive_msg_handler(cy_socket_t socket_handle, void *arg);
 cy_rslt_t tcp_disconnection_handler(cy_socket_t socket_handle, void *arg);
+static tcp_session_t *sessionOpen(cy_socket_t socket_handle, bool security);
+static bool sessionRelease(cy_socket_t socket_handle);
+static void sessionCloseIdle(bool security);
+static void closeSocket(cy_socket_t socket_handle);
+static void logPrintf(tcp_session_t *session, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void logBatch(tcp_session_t *session, uint32_t count);
+static bool rateAllow(uint32_t address, uint32_t cost);
+static void dbWriteLock(void);
+static void dbWriteUnlock(void);
+static void dbSync(void);
+static void dbExpire(void);
+static void sessionPushEvents(bool security);
+static void watchNotify(const dbEntry_t *entry, uint32_t value);
+static void expireRegister(dbEntry_t *entry);
+static void statsCommand(tcp_session_t *session, char command);
+static void statsReply(tcp_session_t *session, const char *reply);
+static void statsBinary(tcp_session_t *session, uint8_t status);
+static void statsServerGet(statsServer_t *server);
+static cy_rslt_t processStats(tcp_session_t *session);
+static void statsPrint(tcp_listener_t *listener);
 
 /*******************************************************************************
 * Global Variables
@@ -93,9 +206,95 @@ void *tls_identity;
 // IP address of the device
 extern cy_wcm_ip_address_t ip_address;
 
-// Buffers to print to
-char secureBuffer[100];
-char nonSecureBuffer[100];
+// The non-secure (0) and secure (1) listeners
+static tcp_listener_t listeners[2];
+
+// Client connections
+tcp_session_t sessions[TCP_SERVER_MAX_SESSIONS];
+
+// Mutex protecting the allocation of sessions, used by the socket callbacks and the server tasks.
+// The database writers take it inside dbMutex (see watchNotify), so nothing
+// holding it may read or write the database or wait on a socket.
+SemaphoreHandle_t sessionMutex;
+
+// database of registers written by the clients
+static dbEntry_t head = {
+	.next = NULL,
+	.deviceId = 0,
+	.regId = 0
+};
+
+// Mutex serializing the database writers. Readers do not take it, they use
+// dbRead which retries if a write happened while it was reading.
+SemaphoreHandle_t dbMutex;
+
+#ifdef TCP_REPLICATION_LEADER
+// The last change from the leader this follower has, replNoPosition until it
+// has had a full copy
+static uint32_t replicaPosition = replNoPosition;
+
+// Entries written by the full copy since its Z, a bit per dbPoolIndex, and
+// whether a Z was had since the last K
+static uint32_t replicaCopied[(dbPoolSize + 31) / 32];
+static bool replicaCopying = false;
+#endif
+
+// Watches held by all of the sessions, so writers can skip watchNotify
+static volatile uint32_t watchTotal = 0;
+
+// Compactions of the stored database that have been reported
+static uint32_t dbSnapshots = 0;
+
+// When dbSync last wrote the database log, set under dbMutex
+static TickType_t dbSynced = 0;
+
+// Clock of the register TTLs, see ttlClock
+static uint32_t ttlSeconds = 0;
+static TickType_t ttlCounted = 0;
+
+/*******************************************************************************
+ * Function Name: tcp_server_init
+ *******************************************************************************
+ * Summary:
+ *  Create the resources shared by the secure and non-secure server tasks.
+ *  Must be called before the server tasks are created.
+ *
+ *******************************************************************************/
+void tcp_server_init(void){
+	sessionMutex = xSemaphoreCreateMutex();
+	dbMutex = xSemaphoreCreateMutex();
+	if(sessionMutex == NULL || dbMutex == NULL){
+		printf("Failed to create the server mutexes\n");
+		CY_ASSERT(0);
+	}
+	rateConfigure(TCP_RATE_TOKENS_PER_SEC, TCP_RATE_BURST);
+}
+
+/*******************************************************************************
+ * Function Name: tcp_server_restore
+ *******************************************************************************
+ * Summary:
+ *  Rebuild the database from storage. Must be called after tcp_server_init,
+ *  once the scheduler is running, and before the server tasks are created.
+ *
+ *******************************************************************************/
+void tcp_server_restore(void){
+	dbWriteLock();
+	ttlCounted = xTaskGetTickCount(); // recovered TTLs start from here
+	bool stored = dbStoreRecover(&head);
+	dbWriteUnlock();
+
+	if(stored){
+		const dbStoreStats_t *stats = dbStoreGetStats();
+		dbSnapshots = stats->snapshots;
+		printf("Database restored: %d entries and %d log records in %d ms\n",
+				(int)stats->recoveredEntries, (int)stats->replayedRecords, (int)(stats->recoveryTicks * portTICK_PERIOD_MS));
+	}
+	else{
+		printf("No database storage, registers will not be saved\n");
+	}
+}
+
 /*******************************************************************************
  * Function Name: tcp_server_task
  *******************************************************************************
@@ -116,11 +315,13 @@ void tcp_server_task(void *arg){
 	// var passed in when task is created, 0 for nonsecure, 1 for secure
 	bool security = (*(bool*)arg);
 
-	//server handle and address
-	static cy_socket_t server_handle;
-	cy_socket_t client_handle;
+	//this task's listener and the server address
+	tcp_listener_t *listener = &listeners[security ? 1 : 0];
 	cy_socket_sockaddr_t server_addr;
 
+	listener->security = security;
+	TickType_t statsPrinted = xTaskGetTickCount();
+
 	// Populate the ip var with the device ip and correct port
 	server_addr.ip_address.ip.v4 = ip_address.ip.v4;
 	server_addr.ip_address.version = CY_SOCKET_IP_VER_V4;
@@ -129,6 +330,7 @@ void tcp_server_task(void *arg){
 	if(security){
 
 		server_addr.port = SECURE_TCP_SERVER_PORT;
+		listener->port = SECURE_TCP_SERVER_PORT;
 
 		/* TLS credentials of the TCP server. */
 		static const char tcp_server_cert[] = keySERVER_CERTIFICATE_PEM;
@@ -160,19 +362,20 @@ void tcp_server_task(void *arg){
 	// non-secure specific setup
 	else{
 		server_addr.port = TCP_SERVER_PORT;
+		listener->port = TCP_SERVER_PORT;
 	}
 
 	/* Create TCP server socket. */
-	result = create_tcp_server_socket(&security, &server_handle, &server_addr, &client_handle);
+	result = create_tcp_server_socket(listener, &server_addr);
 	if (result != CY_RSLT_SUCCESS){
 		printf("Failed to create socket!\n");
 		CY_ASSERT(0);
 	}
 
 	/* Start listening on the TCP server socket. */
-	result = cy_socket_listen(server_handle, TCP_SERVER_MAX_PENDING_CONNECTIONS);
+	result = cy_socket_listen(listener->server_handle, TCP_SERVER_MAX_PENDING_CONNECTIONS);
 	if (result != CY_RSLT_SUCCESS){
-		cy_socket_delete(server_handle);
+		cy_socket_delete(listener->server_handle);
 		printf("cy_socket_listen returned error. Error: %d\n", (int)result);
 		CY_ASSERT(0);
 	}
@@ -183,7 +386,15 @@ void tcp_server_task(void *arg){
 	}
 
 	while(true){
-		vTaskDelay(1);
+		vTaskDelay(pdMS_TO_TICKS(TCP_SERVER_SESSION_POLL_MS));
+		sessionPushEvents(security);
+		sessionCloseIdle(security);
+		dbSync();
+		dbExpire();
+		if(TCP_SERVER_STATS_PRINT_MS > 0 && (xTaskGetTickCount() - statsPrinted) >= pdMS_TO_TICKS(TCP_SERVER_STATS_PRINT_MS)){
+			statsPrinted = xTaskGetTickCount();
+			statsPrint(listener);
+		}
 	}
 
  }
@@ -195,7 +406,7 @@ void tcp_server_task(void *arg){
  *  Function to create a socket and set the socket options
  *
  *******************************************************************************/
-cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, cy_socket_sockaddr_t* server_addr, cy_socket_t* client_handle){
+cy_rslt_t create_tcp_server_socket(tcp_listener_t *listener, cy_socket_sockaddr_t* server_addr){
 
     cy_rslt_t result;
 
@@ -211,10 +422,10 @@ cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, c
     cy_socket_tls_auth_mode_t tls_auth_mode = CY_SOCKET_TLS_VERIFY_REQUIRED;
 
     //secure specific setup
-    if(*security){
+    if(listener->security){
 
     	/* Create a Secure TCP socket. */
-		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TLS, server_handle);
+		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TLS, &listener->server_handle);
 		if(result != CY_RSLT_SUCCESS){
 			printf("Failed to create socket! Error code: %d\n", (int)result);
 			return result;
@@ -222,21 +433,21 @@ cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, c
 		printf("Created secure socket\n");
 
 		/* Set the TCP socket to use the TLS identity. */
-		result = cy_socket_setsockopt(*server_handle, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_IDENTITY, tls_identity, sizeof(tls_identity));
+		result = cy_socket_setsockopt(listener->server_handle, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_IDENTITY, tls_identity, sizeof(tls_identity));
 		if(result != CY_RSLT_SUCCESS){
 			printf("Failed cy_socket_setsockopt! Error code: %d\n", (int)result);
 			return result;
 		}
 
 		/* Set the TLS authentication mode. */
-		cy_socket_setsockopt(*server_handle, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_AUTH_MODE, &tls_auth_mode, sizeof(cy_socket_tls_auth_mode_t));
+		cy_socket_setsockopt(listener->server_handle, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_AUTH_MODE, &tls_auth_mode, sizeof(cy_socket_tls_auth_mode_t));
     }
 
     //nonsecure specific setup
     else{
 
     	/* Create a non-secure TCP socket. */
-		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TCP, server_handle);
+		result = cy_socket_create(CY_SOCKET_DOMAIN_AF_INET, CY_SOCKET_TYPE_STREAM, CY_SOCKET_IPPROTO_TCP, &listener->server_handle);
 		if(result != CY_RSLT_SUCCESS)
 		{
 			printf("Failed to create socket! Error code: %d\n", (int)result);
@@ -247,7 +458,7 @@ cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, c
     }
 
 	/* Set the TCP socket receive timeout period. */
-	result = cy_socket_setsockopt(*server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_RCVTIMEO, &tcp_recv_timeout, sizeof(tcp_recv_timeout));
+	result = cy_socket_setsockopt(listener->server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_RCVTIMEO, &tcp_recv_timeout, sizeof(tcp_recv_timeout));
 	if(result != CY_RSLT_SUCCESS){
 		printf("Set socket option: CY_SOCKET_SO_RCVTIMEO failed\n");
 		return result;
@@ -255,8 +466,8 @@ cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, c
 
 	/* Register the callback function to handle connection request from a TCP client. */
 	tcp_connection_option.callback = tcp_connection_handler;
-	tcp_connection_option.arg = client_handle;
-	result = cy_socket_setsockopt(*server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_CONNECT_REQUEST_CALLBACK, &tcp_connection_option, sizeof(cy_socket_opt_callback_t));
+	tcp_connection_option.arg = listener;
+	result = cy_socket_setsockopt(listener->server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_CONNECT_REQUEST_CALLBACK, &tcp_connection_option, sizeof(cy_socket_opt_callback_t));
 	if(result != CY_RSLT_SUCCESS){
 		printf("Set socket option: CY_SOCKET_SO_CONNECT_REQUEST_CALLBACK failed\n");
 		return result;
@@ -264,8 +475,8 @@ cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, c
 
 	/* Register the callback function to handle messages received from a TCP client. */
 	tcp_receive_option.callback = tcp_receive_msg_handler;
-	tcp_receive_option.arg = security;
-	result = cy_socket_setsockopt(*server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_RECEIVE_CALLBACK, &tcp_receive_option, sizeof(cy_socket_opt_callback_t));
+	tcp_receive_option.arg = listener;
+	result = cy_socket_setsockopt(listener->server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_RECEIVE_CALLBACK, &tcp_receive_option, sizeof(cy_socket_opt_callback_t));
 	if(result != CY_RSLT_SUCCESS){
 		printf("Set socket option: CY_SOCKET_SO_RECEIVE_CALLBACK failed\n");
 		return result;
@@ -274,14 +485,14 @@ cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, c
 	/* Register the callback function to handle disconnection. */
 	tcp_disconnection_option.callback = tcp_disconnection_handler;
 	tcp_disconnection_option.arg = NULL;
-	result = cy_socket_setsockopt(*server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_DISCONNECT_CALLBACK, &tcp_disconnection_option, sizeof(cy_socket_opt_callback_t));
+	result = cy_socket_setsockopt(listener->server_handle, CY_SOCKET_SOL_SOCKET, CY_SOCKET_SO_DISCONNECT_CALLBACK, &tcp_disconnection_option, sizeof(cy_socket_opt_callback_t));
 	if(result != CY_RSLT_SUCCESS){
 		printf("Set socket option: CY_SOCKET_SO_DISCONNECT_CALLBACK failed\n");
 		return result;
 	}
 
 	/* Bind the TCP socket created to Server IP address and to TCP port. */
-	result = cy_socket_bind(*server_handle, server_addr, sizeof(*server_addr));
+	result = cy_socket_bind(listener->server_handle, server_addr, sizeof(*server_addr));
 	if(result != CY_RSLT_SUCCESS){
 		printf("Failed to bind to socket! Error code: %d\n", (int)result);
 	}
@@ -298,7 +509,7 @@ cy_rslt_t create_tcp_server_socket(bool* security, cy_socket_t* server_handle, c
  *
  * Parameters:
  * cy_socket_t socket_handle: Connection handle for the TCP server socket
- *  void *args : Unused
+ *  void *args : tcp_listener_t of the server socket
  *
  * Return:
  *  cy_result result: Result of the operation
@@ -308,8 +519,8 @@ cy_rslt_t tcp_connection_handler(cy_socket_t socket_handle, void *arg){
 
     cy_rslt_t result;
 
-    //pointer to client handle passed through arg
-    cy_socket_t* client_handle = arg;
+    //listener passed through arg
+    tcp_listener_t *listener = arg;
 
     // var to store the address of the connecting client
     cy_socket_sockaddr_t peer_addr;
@@ -317,27 +528,46 @@ cy_rslt_t tcp_connection_handler(cy_socket_t socket_handle, void *arg){
     /* Size of the peer socket address. */
     uint32_t peer_addr_len;
 
-    /* Accept new incoming connection from a TCP client.*/
-    result = cy_socket_accept(socket_handle, &peer_addr, &peer_addr_len, client_handle);
-
-    // Vars to determine if the connection was secure or non-secure
-	cy_socket_tls_auth_mode_t tls_auth_mode;
-	uint32_t length = sizeof(cy_socket_tls_auth_mode_t);
-	cy_socket_getsockopt(socket_handle, CY_SOCKET_SOL_TLS, CY_SOCKET_SO_TLS_AUTH_MODE, &tls_auth_mode, &length);
+    /* Accept new incoming connection from a TCP client. On the secure port
+     * this is where the TLS handshake happens. */
+    TickType_t start = xTaskGetTickCount();
+    result = cy_socket_accept(socket_handle, &peer_addr, &peer_addr_len, &listener->client_handle);
+    TickType_t ticks = xTaskGetTickCount() - start;
 
     if(result == CY_RSLT_SUCCESS){
-		// Print Connection Info to the appropriate buffer
-		if(tls_auth_mode == CY_SOCKET_TLS_VERIFY_REQUIRED){
-			sprintf(secureBuffer,"Connection from IP: %d.%d.%d.%d\tConnection: Secure\t",(uint8)peer_addr.ip_address.ip.v4,
-																						 (uint8)(peer_addr.ip_address.ip.v4 >> 8),
-																						 (uint8)(peer_addr.ip_address.ip.v4 >> 16),
-																						 (uint8)(peer_addr.ip_address.ip.v4 >> 24));
+		statsAdd(&listener->stats.connections, 1);
+		statsAdd(&listener->stats.handshakeMs, ticks * portTICK_PERIOD_MS);
+		statsRecord(listener->stats.handshake, ticks * portTICK_PERIOD_MS);
+
+		// A client over its rate limit is closed before it takes a session.
+		// On the secure port this is after the TLS handshake, the limit does
+		// not save the handshake of a client that is turned away.
+		if(!rateAllow(peer_addr.ip_address.ip.v4, TCP_RATE_CONNECT_COST)){
+			statsAdd(&listener->stats.limitedConnections, 1);
+			closeSocket(listener->client_handle);
+			return result;
 		}
-		else{
-			sprintf(nonSecureBuffer,"Connection from IP: %d.%d.%d.%d\tConnection: Non-Secure\t",(uint8)peer_addr.ip_address.ip.v4,
-																						 (uint8)(peer_addr.ip_address.ip.v4 >> 8),
-																						 (uint8)(peer_addr.ip_address.ip.v4 >> 16),
-																						 (uint8)(peer_addr.ip_address.ip.v4 >> 24));
+
+		// Every client gets its own context
+		tcp_session_t *session = sessionOpen(listener->client_handle, listener->security);
+		if(session == NULL){
+			printf("Too many clients, connection refused\n");
+			statsAdd(&listener->stats.refused, 1);
+			closeSocket(listener->client_handle);
+			return result;
+		}
+
+		session->peerAddress = peer_addr.ip_address.ip.v4;
+
+		// Print Connection Info to the client's buffer
+		session->logLength = 0;
+		logPrintf(session, "Connection from IP: %d.%d.%d.%d\tConnection: %s\t",(uint8)peer_addr.ip_address.ip.v4,
+																					 (uint8)(peer_addr.ip_address.ip.v4 >> 8),
+																					 (uint8)(peer_addr.ip_address.ip.v4 >> 16),
+																					 (uint8)(peer_addr.ip_address.ip.v4 >> 24),
+																					 listener->security ? "Secure" : "Non-Secure");
+		if(listener->security){
+			logPrintf(session, "Handshake: %d ms\t", (int)(ticks * portTICK_PERIOD_MS));
 		}
     }
     else{
@@ -346,240 +576,1665 @@ cy_rslt_t tcp_connection_handler(cy_socket_t socket_handle, void *arg){
 
     return result;
 }
+
 /*******************************************************************************
-* Function Name: sendAck
+* Function Name: rateAllow
 *******************************************************************************
 * Summary:
-* Function to send acknowledgement to tcp client.
-*
-* Parameters:
-* char *message: message to send
-* cy_socket_t socket_handle: Connection handle for the TCP client socket
+* Take cost tokens from the rate limit of a client address. The leader of a
+* follower is never limited, a lost replication connection costs a full copy.
 *
 * Return:
-*  void
+*  bool: false if the client is over its limit and must be closed
 *
 *******************************************************************************/
-void sendAck(char *message, cy_socket_t socket_handle, bool security){
+static bool rateAllow(uint32_t address, uint32_t cost){
+#ifdef TCP_REPLICATION_LEADER
+	if(address == TCP_REPLICATION_LEADER){
+		return true;
+	}
+#endif
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	bool allowed = rateTake(address, cost, xTaskGetTickCount() * portTICK_PERIOD_MS);
+	xSemaphoreGive(sessionMutex);
+	return allowed;
+}
 
-	cy_rslt_t result;
-	uint32_t bytes_sent;
-	// Buffer for creating the connection information prints
-	char writeBuffer[30];
+/*******************************************************************************
+* Function Name: logAppend
+*******************************************************************************
+* Summary:
+* Append length characters of text to the connection information print of a
+* client, whatever does not fit is dropped.
+*
+*******************************************************************************/
+static void logAppend(tcp_session_t *session, const char *text, uint32_t length){
+	uint32_t room = sizeof(session->log) - 1 - session->logLength;
+	if(length > room){
+		length = room;
+	}
+	memcpy(&session->log[session->logLength], text, length);
+	session->logLength += length;
+	session->log[session->logLength] = '\0';
+}
 
-	/* Send the command to TCP server. */
-	result = cy_socket_send(socket_handle, message, MAX_TCP_DATA_PACKET_LENGTH, CY_SOCKET_FLAGS_NONE, &bytes_sent);
-	if(result == CY_RSLT_SUCCESS ){
-		if(security){
-			sprintf(writeBuffer,"Response: %s\n", message);
-			strcat(secureBuffer, writeBuffer);
+/*******************************************************************************
+* Function Name: logPrintf
+*******************************************************************************
+* Summary:
+* printf onto the connection information print of a client, for the rare
+* prints that need formatting.
+*
+*******************************************************************************/
+static void logPrintf(tcp_session_t *session, const char *format, ...){
+	char text[SESSION_LOG_SIZE];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	if(length > 0){
+		logAppend(session, text, ((uint32_t)length < sizeof(text)) ? (uint32_t)length : sizeof(text) - 1);
+	}
+}
+
+/*******************************************************************************
+* Function Name: logMessage
+*******************************************************************************
+* Summary:
+* Append the command a client sent to its connection information print.
+*
+*******************************************************************************/
+static void logMessage(tcp_session_t *session, const char *message, uint32_t length){
+	logAppend(session, "Message: ", 9);
+	logAppend(session, message, length);
+	logAppend(session, "\t", 1);
+}
+
+/*******************************************************************************
+* Function Name: logLength
+*******************************************************************************
+* Summary:
+* Append the length of a command that was refused to the connection
+* information print of a client.
+*
+*******************************************************************************/
+static void logLength(tcp_session_t *session, uint32_t length){
+	char text[12];
+	char *end = textPutDecimal(text, length);
+	logAppend(session, "Message: Length: ", 17);
+	logAppend(session, text, end - text);
+	logAppend(session, "\t", 1);
+}
+
+/*******************************************************************************
+* Function Name: logConnection
+*******************************************************************************
+* Summary:
+* Append text to the connection information print of a client.
+*
+*******************************************************************************/
+static void logConnection(tcp_session_t *session, const char *text){
+	logAppend(session, text, strlen(text));
+}
+
+/*******************************************************************************
+* Function Name: printConnection
+*******************************************************************************
+* Summary:
+* Print the connection information of a client and start a new one.
+*
+*******************************************************************************/
+static void printConnection(tcp_session_t *session){
+	printf("%s", session->log);
+	session->log[0] = '\0';
+	session->logLength = 0;
+}
 
+/*******************************************************************************
+* Function Name: sessionOpen
+*******************************************************************************
+* Summary:
+* Take a free session for a newly accepted client socket. Returns NULL if all
+* of the sessions are in use.
+*
+*******************************************************************************/
+static tcp_session_t *sessionOpen(cy_socket_t socket_handle, bool security){
+	tcp_session_t *session = NULL;
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	for(int i = 0; i < TCP_SERVER_MAX_SESSIONS; i++){
+		if(sessions[i].socket == NULL){
+			session = &sessions[i];
+			session->socket = socket_handle;
+			session->security = security;
+			session->mode = SESSION_MODE_NEW;
+			session->busy = false;
+			session->rxLength = 0;
+			session->log[0] = '\0';
+			session->logLength = 0;
+			session->commands = 0;
+			session->watchCount = 0;
+			session->eventCount = 0;
+			session->eventOverflow = false;
+			session->lastActivity = xTaskGetTickCount();
+			session->acceptTick = session->lastActivity;
+			session->responded = false;
+			break;
 		}
-		else{
-			sprintf(writeBuffer,"Response: %s\n", message);
-			strcat(nonSecureBuffer, writeBuffer);
+	}
+	xSemaphoreGive(sessionMutex);
+	return session;
+}
+
+/*******************************************************************************
+* Function Name: sessionFind
+*******************************************************************************
+* Summary:
+* Find the session of a client socket, NULL if the socket has none.
+* Must be called with sessionMutex held.
+*
+*******************************************************************************/
+static tcp_session_t *sessionFind(cy_socket_t socket_handle){
+	for(int i = 0; i < TCP_SERVER_MAX_SESSIONS; i++){
+		if(sessions[i].socket != NULL && sessions[i].socket == socket_handle){
+			return &sessions[i];
 		}
 	}
-	else{
-		printf("Failed to send ack to client. Error: %d\n", (int)result);
+	return NULL;
+}
+
+/*******************************************************************************
+* Function Name: sessionRelease
+*******************************************************************************
+* Summary:
+* Give back the session of a client socket before the socket is deleted.
+* Only the caller that gets true deletes the socket, so a client closed by
+* the server and by its peer at the same time is deleted once.
+*
+* Return:
+*  bool: false if the socket has no session, another close already has it
+*
+*******************************************************************************/
+static bool sessionRelease(cy_socket_t socket_handle){
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	tcp_session_t *session = sessionFind(socket_handle);
+	if(session != NULL){
+		session->socket = NULL;
+		watchTotal -= session->watchCount;
+		session->watchCount = 0;
 	}
+	xSemaphoreGive(sessionMutex);
+	return session != NULL;
+}
 
+/*******************************************************************************
+* Function Name: closeSocket
+*******************************************************************************
+* Summary:
+* Disconnect and delete a client socket. The peer may have gone already, so
+* a failure is only printed and the socket is deleted anyway.
+*
+*******************************************************************************/
+static void closeSocket(cy_socket_t socket_handle){
+
+	cy_rslt_t result;
 
-	// Disconnect once the ack has been sent
 	result = cy_socket_disconnect(socket_handle, 0);
 	if(result != CY_RSLT_SUCCESS){
-		printf("Disconnect Failed!\n");
-		CY_ASSERT(0);
+		printf("Disconnect Failed! Error: %d\n", (int)result);
 	}
 	/* Delete the client socket. */
 	result = cy_socket_delete(socket_handle);
 	if(result != CY_RSLT_SUCCESS){
-		printf("Socket Delete Failed!\n");
-		CY_ASSERT(0);
+		printf("Socket Delete Failed! Error: %d\n", (int)result);
 	}
+}
 
-	// Print the connection information
-	if(security){
-		printf("%s", secureBuffer);
-	}
-	else{
-		printf("%s", nonSecureBuffer);
+/*******************************************************************************
+* Function Name: closeClient
+*******************************************************************************
+* Summary:
+* Release the session of a client and disconnect and delete its socket,
+* unless another close got to the session first.
+*
+*******************************************************************************/
+static void closeClient(cy_socket_t socket_handle){
+	if(sessionRelease(socket_handle)){
+		closeSocket(socket_handle);
 	}
 }
 
+/*******************************************************************************
+* Function Name: sessionCloseIdle
+*******************************************************************************
+* Summary:
+* Close the sessions of one listener that have not received a command within
+* TCP_SERVER_SESSION_IDLE_TIMEOUT_MS, or TCP_SERVER_SECURE_IDLE_TIMEOUT_MS on
+* the secure port, and the clients that have sent nothing at all within
+* TCP_SERVER_FIRST_FRAME_TIMEOUT_MS of being accepted. A session that a
+* receive callback is using is left for the next poll, and a session that is
+* watching registers is waiting for the server so it is never idle.
+*
+*******************************************************************************/
+static void sessionCloseIdle(bool security){
+
+	cy_socket_t idle[TCP_SERVER_MAX_SESSIONS];
+	int idleCount = 0;
+	TickType_t now = xTaskGetTickCount();
+	TickType_t timeout = pdMS_TO_TICKS(security ? TCP_SERVER_SECURE_IDLE_TIMEOUT_MS : TCP_SERVER_SESSION_IDLE_TIMEOUT_MS);
+
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	for(int i = 0; i < TCP_SERVER_MAX_SESSIONS; i++){
+		tcp_session_t *session = &sessions[i];
+		TickType_t limit = (session->mode == SESSION_MODE_NEW) ? pdMS_TO_TICKS(TCP_SERVER_FIRST_FRAME_TIMEOUT_MS) : timeout;
+		if(session->socket != NULL && !session->busy && session->security == security && session->watchCount == 0 &&
+		   (now - session->lastActivity) >= limit){
+			idle[idleCount++] = session->socket;
+			session->socket = NULL;
+		}
+	}
+	xSemaphoreGive(sessionMutex);
 
- /*******************************************************************************
- * Function Name: tcp_receive_msg_handler
- *******************************************************************************
- * Summary:
- *  Callback function to handle incoming TCP client messages.
- *
- * Parameters:
- * cy_socket_t socket_handle: Connection handle for the TCP client socket
- *  void *arg : Bool representing whether the received message came from the secure or non secure socket
- *
- * Return:
- *  cy_result result: Result of the operation
- *
- *******************************************************************************/
-cy_rslt_t tcp_receive_msg_handler(cy_socket_t socket_handle, void *arg){
-
-	// Security var passed in
-	bool security = (*(bool*)arg);
-
-    cy_rslt_t result;
-
-    // buffer to store the message that is being recieved
-    char message_buffer[MAX_TCP_RECV_BUFFER_SIZE];
-
-    // Buffer for creating the connection information prints
-    char writeBuffer[30];
+	for(int i = 0; i < idleCount; i++){
+		printf("Session idle, closing connection\n");
+		closeSocket(idle[i]);
+	}
+}
 
-    // linked list to store connection information in
-    static dbEntry_t head = {
-    	.next = NULL,
-    	.deviceId = 0,
-    	.regId = 0
-    };
+/*******************************************************************************
+* Function Name: dbWriteLock
+*******************************************************************************
+* Summary:
+* Start changing the database. Writers are serialized by dbMutex and every
+* reader that overlaps the change retries (see dbRead).
+*
+*******************************************************************************/
+static void dbWriteLock(void){
+	xSemaphoreTake(dbMutex, portMAX_DELAY);
+	dbWriteBegin();
+}
 
-    //new database entry to add onto the list
-    dbEntry_t receive;
+/*******************************************************************************
+* Function Name: dbWriteUnlock
+*******************************************************************************
+* Summary:
+* Finish changing the database.
+*
+*******************************************************************************/
+static void dbWriteUnlock(void){
+	dbWriteEnd();
+	xSemaphoreGive(dbMutex);
+}
 
-    // var to store commandID - W/R
-    char commandId;
+/*******************************************************************************
+* Function Name: dbSync
+*******************************************************************************
+* Summary:
+* Write the database changes logged since the last write to storage, at most
+* every TCP_SERVER_DB_SYNC_MS. Called by the server tasks every
+* TCP_SERVER_SESSION_POLL_MS, so all the writes in between share one page
+* write, and a change that was replied to is lost by a reset before it.
+*
+*******************************************************************************/
+static void dbSync(void){
+	if(!dbStoreDirty() || (xTaskGetTickCount() - dbSynced) < pdMS_TO_TICKS(TCP_SERVER_DB_SYNC_MS)){
+		return;
+	}
+	xSemaphoreTake(dbMutex, portMAX_DELAY);
+	dbSynced = xTaskGetTickCount();
+	dbStoreFlush();
+	const dbStoreStats_t *stats = dbStoreGetStats();
+	bool compacted = (stats->snapshots != dbSnapshots);
+	dbSnapshots = stats->snapshots;
+	uint32_t amplification = (stats->bytesLogged > 0) ? (uint32_t)(((uint64_t)stats->bytesWritten * 100) / stats->bytesLogged) : 0;
+	xSemaphoreGive(dbMutex);
+
+	if(compacted){
+		printf("Database compacted, %d bytes written for %d bytes logged (x%d.%02d)\n",
+				(int)stats->bytesWritten, (int)stats->bytesLogged, (int)(amplification / 100), (int)(amplification % 100));
+	}
+}
 
-    /* Variable to store number of bytes received from TCP client. */
-    uint32_t bytes_received = 0;
+/*******************************************************************************
+* Function Name: ttlClock
+*******************************************************************************
+* Summary:
+* Seconds since the server started, for the register TTLs. Counted from the
+* tick count a whole second at a time so it carries on when the tick count
+* wraps. Must be called with dbMutex held.
+*
+*******************************************************************************/
+static uint32_t ttlClock(void){
+	TickType_t whole = (xTaskGetTickCount() - ttlCounted) / pdMS_TO_TICKS(1000);
+	ttlSeconds += whole;
+	ttlCounted += whole * pdMS_TO_TICKS(1000);
+	return ttlSeconds;
+}
 
-    // Receive
-    result = cy_socket_recv(socket_handle, message_buffer, MAX_TCP_RECV_BUFFER_SIZE,
-                            CY_SOCKET_FLAGS_NONE, &bytes_received);
+/*******************************************************************************
+* Function Name: dbExpire
+*******************************************************************************
+* Summary:
+* Remove the registers whose TTL has run out. Called by the server tasks
+* every TCP_SERVER_SESSION_POLL_MS, the readers only retry while a register
+* is actually being removed.
+*
+*******************************************************************************/
+static void dbExpire(void){
+	xSemaphoreTake(dbMutex, portMAX_DELAY);
+	dbExpiryRun(ttlClock(), expireRegister);
+	xSemaphoreGive(dbMutex);
+}
 
-    // buffer to store message to send
-    char returnMessage[MAX_TCP_RECV_BUFFER_SIZE];
+/*******************************************************************************
+* Function Name: statsCommand
+*******************************************************************************
+* Summary:
+* Count a command received on the listener of a session. The command is the
+* first character of an ASCII command or binMagic for a binary frame. A
+* session counts as reused at its second command, the first one that did
+* not need a connection of its own.
+*
+*******************************************************************************/
+static void statsCommand(tcp_session_t *session, char command){
+	serverStats_t *stats = &listeners[session->security ? 1 : 0].stats;
+	if(++session->commands == 2){
+		statsAdd(&stats->reused, 1);
+	}
+	switch((uint8_t)command){
+		case 'R': statsAdd(&stats->commands[statsCmdRead], 1); break;
+		case 'W':
+		case 'T':
+		case 'L': statsAdd(&stats->commands[statsCmdWrite], 1); break;
+		case 'M': statsAdd(&stats->commands[statsCmdBatch], 1); break;
+		case 'D': statsAdd(&stats->commands[statsCmdRange], 1); break;
+		case 'S':
+		case 'U': statsAdd(&stats->commands[statsCmdWatch], 1); break;
+		case 'Q': statsAdd(&stats->commands[statsCmdStats], 1); break;
+		case binMagic: statsAdd(&stats->commands[statsCmdBinary], 1); break;
+		default: break; // counted as an error by its reply
+	}
+}
 
-    //create char* containing message so strlen() can be used to find length
-    char *messageString = &message_buffer[0];
+/*******************************************************************************
+* Function Name: cacheCount
+*******************************************************************************
+* Summary:
+* Count a read of a register by a session as a hit if the register is in the
+* database or a miss if it is not.
+*
+*******************************************************************************/
+static void cacheCount(tcp_session_t *session, bool hit){
+	serverStats_t *stats = &listeners[session->security ? 1 : 0].stats;
+	statsAdd(hit ? &stats->cacheHits : &stats->cacheMisses, 1);
+}
 
-    if(result == CY_RSLT_SUCCESS)
-    {
+/*******************************************************************************
+* Function Name: statsReply
+*******************************************************************************
+* Summary:
+* Count a reply sent to a session: the time since the receive it answers, the
+* time since the client was accepted if it is the first reply, and the errors
+* in the reply text. reply may be NULL for a reply with no errors to count.
+*
+*******************************************************************************/
+static void statsReply(tcp_session_t *session, const char *reply){
+	serverStats_t *stats = &listeners[session->security ? 1 : 0].stats;
+	TickType_t now = xTaskGetTickCount();
+
+	statsRecord(stats->latency, (now - session->lastActivity) * portTICK_PERIOD_MS);
+	if(!session->responded){
+		session->responded = true;
+		statsRecord(stats->firstResponse, (now - session->acceptTick) * portTICK_PERIOD_MS);
+	}
 
-        // to many characters, reject
-        if(strlen(messageString) > 12){
-			snprintf(returnMessage, MAX_TCP_RECV_BUFFER_SIZE , "X illegal length");
-			if(security){
-				sprintf(writeBuffer,"Message: Length: %d\t", strlen(messageString));
-				strcat(secureBuffer, writeBuffer);
+	if(reply == NULL){
+		return;
+	}
+	if(reply[0] == 'X'){
+		if(strncmp(reply, "X illegal length", 16) == 0){
+			statsAdd(&stats->errors[statsErrLength], 1);
+		}
+		else if(strncmp(reply, "X illegal command", 17) == 0){
+			statsAdd(&stats->errors[statsErrCommand], 1);
+		}
+		else if(strncmp(reply, "X illegal character", 19) == 0){
+			statsAdd(&stats->errors[statsErrCharacter], 1);
+		}
+		else if(strncmp(reply, "X Database Full", 15) == 0){
+			statsAdd(&stats->errors[statsErrFull], 1);
+		}
+		else if(strncmp(reply, "X Not Found", 11) == 0){
+			statsAdd(&stats->errors[statsErrNotFound], 1);
+		}
+	}
+	else if(reply[0] == 'M'){
+		// one status per command of the batch
+		uint32_t length = strlen(reply);
+		for(uint32_t i = 1; i < length; i += TCP_BATCH_ENTRY_LENGTH){
+			if(reply[i] == 'F'){
+				statsAdd(&stats->errors[statsErrFull], 1);
 			}
-			else{
-				sprintf(writeBuffer,"Message: Length: %d\t", strlen(messageString));
-				strcat(nonSecureBuffer, writeBuffer);
+			else if(reply[i] == 'N'){
+				statsAdd(&stats->errors[statsErrNotFound], 1);
 			}
-			sendAck(returnMessage, socket_handle, security);
-			return result;
 		}
+	}
+}
+
+/*******************************************************************************
+* Function Name: statsBinary
+*******************************************************************************
+* Summary:
+* Count the errors in the status of a binary reply (see processBinary).
+*
+*******************************************************************************/
+static void statsBinary(tcp_session_t *session, uint8_t status){
+	serverStats_t *stats = &listeners[session->security ? 1 : 0].stats;
+	if(status == 'X'){
+		statsAdd(&stats->errors[statsErrFrame], 1);
+	}
+	else if(status == 'F'){
+		statsAdd(&stats->errors[statsErrFull], 1);
+	}
+	else if(status == 'N'){
+		statsAdd(&stats->errors[statsErrNotFound], 1);
+	}
+}
+
+/*******************************************************************************
+* Function Name: statsServerGet
+*******************************************************************************
+* Summary:
+* Copy the counters of the whole server for statsJson. The caller holds
+* sessionMutex, which serializes the rate limit table. The pool counters are
+* read without dbMutex, each is a single word.
+*
+*******************************************************************************/
+static void statsServerGet(statsServer_t *server){
+	const rateStats_t *rate = rateGetStats();
+	server->rateEvictions = rate->evictions;
+	server->rateTableFull = rate->tableFull;
+	server->poolInUse = dbPoolInUse();
+	server->poolSize = dbPoolSize;
+	server->poolHighWater = dbPoolHighWater();
+}
+
+/*******************************************************************************
+* Function Name: processStats
+*******************************************************************************
+* Summary:
+* Execute a Q command from a session. The reply is one frame holding the
+* counters and histograms of the port the session is on as a JSON object
+* and the counters of the whole server (see statsJson), TCP_STATS_JSON_SIZE at
+* most. The counters are copied out while holding sessionMutex and sent after
+* it is released.
+*
+* Return:
+*  cy_rslt_t: result of sending the reply
+*
+*******************************************************************************/
+static cy_rslt_t processStats(tcp_session_t *session){
+
+	// too big for the callback stack, the receive callbacks run one at a time
+	static uint8_t json[TCP_SESSION_FRAME_HEADER + TCP_STATS_JSON_SIZE];
+	tcp_listener_t *listener = &listeners[session->security ? 1 : 0];
+	uint32_t bytes_sent;
+	cy_rslt_t result;
+
+	statsReply(session, NULL);
+
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	statsServer_t server;
+	statsServerGet(&server);
+	uint32_t length = statsJson(&listener->stats, &server, listener->port, (char *)&json[TCP_SESSION_FRAME_HEADER], TCP_STATS_JSON_SIZE);
+	if(length >= TCP_STATS_JSON_SIZE){
+		length = TCP_STATS_JSON_SIZE - 1; // cut short, the client sees bad JSON
+	}
+	xSemaphoreGive(sessionMutex);
+
+	json[0] = (uint8_t)(length >> 8);
+	json[1] = (uint8_t)length;
+	result = cy_socket_send(session->socket, json, TCP_SESSION_FRAME_HEADER + length, CY_SOCKET_FLAGS_NONE, &bytes_sent);
+
+	if(result != CY_RSLT_SUCCESS){
+		printf("Failed to send ack to client. Error: %d\n", (int)result);
+	}
+	logConnection(session, "Message: Q\tResponse: stats\n");
+	printConnection(session);
+
+	return result;
+}
+
+/*******************************************************************************
+* Function Name: statsPrint
+*******************************************************************************
+* Summary:
+* Print the counters and histograms of a listener to the UART as JSON.
+*
+*******************************************************************************/
+static void statsPrint(tcp_listener_t *listener){
+	static char json[TCP_STATS_JSON_SIZE];
+	statsServer_t server;
+
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	statsServerGet(&server);
+	statsJson(&listener->stats, &server, listener->port, json, sizeof(json));
+	xSemaphoreGive(sessionMutex);
+	printf("%s\n", json);
+}
+
+/*******************************************************************************
+* Function Name: sendAck
+*******************************************************************************
+* Summary:
+* Function to send acknowledgement to tcp client.
+*
+* Parameters:
+* char *message: message to send
+* tcp_session_t *session: the client
+*
+* Return:
+*  void
+*
+*******************************************************************************/
+void sendAck(char *message, tcp_session_t *session){
+
+	cy_rslt_t result;
+	uint32_t bytes_sent;
+	cy_socket_t socket_handle = session->socket;
+
+	/* Send the command to TCP server. */
+	result = cy_socket_send(socket_handle, message, MAX_TCP_DATA_PACKET_LENGTH, CY_SOCKET_FLAGS_NONE, &bytes_sent);
+	if(result == CY_RSLT_SUCCESS ){
+		logConnection(session, "Response: ");
+		logConnection(session, message);
+		logConnection(session, "\n");
+		statsReply(session, message);
+	}
+	else{
+		printf("Failed to send ack to client. Error: %d\n", (int)result);
+	}
+
+	// Print the connection information
+	printConnection(session);
+
+	// Disconnect once the ack has been sent
+	closeClient(socket_handle);
+}
+
+/*******************************************************************************
+* Function Name: sendFramedAck
+*******************************************************************************
+* Summary:
+* Send the reply to one command of a session. The reply text is in the session
+* reply buffer after the frame header, and is framed the same way as the
+* commands, a 2 byte big endian length followed by the reply text. The
+* connection is left open.
+*
+*******************************************************************************/
+static cy_rslt_t sendFramedAck(tcp_session_t *session){
+
+	cy_rslt_t result;
+	uint32_t bytes_sent;
+	char *message = (char *)&session->reply[TCP_SESSION_FRAME_HEADER];
+	uint32_t length = strlen(message);
+
+	session->reply[0] = (uint8_t)(length >> 8);
+	session->reply[1] = (uint8_t)length;
+
+	result = cy_socket_send(session->socket, session->reply, TCP_SESSION_FRAME_HEADER + length, CY_SOCKET_FLAGS_NONE, &bytes_sent);
+	if(result == CY_RSLT_SUCCESS){
+		logConnection(session, "Response: ");
+		logAppend(session, message, (length < 17) ? length : 17);
+		logConnection(session, "\n");
+		statsReply(session, message);
+	}
+	else{
+		printf("Failed to send ack to client. Error: %d\n", (int)result);
+	}
+
+	// Print the command and start a new line for the next one
+	printConnection(session);
+
+	return result;
+}
+
+/*******************************************************************************
+* Function Name: watchNotify
+*******************************************************************************
+* Summary:
+* Queue a changed register and its new value for every session watching it.
+* A register already waiting to be pushed only has its value replaced, so a
+* burst of changes between pushes is sent as one event. Called by the
+* database writer, so sessionMutex is always taken after dbMutex and with the
+* database sequence odd: sessionPushEvents sends the values kept here and
+* never reads the database while holding sessionMutex.
+*
+*******************************************************************************/
+static void watchNotify(const dbEntry_t *entry, uint32_t value){
+
+	if(watchTotal == 0){
+		return; // nobody is watching, the usual case
+	}
+
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	for(int i = 0; i < TCP_SERVER_MAX_SESSIONS; i++){
+		tcp_session_t *session = &sessions[i];
+		bool watched = false;
+		if(session->socket == NULL){
+			continue;
+		}
+		for(uint32_t j = 0; j < session->watchCount && !watched; j++){
+			watched = (session->watches[j].deviceId == entry->deviceId &&
+					   (session->watches[j].regId == TCP_WATCH_ALL_REGISTERS || session->watches[j].regId == entry->regId));
+		}
+		if(!watched || session->eventOverflow){
+			continue;
+		}
+		// already waiting to be pushed?
+		uint32_t j = 0;
+		while(j < session->eventCount && (session->events[j].deviceId != entry->deviceId || session->events[j].regId != entry->regId)){
+			j++;
+		}
+		if(j < session->eventCount){
+			session->events[j].value = value;
+		}
+		else if(session->eventCount < TCP_SESSION_MAX_EVENTS){
+			session->events[session->eventCount].deviceId = entry->deviceId;
+			session->events[session->eventCount].regId = entry->regId;
+			session->events[session->eventCount].value = value;
+			session->eventCount++;
+		}
+		else{
+			session->eventOverflow = true;
+		}
+	}
+	xSemaphoreGive(sessionMutex);
+}
+
+/*******************************************************************************
+* Function Name: processWatch
+*******************************************************************************
+* Summary:
+* Check and execute an S or U command from a session and build the reply.
+*  SDDDDRR  watch a register         UDDDDRR  stop watching a register
+*  SDDDD    watch every register     UDDDD    stop watching the device
+*           of a device              U        stop watching everything
+* The reply is the command itself, an F if the session already has
+* TCP_SESSION_MAX_WATCHES watches, or an X if the command is wrong.
+*
+* A change to a watched register is pushed to the session as a frame holding
+* an 'E' followed by a DDDDRRVVVV for every register that changed since the
+* last push. If more than TCP_SESSION_MAX_EVENTS registers changed the frame
+* is an 'O' instead, and the client must read the registers again.
+*
+*******************************************************************************/
+static void processWatch(const char *message, uint32_t length, char *returnMessage, uint32_t returnSize, tcp_session_t *session){
+
+	tcp_watch_t watch = { .deviceId = 0, .regId = TCP_WATCH_ALL_REGISTERS };
+	bool all = (length == 1);
+	char reply = message[0];
+
+	// Check that it is the correct length and all hex after the S/U
+	bool legal = (length == 5 || length == 7 || (length == 1 && message[0] == 'U'));
+	if(legal && length >= 5){
+		legal = textHex(&message[1], 4, &watch.deviceId);
+	}
+	if(legal && length == 7){
+		legal = textHex(&message[5], 2, &watch.regId);
+	}
+	if(!legal){
+		snprintf(returnMessage, returnSize, "X illegal command");
+		logLength(session, length);
+		return;
+	}
 
-        // Check that it is the correct length and has a legal command
-        if(!((strlen(messageString) == 7 && message_buffer[0] == 'R') || (strlen(messageString) == 11 && message_buffer[0] == 'W'))){
-        	snprintf(returnMessage, MAX_TCP_RECV_BUFFER_SIZE, "X illegal command");
-        	if(security){
-				sprintf(writeBuffer,"Message: Length: %d\t", strlen(messageString));
-				strcat(secureBuffer, writeBuffer);
+	xSemaphoreTake(sessionMutex, portMAX_DELAY);
+	if(message[0] == 'S'){
+		bool found = false;
+		for(uint32_t i = 0; i < session->watchCount && !found; i++){
+			found = (session->watches[i].deviceId == watch.deviceId && session->watches[i].regId == watch.regId);
+		}
+		if(!found && session->watchCount == TCP_SESSION_MAX_WATCHES){
+			reply = 'F';
+		}
+		else if(!found){
+			session->watches[session->watchCount++] = watch;
+			watchTotal++;
+		}
+	}
+	else{
+		uint32_t kept = 0;
+		for(uint32_t i = 0; i < session->watchCount; i++){
+			if(!all && (session->watches[i].deviceId != watch.deviceId || session->watches[i].regId != watch.regId)){
+				session->watches[kept++] = session->watches[i];
+			}
+		}
+		watchTotal -= session->watchCount - kept;
+		session->watchCount = kept;
+	}
+	xSemaphoreGive(sessionMutex);
+
+	// the command itself, at most 7 bytes and returnSize is larger
+	char *end = textPutText(returnMessage, message, length);
+	*end = '\0';
+	returnMessage[0] = reply;
+	logMessage(session, message, length);
+}
+
+/*******************************************************************************
+* Function Name: sessionPushEvents
+*******************************************************************************
+* Summary:
+* Send the registers that changed since the last poll to the sessions of one
+* listener that are watching them (see processWatch). A session that a
+* receive callback is using gets its events at the next poll. Each frame is
+* built from the values kept by watchNotify while holding sessionMutex, and
+* sent after it is released.
+*
+*******************************************************************************/
+static void sessionPushEvents(bool security){
+
+	// one per listener task, the receive callbacks keep the session reply buffer
+	static uint8_t frames[2][TCP_SESSION_FRAME_HEADER + 1 + TCP_SESSION_MAX_EVENTS * TCP_RANGE_ENTRY_LENGTH];
+	uint8_t *frame = frames[security ? 1 : 0];
+	uint32_t bytes_sent;
+
+	if(watchTotal == 0){
+		return;
+	}
+
+	for(int i = 0; i < TCP_SERVER_MAX_SESSIONS; i++){
+		tcp_session_t *session = &sessions[i];
+		cy_socket_t socket_handle = NULL;
+		uint32_t length = 1;
+
+		xSemaphoreTake(sessionMutex, portMAX_DELAY);
+		if(session->socket != NULL && !session->busy && session->security == security && (session->eventCount > 0 || session->eventOverflow)){
+			char *event = (char *)&frame[TCP_SESSION_FRAME_HEADER];
+			if(session->eventOverflow){
+				event[0] = 'O';
 			}
 			else{
-				sprintf(writeBuffer,"Message: Length: %d\t", strlen(messageString));
-				strcat(nonSecureBuffer, writeBuffer);
+				event[0] = 'E';
+				for(uint32_t j = 0; j < session->eventCount; j++){
+					dbEntry_t changed = { .deviceId = session->events[j].deviceId, .regId = session->events[j].regId, .value = session->events[j].value };
+					textPutEntry(&event[length], &changed);
+					length += TCP_RANGE_ENTRY_LENGTH;
+				}
 			}
-        	sendAck(returnMessage, socket_handle, security);
-        	return result;
-        }
+			session->eventCount = 0;
+			session->eventOverflow = false;
+			socket_handle = session->socket;
+		}
+		xSemaphoreGive(sessionMutex);
 
-        // All of the bytes must be a ASCII hex digit from 1->end of string
-        for(int i = 1; i < strlen(messageString); i++){
-        	if(!isxdigit((int)message_buffer[i])){
-        		snprintf(returnMessage, MAX_TCP_RECV_BUFFER_SIZE, "X illegal character");
-        		if(security){
-					sprintf(writeBuffer,"Message: Length: %d\t", strlen(messageString));
-					strcat(secureBuffer, writeBuffer);
-				}
-				else{
-					sprintf(writeBuffer,"Message: Length: %d\t", strlen(messageString));
-					strcat(nonSecureBuffer, writeBuffer);
-				}
-        		sendAck(returnMessage, socket_handle, security);
-        		return result;
-        	}
-        }
+		if(socket_handle == NULL){
+			continue;
+		}
+		frame[0] = (uint8_t)(length >> 8);
+		frame[1] = (uint8_t)length;
+		if(cy_socket_send(socket_handle, frame, TCP_SESSION_FRAME_HEADER + length, CY_SOCKET_FLAGS_NONE, &bytes_sent) != CY_RSLT_SUCCESS){
+			printf("Failed to send event to client.\n");
+			continue;
+		}
+		char count[12];
+		*textPutDecimal(count, (length - 1) / TCP_RANGE_ENTRY_LENGTH) = '\0';
+		printf("Event: %s registers\n", count);
+	}
+}
 
-        // Write command
-        if(message_buffer[0] == 'W'){
-        	//parse the string
-        	sscanf((const char*)message_buffer,"%c%4x%2x%4x", (char *)&commandId, (int*)&receive.deviceId, (int*)&receive.regId, (int*)&receive.value);
-        	receive.next = NULL;
-
-        	//See if the device is already in the database, or if there's room to add it
-        	if((dbFind(&head, &receive) != NULL) || (dbGetCount(&head) <= dbGetMax())){
-        		sprintf(returnMessage,"A%04X%02X%04X",(unsigned int)receive.deviceId,(unsigned int)receive.regId,(unsigned int)receive.value);
-        		dbEntry_t *newDB = malloc(sizeof(dbEntry_t)); // make a new entry to put in the database
-        		memcpy(newDB,&receive,sizeof(dbEntry_t)); // copy the received data into the new entry
-        		dbSetValue(&head, newDB); // save it.
-        		if(security){
-					sprintf(writeBuffer,"Message: %s\t", messageString);
-					strcat(secureBuffer, writeBuffer);
+/*******************************************************************************
+* Function Name: ttlRegister
+*******************************************************************************
+* Summary:
+* Give a register in the database a TTL in seconds, or take it away with 0.
+* On a leader the change is kept for the follower. Must be called between
+* dbWriteLock and dbWriteUnlock.
+*
+*******************************************************************************/
+static void ttlRegister(dbEntry_t *entry, uint32_t ttl){
+	dbSetExpiry(entry, ttl);
+#ifdef TCP_REPLICATION_PEER
+	replLog(entry, replOpExpiry);
+#endif
+}
+
+/*******************************************************************************
+* Function Name: deleteRegister
+*******************************************************************************
+* Summary:
+* Remove a register from the database and give its entry back to the pool.
+* Watchers are told it changed, reading it again gives Not Found. On a
+* leader the delete is kept for the follower. Must be called between
+* dbWriteLock and dbWriteUnlock.
+*
+*******************************************************************************/
+static void deleteRegister(dbEntry_t *find){
+	dbEntry_t *entry = dbDelete(&head, find);
+	if(entry == NULL){
+		return;
+	}
+	watchNotify(entry, 0);
+#ifdef TCP_REPLICATION_PEER
+	replLog(entry, replOpDelete);
+#endif
+	dbFree(entry);
+}
+
+/*******************************************************************************
+* Function Name: expireRegister
+*******************************************************************************
+* Summary:
+* Remove a register whose TTL ran out, called by dbExpiryRun with dbMutex
+* held.
+*
+*******************************************************************************/
+static void expireRegister(dbEntry_t *entry){
+	dbWriteBegin();
+	deleteRegister(entry);
+	dbWriteEnd();
+}
+
+/*******************************************************************************
+* Function Name: writeRegister
+*******************************************************************************
+* Summary:
+* Store the value of a deviceId/regId, adding it to the database if there is
+* room. A change is pushed to the watchers and, on a leader, kept for the
+* follower. The register expires ttl seconds later, or never if ttl is 0 and
+* a TTL it had is taken away. With TCP_DB_EVICT a new register takes the
+* place of the victim of dbEvictVictim when the database is full. Must be
+* called between dbWriteLock and dbWriteUnlock.
+*
+* Return:
+*  bool: false if the register is new and there is no room for it
+*
+*******************************************************************************/
+static bool writeRegister(dbEntry_t *receive, uint32_t ttl, tcp_session_t *session){
+
+	//See if the device is already in the database, or if there's room to add it
+	dbEntry_t *entry = dbFind(&head, receive);
+	if(entry != NULL){
+		bool changed = (entry->value != receive->value);
+		dbSetValue(&head, receive); // only the value is copied, nothing new to allocate
+		if(changed){
+			watchNotify(receive, receive->value);
+#ifdef TCP_REPLICATION_PEER
+			replLog(receive, replOpWrite);
+#endif
+		}
+	}
+	else{
+		if(TCP_DB_EVICT && dbGetCount(&head) >= dbGetMax()){
+			dbEntry_t *victim = dbEvictVictim();
+			if(victim != NULL){
+				deleteRegister(victim);
+				statsAdd(&listeners[session->security ? 1 : 0].stats.evictions, 1);
+			}
+		}
+		if(dbGetCount(&head) < dbGetMax()){
+			entry = dbAlloc(); // take a free entry from the pool to put in the database
+		}
+		if(entry != NULL){
+			memcpy(entry,receive,sizeof(dbEntry_t)); // copy the received data into the new entry
+			dbSetValue(&head, entry); // save it.
+			watchNotify(receive, receive->value);
+#ifdef TCP_REPLICATION_PEER
+			replLog(receive, replOpWrite);
+#endif
+		}
+	}
+	if(entry != NULL && (ttl != 0 || dbExpirySeconds(entry) != 0)){
+		ttlRegister(entry, ttl);
+	}
+	return entry != NULL;
+}
+
+/*******************************************************************************
+* Function Name: processBatch
+*******************************************************************************
+* Summary:
+* Check and execute an M command, an 'M' followed by up to TCP_BATCH_MAX_ENTRIES
+* R (7 char), W (11 char) and T (15 char) commands with no separators. All of the commands
+* are checked before any is executed, and they are all executed in one write
+* of the database so no other client sees part of the batch. A batch of only
+* R commands takes no lock, each register is read with dbRead like a single
+* R, so it can see part of a batch of writes made at the same time.
+*
+* The reply is an 'M' followed by one 11 char result per command, in order:
+*  ADDDDRRVVVV  the register was read or written
+*  NDDDDRR0000  R of a register that is not in the database
+*  FDDDDRRVVVV  W of a new register when the database is full
+*
+* Parameters:
+* const char *message: the command
+* uint32_t length: characters in message, it is not NUL terminated
+* char *returnMessage: buffer for the reply
+* uint32_t returnSize: size of returnMessage
+* tcp_session_t *session: the client
+*
+*******************************************************************************/
+static void processBatch(const char *message, uint32_t length, char *returnMessage, uint32_t returnSize, tcp_session_t *session){
+
+	// the commands of the batch
+	textCommand_t commands[TCP_BATCH_MAX_ENTRIES];
+	uint32_t count = 0;
+	uint32_t offset = 1;
+	bool writes = false;
+
+	while(offset < length){
+		char command = message[offset];
+		if(command != 'R' && command != 'W' && command != 'T'){
+			snprintf(returnMessage, returnSize, "X illegal command");
+			return;
+		}
+		if(command != 'R' && TCP_READ_ONLY){
+			snprintf(returnMessage, returnSize, "X read only");
+			return;
+		}
+		writes |= (command != 'R');
+		uint32_t entryLength = textCommandLength(command);
+		if(offset + entryLength > length){
+			snprintf(returnMessage, returnSize, "X illegal length");
+			return;
+		}
+		if(count == TCP_BATCH_MAX_ENTRIES){
+			snprintf(returnMessage, returnSize, "X batch too long");
+			return;
+		}
+
+		// All of the bytes after the command must be a ASCII hex digit
+		if(textParse(&message[offset], entryLength, &commands[count]) != textOk){
+			snprintf(returnMessage, returnSize, "X illegal character");
+			return;
+		}
+		count++;
+		offset += entryLength;
+	}
+
+	if(count == 0 || 1 + count * TCP_BATCH_ENTRY_LENGTH >= returnSize){
+		snprintf(returnMessage, returnSize, "X illegal command");
+		return;
+	}
+
+	char *reply = returnMessage;
+	*reply++ = 'M';
+	if(!writes){
+		// Readers never hold up the writers or make the other readers retry
+		for(uint32_t i = 0; i < count; i++){
+			dbEntry_t *entry = &commands[i].entry;
+			bool found = dbRead(entry->deviceId, entry->regId, &entry->value);
+			cacheCount(session, found);
+			*reply++ = found ? 'A' : 'N';
+			reply = textPutEntry(reply, entry);
+		}
+		*reply = '\0';
+		logBatch(session, count);
+		return;
+	}
+
+	// Apply the whole batch at once
+	dbWriteLock();
+	for(uint32_t i = 0; i < count; i++){
+		dbEntry_t *entry = &commands[i].entry;
+		char status = 'A';
+		if(commands[i].command != 'R'){
+			if(!writeRegister(entry, commands[i].extra, session)){
+				status = 'F';
+			}
+		}
+		else{
+			dbEntry_t *foundValue = dbFind(&head, entry);
+			cacheCount(session, foundValue != NULL);
+			if(foundValue){
+				entry->value = foundValue->value;
+				dbEvictTouch(foundValue);
+			}
+			else{
+				status = 'N';
+			}
+		}
+		*reply++ = status;
+		reply = textPutEntry(reply, entry);
+	}
+	dbWriteUnlock();
+	*reply = '\0';
+	logBatch(session, count);
+}
+
+/*******************************************************************************
+* Function Name: logBatch
+*******************************************************************************
+* Summary:
+* Add the size of a batch to the connection information print of a client.
+*
+*******************************************************************************/
+static void logBatch(tcp_session_t *session, uint32_t count){
+	char text[12];
+	logConnection(session, "Message: Batch: ");
+	logAppend(session, text, textPutDecimal(text, count) - text);
+	logConnection(session, "\t");
+}
+
+/*******************************************************************************
+* Function Name: processCommand
+*******************************************************************************
+* Summary:
+* Check and execute one R, W, T or M command and build the reply. A T is a W
+* with a TTL, TDDDDRRVVVVSSSS writes the register and removes it SSSS seconds
+* later unless it is written again. A W takes away the TTL of a register.
+* LDDDDRR01 pins a register so it is never evicted and LDDDDRR00 unpins it,
+* the reply is the command or X Not Found.
+*
+* Parameters:
+* const char *message: the command
+* uint32_t length: characters in message, it is not NUL terminated
+* char *returnMessage: buffer for the reply
+* uint32_t returnSize: size of returnMessage, at least MAX_TCP_RECV_BUFFER_SIZE
+* tcp_session_t *session: the client
+*
+* Return:
+*  void
+*
+*******************************************************************************/
+static void processCommand(const char *message, uint32_t length, char *returnMessage, uint32_t returnSize, tcp_session_t *session){
+
+    // the command, checked and decoded in one pass
+    textCommand_t command;
+    dbEntry_t *receive = &command.entry;
+    char *reply = returnMessage;
+
+    // Batch of commands
+    if(length > 0 && message[0] == 'M'){
+    	processBatch(message, length, returnMessage, returnSize, session);
+    	return;
+    }
+
+    switch(textParse(message, length, &command)){
+    	case textOk:
+    		break;
+    	case textIllegalLength:
+    		// to many characters, reject
+    		snprintf(returnMessage, returnSize, "X illegal length");
+    		logLength(session, length);
+    		return;
+    	case textIllegalCommand:
+    		// not the correct length for a legal command
+    		snprintf(returnMessage, returnSize, "X illegal command");
+    		logLength(session, length);
+    		return;
+    	default:
+    		// a field is not ASCII hex
+    		snprintf(returnMessage, returnSize, "X illegal character");
+    		logLength(session, length);
+    		return;
+    }
+
+    // Only the leader changes the database of a follower
+    if((command.command == 'W' || command.command == 'T') && TCP_READ_ONLY){
+    	snprintf(returnMessage, returnSize, "X read only");
+    	return;
+    }
+
+    // Pin command
+    if(command.command == 'L'){
+    	dbWriteLock();
+    	dbEntry_t *entry = dbFind(&head, receive);
+    	if(entry != NULL){
+    		dbSetPinned(entry, command.extra != 0);
+    	}
+    	dbWriteUnlock();
+
+    	if(entry != NULL){
+    		*reply++ = 'L';
+    		reply = textPutHex(reply, receive->deviceId, 4);
+    		reply = textPutHex(reply, receive->regId, 2);
+    		reply = textPutHex(reply, command.extra != 0, 2);
+    		*reply = '\0';
+			logMessage(session, message, length);
+    	}
+    	else{
+    		snprintf(returnMessage, returnSize, "X Not Found");
+    	}
+    	return;
+    }
+
+    // Write command, T is a write with a TTL
+    if(command.command == 'W' || command.command == 'T'){
+    	dbWriteLock();
+    	bool written = writeRegister(receive, command.extra, session);
+    	dbWriteUnlock();
+
+    	if(written){
+    		*reply++ = 'A';
+    		*textPutEntry(reply, receive) = '\0';
+			logMessage(session, message, length);
+    	}
+    	else{
+    		snprintf(returnMessage, returnSize, "X Database Full %d", (int)dbGetCount(&head));
+    	}
+    	return;
+    }
+
+    // read, look through the database to find a previous write of the deviceId/regId
+	bool found = dbRead(receive->deviceId, receive->regId, &receive->value);
+	cacheCount(session, found);
+	if(found){
+		*reply++ = 'A';
+		*textPutEntry(reply, receive) = '\0';
+		logMessage(session, message, length);
+	}
+	else{
+		snprintf(returnMessage, returnSize, "X Not Found");
+	}
+}
+
+/*******************************************************************************
+* Function Name: processRangeRead
+*******************************************************************************
+* Summary:
+* Check and execute a D command and send the reply to a session. The command
+* is a 'D' followed by one deviceId (DDDD) or a first and last deviceId
+* (DDDDdddd) in hex. The reply is a DDDDRRVVVV for every register of the
+* devices, in order of deviceId then regId, in frames of as many registers as
+* fit in the session's reply buffer. Every frame but the last starts with a
+* 'd', meaning more follow, and the last with a 'D', so a range of any size
+* can be read. Each frame is built holding off the database writers and sent
+* after letting them go, so a write can land between two frames.
+*
+* Return:
+*  cy_rslt_t: result of sending the reply
+*
+*******************************************************************************/
+static cy_rslt_t processRangeRead(tcp_session_t *session, const char *message, uint32_t length){
+
+	// a frame of the reply, built in the session's reply buffer
+	char *text = (char *)&session->reply[TCP_SESSION_FRAME_HEADER];
+	uint32_t frameEntries = (sizeof(session->reply) - TCP_SESSION_FRAME_HEADER - 2) / TCP_RANGE_ENTRY_LENGTH;
+	uint32_t firstDeviceId = 0;
+	uint32_t lastDeviceId;
+	uint32_t deviceId;         // the last register sent
+	uint32_t regId = 0;
+	bool started = false;
+	bool more = true;
+	uint32_t sent = 0;
+	uint32_t bytes_sent;
+	cy_rslt_t result = CY_RSLT_SUCCESS;
+
+	// Check that it is the correct length and all hex after the D
+	bool legal = (length == 5 || length == 9) && textHex(&message[1], 4, &firstDeviceId);
+	lastDeviceId = firstDeviceId;
+	if(legal && length == 9){
+		legal = textHex(&message[5], 4, &lastDeviceId);
+	}
+	if(!legal){
+		snprintf(text, sizeof(session->reply) - TCP_SESSION_FRAME_HEADER, "X illegal command");
+		return sendFramedAck(session);
+	}
+
+	deviceId = firstDeviceId;
+	while(more && result == CY_RSLT_SUCCESS){
+		char *next = &text[1];
+
+		// carry on after the last register sent, the writers may have moved it in the index
+		xSemaphoreTake(dbMutex, portMAX_DELAY);
+		uint32_t first;
+		uint32_t count = dbFindRange(deviceId, lastDeviceId, &first);
+		uint32_t i = 0;
+		while(started && i < count && dbGetIndexed(first + i)->deviceId == deviceId && dbGetIndexed(first + i)->regId <= regId){
+			i++;
+		}
+		for(uint32_t n = 0; i < count && n < frameEntries; i++, n++){
+			dbEntry_t *entry = dbGetIndexed(first + i);
+			next = textPutEntry(next, entry);
+			deviceId = entry->deviceId;
+			regId = entry->regId;
+			started = true;
+		}
+		more = (i < count);
+		xSemaphoreGive(dbMutex);
+
+		uint32_t replyLength = next - text;
+		text[0] = more ? 'd' : 'D';
+		session->reply[0] = (uint8_t)(replyLength >> 8);
+		session->reply[1] = (uint8_t)replyLength;
+		result = cy_socket_send(session->socket, session->reply, TCP_SESSION_FRAME_HEADER + replyLength, CY_SOCKET_FLAGS_NONE, &bytes_sent);
+		sent += (replyLength - 1) / TCP_RANGE_ENTRY_LENGTH;
+	}
+
+	if(result != CY_RSLT_SUCCESS){
+		printf("Failed to send ack to client. Error: %d\n", (int)result);
+	}
+	else{
+		statsReply(session, NULL);
+	}
+	char count[12];
+	logMessage(session, message, length);
+	logConnection(session, "Response: ");
+	logAppend(session, count, textPutDecimal(count, sent) - count);
+	logConnection(session, " registers\n");
+	printConnection(session);
+
+	return result;
+}
+
+/*******************************************************************************
+* Function Name: processReplica
+*******************************************************************************
+* Summary:
+* Apply a replication command from the leader (see replication.h) and answer
+* with the last change this follower has. Only the leader may send them, on
+* the non-secure port.
+*
+* Parameters:
+* const char *message: the command
+* uint32_t length: characters in message, it is not NUL terminated
+* char *returnMessage: buffer for the reply
+* uint32_t returnSize: size of returnMessage
+* tcp_session_t *session: the leader
+*
+*******************************************************************************/
+static void processReplica(const char *message, uint32_t length, char *returnMessage, uint32_t returnSize, tcp_session_t *session){
+#ifdef TCP_REPLICATION_LEADER
+	uint32_t first = 0;
+	uint32_t offset = 1;
+	uint32_t applied = 0;
+	uint32_t full = 0;
+
+	if(session->security || session->peerAddress != TCP_REPLICATION_LEADER){
+		snprintf(returnMessage, returnSize, "X not the leader");
+		return;
+	}
+
+	// Check the length, that every change starts with a replOp and that
+	// everything else after the command is hex
+	bool legal = (message[0] == 'Y' && length == 1) ||
+	             (message[0] == 'Z' && length == 1) ||
+	             (message[0] == 'K' && length == 9) ||
+	             (message[0] == 'C' && length > 1 && (length - 1) % replEntryLength == 0) ||
+	             (message[0] == 'P' && length > 9 && (length - 9) % replEntryLength == 0);
+	uint32_t changes = (message[0] == 'C') ? 1 : (message[0] == 'P') ? 9 : length;
+	uint32_t field;
+	if(legal && changes > 1){
+		legal = textHex(&message[1], 8, &field);
+	}
+	for(uint32_t i = changes; legal && i < length; i += replEntryLength){
+		char op = message[i];
+		legal = (op == replOpWrite || op == replOpExpiry || op == replOpDelete) &&
+		        textHex(&message[i + 1], 8, &field) && textHex(&message[i + 9], 2, &field);
+	}
+	if(!legal){
+		snprintf(returnMessage, returnSize, "X illegal command");
+		return;
+	}
+
+	if(message[0] == 'Z'){
+		// a full copy starts, nothing this follower has is known to be current
+		replicaPosition = replNoPosition;
+		memset(replicaCopied, 0, sizeof(replicaCopied));
+		replicaCopying = true;
+	}
+	else if(message[0] == 'K'){
+		// the copy is complete, the changes after it come next. Whatever was
+		// not in it is gone from the leader, the last register first so the
+		// index does not move under the ones still to look at.
+		textHex(&message[1], 8, &replicaPosition);
+		if(replicaCopying){
+			dbWriteLock();
+			for(uint32_t i = dbGetCount(&head); i-- > 0;){
+				dbEntry_t *entry = dbGetIndexed(i);
+				uint32_t index = dbPoolIndex(entry);
+				if(!(replicaCopied[index / 32] & (1u << (index % 32)))){
+					deleteRegister(entry);
+					applied++;
 				}
-				else{
-					sprintf(writeBuffer,"Message: %s\t", messageString);
-					strcat(nonSecureBuffer, writeBuffer);
+			}
+			dbWriteUnlock();
+			replicaCopying = false;
+		}
+	}
+	else if(message[0] == 'C' || message[0] == 'P'){
+		if(message[0] == 'C'){
+			replicaPosition = replNoPosition; // a partial copy is no position
+		}
+		else{
+			textHex(&message[1], 8, &first);
+			offset = 9;
+			if(replicaPosition == replNoPosition || first > replicaPosition + 1){
+				// changes are missing, the leader goes back to replicaPosition
+				length = offset;
+			}
+		}
+
+		dbWriteLock();
+		for(uint32_t change = first; offset < length; offset += replEntryLength, change++){
+			dbEntry_t receive;
+			if(message[0] == 'P' && change <= replicaPosition){
+				continue; // already have it
+			}
+			char op = message[offset];
+			textHex(&message[offset + 1], 4, &receive.deviceId);
+			textHex(&message[offset + 5], 2, &receive.regId);
+			textHex(&message[offset + 7], 4, &receive.value);
+			receive.next = NULL;
+			if(op == replOpWrite){
+				if(!writeRegister(&receive, 0, session)){
+					full++;
 				}
-        		sendAck(returnMessage, socket_handle, security);
-        		return result;
-        	}
-        	else{
-        		sprintf(returnMessage,"X Database Full %d",(int)dbGetCount(&head));
-        		sendAck(returnMessage, socket_handle, security);
-        		return result;
-        	}
-        }
-        // read
-        if(message_buffer[0] == 'R'){
-        	// Parse the string
-			sscanf((const char *)message_buffer,"%c%4x%2x",(char *)&commandId,( int *)&receive.deviceId,( int *)&receive.regId);
-			dbEntry_t *foundValue = dbFind(&head, &receive); // look through the database to find a previous write of the deviceId/regId
-			if(foundValue){
-				sprintf(returnMessage,"A%04X%02X%04X",(unsigned int)foundValue->deviceId,(unsigned int)foundValue->regId,(unsigned int)foundValue->value);
-				if(security){
-					sprintf(writeBuffer,"Message: %s\t", messageString);
-					strcat(secureBuffer, writeBuffer);
+				else if(message[0] == 'C'){
+					uint32_t index = dbPoolIndex(dbFind(&head, &receive));
+					replicaCopied[index / 32] |= 1u << (index % 32);
 				}
-				else{
-					sprintf(writeBuffer,"Message: %s\t", messageString);
-					strcat(nonSecureBuffer, writeBuffer);
+			}
+			else if(op == replOpExpiry){
+				dbEntry_t *entry = dbFind(&head, &receive);
+				if(entry != NULL){
+					ttlRegister(entry, receive.value);
 				}
-				sendAck(returnMessage, socket_handle, security);
-				return result;
 			}
 			else{
-				sprintf(returnMessage,"X Not Found");
-				sendAck(returnMessage, socket_handle, security);
-				return result;
+				deleteRegister(&receive);
+			}
+			applied++;
+			if(message[0] == 'P'){
+				replicaPosition = change;
 			}
 		}
+		dbWriteUnlock();
+	}
 
+	if(full > 0){
+		printf("Replication: %d registers did not fit in the database\n", (int)full);
+	}
+	snprintf(returnMessage, returnSize, "Y%08X", (unsigned int)replicaPosition);
+	logPrintf(session, "Replica: %c %d\t", message[0], (int)applied);
+#else
+	(void)message;
+	(void)length;
+	(void)session;
+	snprintf(returnMessage, returnSize, "X illegal command");
+#endif
+}
+
+/*******************************************************************************
+* Function Name: sessionProcessFrames
+*******************************************************************************
+* Summary:
+* Execute every complete command frame in the receive buffer of a session and
+* keep any partial frame for the next receive. Each frame is a 2 byte big
+* endian length followed by that many bytes of command.
+*
+* Return:
+*  bool: false if the client sent a frame that is too long and must be closed
+*
+*******************************************************************************/
+static bool sessionProcessFrames(tcp_session_t *session){
+
+	// reply text goes after the frame header
+	char *returnMessage = (char *)&session->reply[TCP_SESSION_FRAME_HEADER];
+	uint32_t returnSize = sizeof(session->reply) - TCP_SESSION_FRAME_HEADER;
+	uint32_t offset = 0;
+	bool keepOpen = true;
+
+	while(session->rxLength - offset >= TCP_SESSION_FRAME_HEADER){
+		uint32_t length = ((uint32_t)session->rxBuffer[offset] << 8) | session->rxBuffer[offset + 1];
+
+		if(length > TCP_SESSION_BUFFER_SIZE - TCP_SESSION_FRAME_HEADER){
+			snprintf(returnMessage, returnSize, "X illegal length");
+			sendFramedAck(session);
+			return false;
+		}
+		if(session->rxLength - offset - TCP_SESSION_FRAME_HEADER < length){
+			break; // wait for the rest of the frame
+		}
+
+		// The command is used in place, by its length
+		const char *message = (const char *)&session->rxBuffer[offset + TCP_SESSION_FRAME_HEADER];
+		char command = (length > 0) ? message[0] : '\0';
+
+		statsCommand(session, command);
+		if(command == 'D'){
+			// Registers of a range of devices, the reply is streamed
+			keepOpen = (processRangeRead(session, message, length) == CY_RSLT_SUCCESS);
+		}
+		else if(command == 'Q'){
+			// Counters and histograms of this port
+			keepOpen = (processStats(session) == CY_RSLT_SUCCESS);
+		}
+		else if(command == 'S' || command == 'U'){
+			// Watch commands only make sense on a connection that stays open
+			processWatch(message, length, returnMessage, returnSize, session);
+			keepOpen = (sendFramedAck(session) == CY_RSLT_SUCCESS);
+		}
+		else if(command == 'Y' || command == 'Z' || command == 'P' || command == 'C' || command == 'K'){
+			// Changes from the leader
+			processReplica(message, length, returnMessage, returnSize, session);
+			keepOpen = (sendFramedAck(session) == CY_RSLT_SUCCESS);
+		}
+		else{
+			processCommand(message, length, returnMessage, returnSize, session);
+			keepOpen = (sendFramedAck(session) == CY_RSLT_SUCCESS);
+		}
+
+		offset += TCP_SESSION_FRAME_HEADER + length;
+		if(!keepOpen){
+			return false;
+		}
+	}
+
+	// move the partial frame to the front of the buffer
+	memmove(session->rxBuffer, &session->rxBuffer[offset], session->rxLength - offset);
+	session->rxLength -= offset;
+
+	return true;
+}
+
+/*******************************************************************************
+* Function Name: processBinary
+*******************************************************************************
+* Summary:
+* Execute one binary command and build the binary reply. The reply command is
+*  'A' the register was read or written, the value is in the reply
+*  'N' R of a register that is not in the database
+*  'F' W of a new register when the database is full
+*  'X' the CRC or command is wrong, or W on a follower
+*
+* Parameters:
+* const uint8_t *frame: binFrameLength bytes received from the client
+* uint8_t *reply: binFrameLength bytes to send back
+* tcp_session_t *session: the client
+*
+*******************************************************************************/
+static void processBinary(const uint8_t *frame, uint8_t *reply, tcp_session_t *session){
+
+	binCommand_t command;
+	uint8_t status = 'X';
+
+	if(binDecode(frame, &command)){
+		if(command.command == 'W' && !TCP_READ_ONLY){
+			dbWriteLock();
+			status = writeRegister(&command.entry, 0, session) ? 'A' : 'F';
+			dbWriteUnlock();
+		}
+		else if(command.command == 'R'){
+			status = dbRead(command.entry.deviceId, command.entry.regId, &command.entry.value) ? 'A' : 'N';
+			cacheCount(session, status == 'A');
+		}
+	}
+
+	binEncode(status, &command.entry, reply);
+}
+
+/*******************************************************************************
+* Function Name: sessionProcessBinary
+*******************************************************************************
+* Summary:
+* Execute every complete binary frame in the receive buffer of a session and
+* send all of the replies at once. Any partial frame is kept for the next
+* receive.
+*
+* Return:
+*  bool: false if the client lost frame sync and must be closed
+*
+*******************************************************************************/
+static bool sessionProcessBinary(tcp_session_t *session){
+
+	// Buffer for creating the connection information prints
+	char writeBuffer[30];
+	uint32_t offset = 0;
+	uint32_t replyLength = 0;
+	uint32_t bytes_sent;
+	bool inSync = true;
+
+	// every frame of a full rxBuffer has room for its reply in the reply buffer
+	while(session->rxLength - offset >= binFrameLength && replyLength + binFrameLength <= sizeof(session->reply)){
+		if(session->rxBuffer[offset] != binMagic){
+			inSync = false;
+			break;
+		}
+		processBinary(&session->rxBuffer[offset], &session->reply[replyLength], session);
+		statsCommand(session, binMagic);
+		statsBinary(session, session->reply[replyLength + 1]);
+		offset += binFrameLength;
+		replyLength += binFrameLength;
+	}
+
+	// move the partial frame to the front of the buffer
+	memmove(session->rxBuffer, &session->rxBuffer[offset], session->rxLength - offset);
+	session->rxLength -= offset;
+
+	if(replyLength > 0){
+		if(cy_socket_send(session->socket, session->reply, replyLength, CY_SOCKET_FLAGS_NONE, &bytes_sent) != CY_RSLT_SUCCESS){
+			printf("Failed to send ack to client.\n");
+			return false;
+		}
+		statsReply(session, NULL);
+		snprintf(writeBuffer, sizeof(writeBuffer), "Binary: %d commands\n", (int)(replyLength / binFrameLength));
+		logConnection(session, writeBuffer);
+		printConnection(session);
+	}
+
+	return inSync;
+}
+
+ /*******************************************************************************
+ * Function Name: tcp_receive_msg_handler
+ *******************************************************************************
+ * Summary:
+ *  Callback function to handle incoming TCP client messages.
+ *
+ *  A client that starts with a printable R/W command is answered once and
+ *  disconnected. A client that starts with a length framed command or a
+ *  binMagic byte is kept open as a session (see sessionProcessFrames and
+ *  sessionProcessBinary) until it disconnects or is idle for
+ *  TCP_SERVER_SESSION_IDLE_TIMEOUT_MS.
+ *
+ *  Each client has its own tcp_session_t, so the secure and non-secure
+ *  listeners can be served at the same time. They only meet in the
+ *  database, where writers take turns and readers never block.
+ *
+ * Parameters:
+ * cy_socket_t socket_handle: Connection handle for the TCP client socket
+ *  void *arg : tcp_listener_t of the port the client connected to
+ *
+ * Return:
+ *  cy_result result: Result of the operation
+ *
+ *******************************************************************************/
+cy_rslt_t tcp_receive_msg_handler(cy_socket_t socket_handle, void *arg){
+
+    cy_rslt_t result;
+
+    // buffer to store the message that is being recieved
+    char message_buffer[MAX_TCP_RECV_BUFFER_SIZE];
+
+    // buffer to store message to send
+    char returnMessage[MAX_TCP_RECV_BUFFER_SIZE];
+
+    /* Variable to store number of bytes received from TCP client. */
+    uint32_t bytes_received = 0;
+
+    bool keepOpen = true;
+    bool oneShot = false;
+
+    //listener passed through arg
+    tcp_listener_t *listener = arg;
+
+    // Claim the client's context so it is not closed while in use
+    xSemaphoreTake(sessionMutex, portMAX_DELAY);
+    tcp_session_t *session = sessionFind(socket_handle);
+    if(session != NULL){
+    	session->busy = true;
+    }
+    xSemaphoreGive(sessionMutex);
+
+    if(session == NULL){
+    	printf("Message from an unknown client\n");
+    	return CY_RSLT_SUCCESS;
+    }
+
+    // Add to the partial frame already received. The whole buffer is
+    // offered so a burst of frames is not left behind in the socket.
+    result = cy_socket_recv(socket_handle, &session->rxBuffer[session->rxLength], TCP_SESSION_BUFFER_SIZE - session->rxLength,
+                            CY_SOCKET_FLAGS_NONE, &bytes_received);
+    if(result == CY_RSLT_SUCCESS && !rateAllow(session->peerAddress, (bytes_received + TCP_RATE_BYTES_PER_TOKEN - 1) / TCP_RATE_BYTES_PER_TOKEN)){
+    	// Over the rate limit, close the client without looking at what it sent
+    	statsAdd(&listener->stats.limitedReceives, 1);
+    	keepOpen = false;
+    }
+    else if(result == CY_RSLT_SUCCESS){
+    	session->rxLength += bytes_received;
+    	session->lastActivity = xTaskGetTickCount();
+    	if(session->mode == SESSION_MODE_NEW && session->rxLength > 0){
+    		// The first byte tells what kind of client this is
+    		if(session->rxBuffer[0] == binMagic){
+    			session->mode = SESSION_MODE_BINARY;
+    		}
+    		else if(session->rxBuffer[0] < ' '){
+    			// A length cannot be printable, this client wants a session
+    			session->mode = SESSION_MODE_FRAMED;
+    		}
+    		else{
+    			// A printable command, answer it and disconnect
+    			bytes_received = (session->rxLength < MAX_TCP_RECV_BUFFER_SIZE) ? session->rxLength : MAX_TCP_RECV_BUFFER_SIZE;
+    			memcpy(message_buffer, session->rxBuffer, bytes_received);
+    			session->rxLength = 0;
+    			oneShot = true;
+    		}
+    	}
+    	if(session->mode == SESSION_MODE_FRAMED){
+    		keepOpen = sessionProcessFrames(session);
+    	}
+    	else if(session->mode == SESSION_MODE_BINARY){
+    		keepOpen = sessionProcessBinary(session);
+    	}
     }
-    // cy_socket_recv did not return CY_RSLT_SUCCESS
-    else
+
+    if(oneShot){
+    	// One command per connection
+    	statsCommand(session, message_buffer[0]);
+    	processCommand(message_buffer, bytes_received, returnMessage, sizeof(returnMessage), session);
+    	sendAck(returnMessage, session);
+    	return result;
+    }
+
+    xSemaphoreTake(sessionMutex, portMAX_DELAY);
+    session->busy = false;
+    xSemaphoreGive(sessionMutex);
+
+    if(result != CY_RSLT_SUCCESS)
     {
+        // cy_socket_recv did not return CY_RSLT_SUCCESS
         printf("Failed to receive message from the TCP client. Error: %d\n",
               (int)result);
         if(result == CY_RSLT_MODULE_SECURE_SOCKETS_CLOSED)
         {
-            /* Disconnect the socket. */
-			result = cy_socket_disconnect(socket_handle, 0);
-
-			/* Delete the client socket. */
-			result = cy_socket_delete(socket_handle);
+			closeClient(socket_handle);
         }
-
+    }
+    else if(!keepOpen){
+    	closeClient(socket_handle);
     }
 
     return result;
@@ -589,7 +2244,9 @@ cy_rslt_t tcp_receive_msg_handler(cy_socket_t socket_handle, void *arg){
  * Function Name: tcp_disconnection_handler
  *******************************************************************************
  * Summary:
- *  Callback function to handle TCP client disconnection event.
+ *  Callback function to handle TCP client disconnection event. The socket is
+ *  closed only if its session has not been closed already, by an idle
+ *  timeout or by the receive callback.
  *
  * Parameters:
  * cy_socket_t socket_handle: Connection handle for the TCP client socket
@@ -601,23 +2258,9 @@ cy_rslt_t tcp_receive_msg_handler(cy_socket_t socket_handle, void *arg){
  *******************************************************************************/
 cy_rslt_t tcp_disconnection_handler(cy_socket_t socket_handle, void *arg){
 
-    cy_rslt_t result;
+	closeClient(socket_handle);
 
-    /* Disconnect the socket. */
-	result = cy_socket_disconnect(socket_handle, 0);
-	if(result != CY_RSLT_SUCCESS){
-		printf("Disconnect Failed!\n");
-		CY_ASSERT(0);
-	}
-	/* Delete the client socket. */
-	result = cy_socket_delete(socket_handle);
-	if(result != CY_RSLT_SUCCESS){
-		printf("Socket Delete Failed!\n");
-		CY_ASSERT(0);
-	}
-
-    return result;
+    return CY_RSLT_SUCCESS;
 }
 
 /* [] END OF FILE */
-
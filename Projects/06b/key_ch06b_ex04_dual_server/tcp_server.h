@@ -62,13 +62,102 @@
 #define WIFI_CONN_RETRY_INTERVAL_MSEC             (1000)
 
 /* TCP server related macros. */
+#ifndef TCP_SERVER_PORT
 #define TCP_SERVER_PORT                           (27708)
+#endif
+#ifndef SECURE_TCP_SERVER_PORT
 #define SECURE_TCP_SERVER_PORT					  (40508)
+#endif
 #define TCP_SERVER_MAX_PENDING_CONNECTIONS        (3)
 #define TCP_SERVER_RECV_TIMEOUT_MS                (4000)
 #define MAX_TCP_RECV_BUFFER_SIZE                  (20)
 #define MAX_TCP_DATA_PACKET_LENGTH				  (20)
 
+/* Session related macros. A client that sends length framed commands keeps
+ * its connection open until it disconnects or is idle for the timeout. Every
+ * connection, one-shot or not, uses a session while it is open. */
+#define TCP_SERVER_MAX_SESSIONS                   (8)
+#define TCP_SERVER_SESSION_IDLE_TIMEOUT_MS        (30000)
+
+/* A client that has not sent its first byte this long after it was accepted
+ * is closed, on either port, so silent connections cannot hold every session. */
+#ifndef TCP_SERVER_FIRST_FRAME_TIMEOUT_MS
+#define TCP_SERVER_FIRST_FRAME_TIMEOUT_MS         (5000)
+#endif
+
+/* Most time a partly filled page of the database log waits in RAM before it
+ * is written, see dbStore.h. Every write of it erases and programs the page
+ * again, so this is the flash wear of a slow trickle of writes against the
+ * changes a reset can lose. */
+#ifndef TCP_SERVER_DB_SYNC_MS
+#define TCP_SERVER_DB_SYNC_MS                     (1000)
+#endif
+
+/* Rate limiting of each client address, see rateLimit.h. Accepting a
+ * connection takes TCP_RATE_CONNECT_COST tokens and a receive takes one token
+ * for every TCP_RATE_BYTES_PER_TOKEN bytes or part of it. A client that is
+ * out of tokens is closed before anything it sent is looked at. Set
+ * TCP_RATE_TOKENS_PER_SEC to 0 to turn rate limiting off. */
+#ifndef TCP_RATE_TOKENS_PER_SEC
+#define TCP_RATE_TOKENS_PER_SEC                   (100)
+#endif
+#define TCP_RATE_BURST                            (200)
+#define TCP_RATE_CONNECT_COST                     (5)
+#define TCP_RATE_BYTES_PER_TOKEN                  (64)
+
+/* Reopening a secure connection costs a full TLS handshake, so secure
+ * sessions are kept open longer for clients to come back to. */
+#define TCP_SERVER_SECURE_IDLE_TIMEOUT_MS         (120000)
+
+/* Size of the JSON reply to a stats (Q) command, and how often each server
+ * task prints the same JSON to the UART (0 to never print it). */
+#define TCP_STATS_JSON_SIZE                       (1200)
+#define TCP_SERVER_STATS_PRINT_MS                 (60000)
+
+/* Batch (M) command related macros. A batch is only accepted in a session
+ * because the reply does not fit in MAX_TCP_DATA_PACKET_LENGTH. */
+#define TCP_BATCH_MAX_ENTRIES                     (32)
+#define TCP_BATCH_ENTRY_LENGTH                    (11)
+#define TCP_MAX_BATCH_LENGTH                      (1 + TCP_BATCH_MAX_ENTRIES * TCP_BATCH_ENTRY_LENGTH)
+#define TCP_SESSION_BUFFER_SIZE                   (2 + TCP_MAX_BATCH_LENGTH)
+
+/* What a write of a new register does when the database is full: refuse it
+ * with X Database Full (0), or evict a register that has not been read or
+ * written lately to make room for it (1, CLOCK, see dbEvict.h). A register
+ * pinned with an L command is never evicted. */
+#ifndef TCP_DB_EVICT
+#define TCP_DB_EVICT                              (0)
+#endif
+
+/* Each register in the reply to a range read (D) command is DDDDRRVVVV. */
+#define TCP_RANGE_ENTRY_LENGTH                    (10)
+
+/* Watches (S command) a session can hold, and changed registers it can have
+ * waiting to be pushed before the server tells it that events were lost. */
+#define TCP_SESSION_MAX_WATCHES                   (8)
+#define TCP_SESSION_MAX_EVENTS                    (32)
+
+/* Replication, see replication.h. On a leader define TCP_REPLICATION_PEER as
+ * the address of its follower, on the follower define TCP_REPLICATION_LEADER
+ * as the address of the leader, both with TCP_IPV4. A follower refuses
+ * writes from clients. Leave both undefined for a stand alone server. */
+#define TCP_IPV4(a, b, c, d)                      ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+/* #define TCP_REPLICATION_PEER                   TCP_IPV4(192, 168, 1, 21) */
+/* #define TCP_REPLICATION_LEADER                 TCP_IPV4(192, 168, 1, 20) */
+#ifndef TCP_REPLICATION_PEER_PORT
+#define TCP_REPLICATION_PEER_PORT                 TCP_SERVER_PORT
+#endif
+
+/* Changes the leader keeps for a follower that falls behind, how long it
+ * lets changes collect into a batch, how often it checks in with a follower
+ * that has nothing to receive (well inside the session idle timeout) and how
+ * long it waits for an answer or before connecting again. */
+#define TCP_REPLICATION_LOG_SIZE                  (256)
+#define TCP_REPLICATION_BATCH_MS                  (20)
+#define TCP_REPLICATION_HEARTBEAT_MS              (10000)
+#define TCP_REPLICATION_ACK_TIMEOUT_MS            (4000)
+#define TCP_REPLICATION_RETRY_MS                  (2000)
+
 /* TCP server certificate. Copy from the TCP server certificate
  * generated by OpenSSL (See Readme.md on how to generate a SSL certificate).
  */
@@ -160,6 +249,8 @@
 * Function Prototypes
 ********************************************************************************/
 void tcp_server_task(void *arg);
+void tcp_server_init(void);
+void tcp_server_restore(void);
 void connect_to_wifi_ap_task(void *arg);
 
 #endif /* TCP_SERVER_H_ */
@@ -0,0 +1,115 @@
+//parsing and formatting of the ASCII AWEP commands, see textProtocol.h
+#include "cyhal.h"
+#include "textProtocol.h"
+#include <string.h>
+
+// Value of each character as a hex digit plus 0x10
+static const uint8_t textHexTable[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+	['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+	['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F
+};
+// the table holds digit + 0x10 so the entries left at 0 are not digits
+
+static const char textHexDigits[16] = "0123456789ABCDEF";
+
+// Layout of a single command, the hex fields after the letter
+typedef struct {
+	char command;
+	uint8_t length;
+	uint8_t valueDigits;
+	uint8_t extraDigits;
+} textLayout_t;
+
+static const textLayout_t textLayouts[] = {
+	{ 'R', 7, 0, 0 },
+	{ 'W', 11, 4, 0 },
+	{ 'T', 15, 4, 4 },
+	{ 'L', 9, 0, 2 },
+};
+
+// textLayout:
+// The layout of a command letter, NULL if it is not one
+static const textLayout_t *textLayout(char command){
+	for(uint32_t i = 0; i < sizeof(textLayouts) / sizeof(textLayouts[0]); i++){
+		if(textLayouts[i].command == command){
+			return &textLayouts[i];
+		}
+	}
+	return NULL;
+}
+
+uint32_t textCommandLength(char command){
+	const textLayout_t *layout = textLayout(command);
+	return (layout != NULL) ? layout->length : 0;
+}
+
+// textHex:
+// Accumulate the digits, any character that is not hex makes the OR of the
+// table entries lose bit 4
+bool textHex(const char *text, uint32_t digits, uint32_t *value){
+	uint32_t result = 0;
+	uint8_t valid = 0x10;
+	for(uint32_t i = 0; i < digits; i++){
+		uint8_t entry = textHexTable[(uint8_t)text[i]];
+		valid &= entry;
+		result = (result << 4) | (entry & 0x0F);
+	}
+	*value = result;
+	return valid != 0;
+}
+
+// textParse:
+// Check the length, the letter and the digits of a single command and decode it
+textStatus_t textParse(const char *text, uint32_t length, textCommand_t *command){
+	if(length > textMaxCommandLength){
+		return textIllegalLength;
+	}
+	const textLayout_t *layout = (length > 0) ? textLayout(text[0]) : NULL;
+	if(layout == NULL || layout->length != length){
+		return textIllegalCommand;
+	}
+
+	command->command = text[0];
+	command->entry.value = 0;
+	command->entry.next = NULL;
+	command->extra = 0;
+	bool valid = textHex(&text[1], 4, &command->entry.deviceId) &&
+	             textHex(&text[5], 2, &command->entry.regId) &&
+	             textHex(&text[7], layout->valueDigits, &command->entry.value) &&
+	             textHex(&text[7 + layout->valueDigits], layout->extraDigits, &command->extra);
+	return valid ? textOk : textIllegalCharacter;
+}
+
+char *textPutHex(char *out, uint32_t value, uint32_t digits){
+	for(uint32_t i = digits; i > 0; i--){
+		out[i - 1] = textHexDigits[value & 0x0F];
+		value >>= 4;
+	}
+	return out + digits;
+}
+
+char *textPutDecimal(char *out, uint32_t value){
+	char digits[10];
+	uint32_t count = 0;
+	do{
+		digits[count++] = (char)('0' + value % 10);
+		value /= 10;
+	}while(value > 0);
+	while(count > 0){
+		*out++ = digits[--count];
+	}
+	return out;
+}
+
+char *textPutEntry(char *out, const dbEntry_t *entry){
+	out = textPutHex(out, entry->deviceId, 4);
+	out = textPutHex(out, entry->regId, 2);
+	return textPutHex(out, entry->value, 4);
+}
+
+char *textPutText(char *out, const char *text, uint32_t length){
+	memcpy(out, text, length);
+	return out + length;
+}
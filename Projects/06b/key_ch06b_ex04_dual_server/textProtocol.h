@@ -0,0 +1,54 @@
+#ifndef TEXTPROTOCOL_H_
+#define TEXTPROTOCOL_H_
+
+#include "cyhal.h"
+#include "linkedList.h"
+
+// Parsing and formatting of the ASCII AWEP commands and replies.
+//
+// Every function takes the length of its text, nothing needs a NUL and
+// nothing is read past the length. A command is checked and decoded in one
+// pass: the command letter picks its layout from a table and each hex digit
+// is looked up in a 256 entry table, so there is no strlen, isxdigit,
+// sscanf or sprintf on the way in or out.
+//
+// The single command layouts are
+//  RDDDDRR          read
+//  WDDDDRRVVVV      write
+//  TDDDDRRVVVVSSSS  write with a TTL of SSSS seconds
+//  LDDDDRRPP        pin (PP not 00) or unpin a register
+#define textMaxCommandLength (15)
+
+// Result of textParse, in the order the server checks them
+typedef enum {
+	textOk,
+	textIllegalLength,    // longer than any command
+	textIllegalCommand,   // not a command letter, or the wrong length for it
+	textIllegalCharacter  // a field is not hex
+} textStatus_t;
+
+// A decoded command
+typedef struct {
+	char command;     // R, W, T or L
+	dbEntry_t entry;  // deviceId and regId, the value of a W or T
+	uint32_t extra;   // TTL of a T, PP of an L
+} textCommand_t;
+
+//length of a single command by its letter, 0 if it is not one
+uint32_t textCommandLength(char command);
+//check and decode one command of length characters
+textStatus_t textParse(const char *text, uint32_t length, textCommand_t *command);
+//decode digits hex digits, false if any is not hex
+bool textHex(const char *text, uint32_t digits, uint32_t *value);
+
+//the format functions write without a NUL and return the end of what they wrote
+//value as digits upper case hex digits
+char *textPutHex(char *out, uint32_t value, uint32_t digits);
+//value in decimal
+char *textPutDecimal(char *out, uint32_t value);
+//DDDDRRVVVV of an entry
+char *textPutEntry(char *out, const dbEntry_t *entry);
+//length characters of text
+char *textPutText(char *out, const char *text, uint32_t length);
+
+#endif
@@ -14,9 +14,10 @@
 // Task Headers
 #include "capsense_task.h"
 #include "mqtt_task.h"
+#include "publisher_task.h"
+#include "thermostat_state.h"
 
 // Middleware Headers
-#include "semphr.h"
 #include "cycfg.h"
 #include "cycfg_capsense.h"
 #include "queue.h"
@@ -27,12 +28,6 @@
 ******************************************************************************/
 TaskHandle_t capsense_task_handle;
 
-// Defined in main.c
-extern int setTemp;
-extern bool isConnected;
-extern SemaphoreHandle_t setTempSemaphore;
-extern SemaphoreHandle_t isConnectedSemaphore;
-
 // Capsense deep sleep callback objects
 /* SysPm callback params */
 cy_stc_syspm_callback_params_t callback_params =
@@ -89,6 +84,9 @@ void capsense_task(void* pvParameters){
 	uint32_t button0_status = 0;
 	uint32_t button1_status = 0;
 
+	// Whether setTemp changed
+	bool setTempChanged;
+
 	// Initialize Capsense
 	const cy_stc_sysint_t CapSense_interrupt_config =
 	{
@@ -113,9 +111,7 @@ void capsense_task(void* pvParameters){
 
 		Cy_CapSense_ProcessAllWidgets(&cy_capsense_context);
 
-		xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-		int setTempPrevious = setTemp; // var to store previous settemp
-		xSemaphoreGive(setTempSemaphore);
+		setTempChanged = false;
 
 		// Button 0 Pressed
 		if(Cy_CapSense_IsWidgetActive(CY_CAPSENSE_BUTTON0_WDGT_ID, &cy_capsense_context)){
@@ -124,14 +120,7 @@ void capsense_task(void* pvParameters){
 				printf("Button 0 Pressed!\n");
 
 				// Decrement setTemp
-				xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-				if(setTemp <= 50){
-					setTemp = 50;
-				}
-				else{
-					setTemp--;
-				}
-				xSemaphoreGive(setTempSemaphore);
+				setTempChanged = thermostatStepSetTemp(-1);
 			}
 		}
 		// Button 1 Pressed
@@ -141,14 +130,7 @@ void capsense_task(void* pvParameters){
 				printf("Button 1 Pressed!\n");
 
 				// Increment setTemp
-				xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-				if(setTemp >= 90){
-					setTemp = 90;
-				}
-				else{
-					setTemp++;
-				}
-				xSemaphoreGive(setTempSemaphore);
+				setTempChanged = thermostatStepSetTemp(1);
 			}
 		}
 		else{
@@ -156,16 +138,10 @@ void capsense_task(void* pvParameters){
 			button1_status = 0;
 		}
 		// If setTemp changed notify display and publisher threads
-		xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-		if(setTempPrevious != setTemp){
+		if(setTempChanged){
 			xTaskNotifyGive(display_task_handle);
-			xSemaphoreTake(isConnectedSemaphore, portMAX_DELAY);
-			if(isConnected){
-				xTaskNotify(publisher_task_handle, SETTEMP, eSetValueWithoutOverwrite);
-			}
-			xSemaphoreGive(isConnectedSemaphore);
+			publisherNotify(SETTEMP);
 		}
-		xSemaphoreGive(setTempSemaphore);
 	}
 }
 
@@ -14,9 +14,9 @@
 // Task Headers
 #include "display_task.h"
 #include "mqtt_task.h"
+#include "thermostat_state.h"
 
 // Middleware Headers
-#include "semphr.h"
 #include "GUI.h"
 #include "mtb_st7789v.h"
 #include "cy8ckit_028_tft_pins.h"
@@ -52,15 +52,6 @@ void displayUpdate();
 /* Task handle for this task. */
 TaskHandle_t display_task_handle;
 
-// Defined in main.c
-extern int actualTemp, setTemp;
-extern char * mode;
-extern bool isConnected;
-extern SemaphoreHandle_t actualTempSemaphore;
-extern SemaphoreHandle_t setTempSemaphore;
-extern SemaphoreHandle_t modeSemaphore;
-extern SemaphoreHandle_t isConnectedSemaphore;
-
 /*******************************************************************************
 * Function Name: display_task
 ********************************************************************************
@@ -121,47 +112,39 @@ void display_task(void *pvParameters){
 void displayUpdate(){
 	printf("Updating display\n");
 
+	// Draw the values of one moment
+	thermostat_state_t state;
+	thermostatStateGet(&state);
+
 	// Actual Temp
 	GUI_DispStringAt("Actual Temperature: ", TFT_LEFT_ALIGNED, TFT_ROW_ONE);
-
-	xSemaphoreTake(actualTempSemaphore, portMAX_DELAY);
-	GUI_DispDecMin(actualTemp);
-	xSemaphoreGive(actualTempSemaphore);
+	GUI_DispDecMin(state.actualTemp);
 
 	// Set Temp
 	GUI_DispStringAt("Set Temperature: ", TFT_LEFT_ALIGNED, TFT_ROW_TWO);
-
-	xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-	GUI_DispDecMin(setTemp);
-	xSemaphoreGive(setTempSemaphore);
+	GUI_DispDecMin(state.setTemp);
 
 	// Mode
 	GUI_DispStringAt("Mode: ", TFT_LEFT_ALIGNED, TFT_ROW_THREE);
 
-	xSemaphoreTake(modeSemaphore, portMAX_DELAY);
-
-	if(strcmp(mode, MODE_HEAT) == 0){
+	if(strcmp(state.mode, MODE_HEAT) == 0){
 		GUI_DrawBitmap(&bmfire80, X_BMP_POS, TFT_ROW_THREE);
 	}
-	else if(strcmp(mode, MODE_COOL) == 0){
+	else if(strcmp(state.mode, MODE_COOL) == 0){
 		GUI_DrawBitmap(&bmsnowflake80, X_BMP_POS, TFT_ROW_THREE);
 	}
 	else{
 		GUI_DrawBitmap(&bmblack80, X_BMP_POS, TFT_ROW_THREE);
-		GUI_DispString(mode);
+		GUI_DispString(state.mode);
 	}
 
-	xSemaphoreGive(modeSemaphore);
-
 	// WiFi symbol
-	xSemaphoreTake(isConnectedSemaphore, portMAX_DELAY);
-	if(isConnected){
+	if(state.isConnected){
 		GUI_DrawBitmap(&bmwifi80, X_WIFI_POS, TFT_ROW_FIVE);
 	}
 	else{
 		GUI_DrawBitmap(&bmwifiDisconnect80, X_WIFI_POS, TFT_ROW_FIVE);
 	}
-	xSemaphoreGive(isConnectedSemaphore);
 }
 
 /* [] END OF FILE */
@@ -46,6 +46,7 @@
 #include "semphr.h"
 // Task Headers
 #include "mqtt_task.h"
+#include "offline_queue.h"
 
 /******************************************************************************
 * Global Variables
@@ -53,17 +54,6 @@
 /* This enables RTOS aware debugging. */
 volatile int uxTopUsedPriority;
 
-// Vars to store the state of the thermostat
-int setTemp = 70;
-int actualTemp = 0;
-char *mode = MODE_IDLE;
-bool isConnected = false;
-// Semaphores for thermostat state vars
-SemaphoreHandle_t actualTempSemaphore;
-SemaphoreHandle_t setTempSemaphore;
-SemaphoreHandle_t modeSemaphore;
-SemaphoreHandle_t isConnectedSemaphore;
-
 /******************************************************************************
  * Function Name: main
  ******************************************************************************
@@ -97,11 +87,8 @@ int main(){
     /* Initialize retarget-io to use the debug UART port. */
     cy_retarget_io_init(CYBSP_DEBUG_UART_TX, CYBSP_DEBUG_UART_RX, CY_RETARGET_IO_BAUDRATE);
 
-    // Initialize Semaphores
-    actualTempSemaphore = xSemaphoreCreateMutex();
-    setTempSemaphore = xSemaphoreCreateMutex();
-    modeSemaphore = xSemaphoreCreateMutex();
-    isConnectedSemaphore = xSemaphoreCreateMutex();
+    // Find the changes kept offline before a reset
+    offlineQueueInit();
 
     // Initialize GPIOs for red and blue LEDs
 	cyhal_gpio_init(CYBSP_LED_RGB_RED, CYHAL_GPIO_DIR_OUTPUT, CYHAL_GPIO_DRIVE_STRONG, CYBSP_LED_STATE_OFF);
@@ -59,6 +59,8 @@
 #include "pot_task.h"
 #include "display_task.h"
 #include "capsense_task.h"
+#include "thermostat_state.h"
+#include "offline_queue.h"
 
 /* Configuration file for Wi-Fi and MQTT client */
 #include "wifi_config.h"
@@ -81,6 +83,11 @@
 /* Time in milliseconds to wait before creating the publisher task. */
 #define TASK_CREATION_DELAY_MS           (2000u)
 
+/* Time in milliseconds to wait before connecting again after the connection
+ * failed or was lost. The thermostat keeps working offline meanwhile.
+ */
+#define MQTT_RECONNECT_INTERVAL_MS       (10000u)
+
 /* Flag Masks for tracking which cleanup functions must be called. */
 #define WCM_INITIALIZED                  (1lu << 0)
 #define WIFI_CONNECTED                   (1lu << 1)
@@ -129,10 +136,6 @@ uint32_t status_flag;
  */
 uint8_t *mqtt_network_buffer = NULL;
 
-// Defined in main.c
-extern bool isConnected;
-extern SemaphoreHandle_t isConnectedSemaphore;
-
 /******************************************************************************
 * Function Prototypes
 *******************************************************************************/
@@ -141,6 +144,8 @@ static cy_rslt_t mqtt_init(void);
 static cy_rslt_t mqtt_connect(void);
 void mqtt_event_callback(cy_mqtt_t mqtt_handle, cy_mqtt_event_t event, void *user_data);
 static void cleanup(void);
+static void cleanup_mqtt(void);
+static void stop_mqtt_tasks(void);
 static cy_rslt_t mqtt_get_unique_client_identifier(char *mqtt_client_identifier);
 
 /******************************************************************************
@@ -166,6 +171,9 @@ void mqtt_client_task(void *pvParameters){
 	 */
 	mqtt_task_cmd_t mqtt_status;
 
+	/* Whether the MQTT client is connected to the broker. */
+	bool isConnected = false;
+
 	/* Configure the Wi-Fi interface as a Wi-Fi STA (i.e. Client). */
 	cy_wcm_config_t config = {.interface = CY_WCM_INTERFACE_TYPE_STA};
 
@@ -175,9 +183,6 @@ void mqtt_client_task(void *pvParameters){
     /* Create a message queue to communicate with other tasks and callbacks. */
 	mqtt_task_q = xQueueCreate(MQTT_TASK_QUEUE_LENGTH, sizeof(mqtt_task_cmd_t));
 
-	// Take the connection semaphore
-	xSemaphoreTake(isConnectedSemaphore, portMAX_DELAY);
-
 	/* Initialize the Wi-Fi Connection Manager and jump to the cleanup block
 	 * upon failure.
 	 */
@@ -192,84 +197,70 @@ void mqtt_client_task(void *pvParameters){
 	status_flag |= WCM_INITIALIZED;
 	printf("\nWi-Fi Connection Manager initialized.\n");
 
-	/* Initiate connection to the Wi-Fi AP and cleanup if the operation fails. */
-	if (CY_RSLT_SUCCESS != wifi_connect()){
-		goto exit_cleanup;
-	}
-
-	/* Set-up the MQTT client and connect to the MQTT broker. Jump to the
-	 * cleanup block if any of the operations fail.
-	 */
-	if ( (CY_RSLT_SUCCESS != mqtt_init()) || (CY_RSLT_SUCCESS != mqtt_connect()) ){
-		isConnected = false;
-		goto exit_cleanup;
-
-	}
-	else{
-		isConnected = true;
-	}
-
-    // Only start subscriber and publisher task if we are connected to wifi and broker
-    if(isConnected){
-		/* Create the subscriber task and cleanup if the operation fails. */
-		if (pdPASS != xTaskCreate(subscriber_task, "Subscriber task", SUBSCRIBER_TASK_STACK_SIZE, NULL, SUBSCRIBER_TASK_PRIORITY, &subscriber_task_handle)){
-			printf("Failed to create the Subscriber task!\n");
-			goto exit_cleanup;
-		}
-
-		// Wait for the subscribe operation to complete
-		vTaskDelay(pdMS_TO_TICKS(TASK_CREATION_DELAY_MS));
+    while (true){
+		/* Connect to the Wi-Fi AP, set-up the MQTT client and connect to the
+		 * MQTT broker, then start the subscriber and publisher tasks. If any
+		 * of the operations fail the thermostat works offline until the next
+		 * attempt.
+		 */
+		if ( (CY_RSLT_SUCCESS == wifi_connect()) && (CY_RSLT_SUCCESS == mqtt_init()) && (CY_RSLT_SUCCESS == mqtt_connect()) ){
+			/* Create the subscriber task. */
+			if (pdPASS != xTaskCreate(subscriber_task, "Subscriber task", SUBSCRIBER_TASK_STACK_SIZE, NULL, SUBSCRIBER_TASK_PRIORITY, &subscriber_task_handle)){
+				printf("Failed to create the Subscriber task!\n");
+			}
+			else{
+				// Wait for the subscribe operation to complete
+				vTaskDelay(pdMS_TO_TICKS(TASK_CREATION_DELAY_MS));
 
-		/* Create the publisher task and cleanup if the operation fails.*/
-		if (pdPASS != xTaskCreate(publisher_task, "Publisher task", PUBLISHER_TASK_STACK_SIZE, NULL, PUBLISHER_TASK_PRIORITY, &publisher_task_handle)){
-			printf("Failed to create Publisher task!\n");
-			goto exit_cleanup;
+				/* Create the publisher task. */
+				if (pdPASS != xTaskCreate(publisher_task, "Publisher task", PUBLISHER_TASK_STACK_SIZE, NULL, PUBLISHER_TASK_PRIORITY, &publisher_task_handle)){
+					printf("Failed to create Publisher task!\n");
+				}
+				else{
+					// The other tasks notify the publisher from here on
+					isConnected = true;
+					thermostatSetConnected(true);
+				}
+			}
 		}
-    }
-    // Give the connection semaphore
-    xSemaphoreGive(isConnectedSemaphore);
 
-    /* Create the potentiometer task.*/
-	if (pdPASS != xTaskCreate(pot_task, "Potentiometer task", POT_TASK_STACK_SIZE, NULL, POT_TASK_PRIORITY, &pot_task_handle)){
-		printf("Failed to create the Potentiometer task!\n");
-	}
-	printf("Created Pot Task\n");
+		// The thermostat tasks are started once, after the first attempt
+		if (pot_task_handle == NULL){
+			/* Create the potentiometer task.*/
+			if (pdPASS != xTaskCreate(pot_task, "Potentiometer task", POT_TASK_STACK_SIZE, NULL, POT_TASK_PRIORITY, &pot_task_handle)){
+				printf("Failed to create the Potentiometer task!\n");
+			}
+			printf("Created Pot Task\n");
 
-	/* Create the display task.*/
-	if (pdPASS != xTaskCreate(display_task, "Display task", DISPLAY_TASK_STACK_SIZE, NULL, DISPLAY_TASK_PRIORITY, &display_task_handle)){
-		printf("Failed to create the Display task!\n");
-	}
-	printf("Created Display Task\n");
+			/* Create the display task.*/
+			if (pdPASS != xTaskCreate(display_task, "Display task", DISPLAY_TASK_STACK_SIZE, NULL, DISPLAY_TASK_PRIORITY, &display_task_handle)){
+				printf("Failed to create the Display task!\n");
+			}
+			printf("Created Display Task\n");
 
-	/* Create the capsense task.*/
-	if (pdPASS != xTaskCreate(capsense_task, "Capsense task", CAPSENSE_TASK_STACK_SIZE, NULL, CAPSENSE_TASK_PRIORITY, &capsense_task_handle)){
-		printf("Failed to create the Capsense task!\n");
-	}
-	printf("Created Capsense Task\n");
+			/* Create the capsense task.*/
+			if (pdPASS != xTaskCreate(capsense_task, "Capsense task", CAPSENSE_TASK_STACK_SIZE, NULL, CAPSENSE_TASK_PRIORITY, &capsense_task_handle)){
+				printf("Failed to create the Capsense task!\n");
+			}
+			printf("Created Capsense Task\n");
+		}
 
-    while (true){
-    	if(isConnected){
+		// Show the connection state
+		if (display_task_handle != NULL){
+			xTaskNotifyGive(display_task_handle);
+		}
 
-			/* Wait for results of MQTT operations from other tasks and callbacks. */
+		/* Wait for results of MQTT operations from other tasks and callbacks. */
+		while (isConnected){
 			if(pdTRUE == xQueueReceive(mqtt_task_q, &mqtt_status, portMAX_DELAY)){
 				switch(mqtt_status){
 					case HANDLE_MQTT_PUBLISH_FAILURE:
 					case HANDLE_MQTT_SUBSCRIBE_FAILURE:
 					case HANDLE_DISCONNECTION:
 					{
-						/* Delete the subscriber and publisher tasks and go to the
-						 * cleanup label as MQTT subscribe/publish has failed.
-						 */
-						cy_mqtt_disconnect(mqtt_connection);
-						printf("Terminating the publisher and subscriber tasks...\n\n");
-						if (subscriber_task_handle != NULL){
-							vTaskDelete(subscriber_task_handle);
-						}
-						if (publisher_task_handle != NULL){
-							vTaskDelete(publisher_task_handle);
-						}
+						// Stop the other tasks notifying the publisher before it is deleted
 						isConnected = false;
-						goto exit_cleanup;
+						thermostatSetConnected(false);
 						break;
 					}
 					default:
@@ -277,7 +268,19 @@ void mqtt_client_task(void *pvParameters){
 				}
 			}
 		}
-    	vTaskDelay(100);
+
+		/* Delete the subscriber and publisher tasks and clean up the MQTT
+		 * client, keeping the Wi-Fi Connection Manager for the next attempt.
+		 */
+		stop_mqtt_tasks();
+		cleanup_mqtt();
+		xQueueReset(mqtt_task_q);
+		if (display_task_handle != NULL){
+			xTaskNotifyGive(display_task_handle);
+		}
+
+		printf("Offline, %u changes kept. Connecting again in %u ms...\n\n", (unsigned int)offlineQueueCount(), (unsigned int)MQTT_RECONNECT_INTERVAL_MS);
+		vTaskDelay(pdMS_TO_TICKS(MQTT_RECONNECT_INTERVAL_MS));
     }
 
     /* Cleanup section: Delete subscriber and publisher tasks and perform
@@ -592,6 +595,39 @@ static cy_rslt_t mqtt_get_unique_client_identifier(char *mqtt_client_identifier)
  *
  ******************************************************************************/
 static void cleanup(void){
+    /* Clean up the MQTT client. */
+    cleanup_mqtt();
+    /* Disconnect from Wi-Fi AP. */
+    if (status_flag & WIFI_CONNECTED)
+    {
+        if (cy_wcm_disconnect_ap() == CY_RSLT_SUCCESS)
+        {
+            printf("Disconnected from the Wi-Fi AP!\n");
+        }
+    }
+    /* De-initialize the Wi-Fi Connection Manager. */
+    if (status_flag & WCM_INITIALIZED)
+    {
+        cy_wcm_deinit();
+    }
+}
+
+/******************************************************************************
+ * Function Name: cleanup_mqtt
+ ******************************************************************************
+ * Summary:
+ *  Function that invokes the deinit and cleanup functions of the MQTT client
+ *  based on the status_flag, and clears their bits so the client can be set
+ *  up again.
+ *
+ * Parameters:
+ *  void
+ *
+ * Return:
+ *  void
+ *
+ ******************************************************************************/
+static void cleanup_mqtt(void){
     /* Disconnect the MQTT connection if it was established. */
     if (status_flag & MQTT_CONNECTION_SUCCESS)
     {
@@ -607,24 +643,52 @@ static void cleanup(void){
     if (status_flag & BUFFER_INITIALIZED)
     {
         vPortFree((void *) mqtt_network_buffer);
+        mqtt_network_buffer = NULL;
     }
     /* Deinit the MQTT library. */
     if (status_flag & LIBS_INITIALIZED)
     {
         cy_mqtt_deinit();
     }
-    /* Disconnect from Wi-Fi AP. */
-    if (status_flag & WIFI_CONNECTED)
+    status_flag &= ~(MQTT_CONNECTION_SUCCESS | MQTT_INSTANCE_CREATED | BUFFER_INITIALIZED | LIBS_INITIALIZED);
+}
+
+/******************************************************************************
+ * Function Name: stop_mqtt_tasks
+ ******************************************************************************
+ * Summary:
+ *  Function that deletes the subscriber and publisher tasks, if they were
+ *  created. The publisher is deleted while no task is inside the offline
+ *  store, so the store's lock is never lost with it. Its handle is cleared
+ *  first with the scheduler suspended, so publisherNotify either notifies
+ *  the task before it is deleted or finds no task.
+ *
+ * Parameters:
+ *  void
+ *
+ * Return:
+ *  void
+ *
+ ******************************************************************************/
+static void stop_mqtt_tasks(void){
+    if (subscriber_task_handle != NULL || publisher_task_handle != NULL)
     {
-        if (cy_wcm_disconnect_ap() == CY_RSLT_SUCCESS)
-        {
-            printf("Disconnected from the Wi-Fi AP!\n");
-        }
+        printf("Terminating the publisher and subscriber tasks...\n\n");
     }
-    /* De-initialize the Wi-Fi Connection Manager. */
-    if (status_flag & WCM_INITIALIZED)
+    if (subscriber_task_handle != NULL)
     {
-        cy_wcm_deinit();
+        vTaskDelete(subscriber_task_handle);
+        subscriber_task_handle = NULL;
+    }
+    if (publisher_task_handle != NULL)
+    {
+        offlineQueueHold();
+        vTaskSuspendAll();
+        TaskHandle_t handle = publisher_task_handle;
+        publisher_task_handle = NULL;
+        xTaskResumeAll();
+        vTaskDelete(handle);
+        offlineQueueRelease();
     }
 }
 
@@ -62,6 +62,10 @@
 #define DESIRED									3
 #define MODE									4
 
+// Bit of each identifier in the notification value of the publisher thread,
+// the changes are ORed in (eSetBits) so none is lost while it is busy
+#define NOTIFY_BIT(value)						(1u << (value))
+
 // Thermostat temp range
 #define ACTUALTEMPMAX							90
 #define ACTUALTEMPMIN							50
@@ -0,0 +1,453 @@
+/******************************************************************************
+* File Name: offline_queue.c
+*
+* Description: The store of the reported state changes made while the
+*              thermostat is offline, see offline_queue.h.
+*
+*              On target the rows are kept at the start of the last flash
+*              block reported by the HAL, the work flash on PSoC 6. Defining
+*              OFFLINE_QUEUE_FILE as a file name keeps them in that file
+*              instead, for running the store on a host.
+*
+******************************************************************************/
+//PSoC MCU Headers
+#include "cyhal.h"
+
+// Task Headers
+#include "offline_queue.h"
+#include "mqtt_task.h"
+
+// Middleware Headers
+#include "task.h"
+#include "semphr.h"
+
+// Standard C header
+#include <stdio.h>
+#include <string.h>
+
+/*******************************************************************************
+* Macros
+********************************************************************************/
+// Start of a row written by this store
+#define OFFLINE_ROW_MAGIC				(0x4F464C51u)
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+// A row of flash, always full
+typedef struct {
+	uint32_t magic;
+	uint32_t sequence;   // of the write, the oldest row has the lowest
+	offline_delta_t deltas[OFFLINE_QUEUE_ROW_DELTAS];
+} offline_row_t;
+
+/*******************************************************************************
+* Function Prototypes
+********************************************************************************/
+static bool rowsOpen(void);
+static bool rowRead(uint32_t row, void *data, uint32_t length);
+static bool rowWrite(uint32_t row, const offline_row_t *data);
+static bool rowErase(uint32_t row);
+static void spill(void);
+static void dropFlashHead(void);
+static int modeValue(const char *mode);
+
+/*******************************************************************************
+* Global Variables
+********************************************************************************/
+// The newest changes, oldest first from ramHead
+static offline_delta_t ramDeltas[OFFLINE_QUEUE_RAM_SIZE];
+static uint32_t ramHead;
+static uint32_t ramCount;
+
+// The older changes, in rows oldest first from flashHead
+static bool flashReady;
+static uint32_t flashHead;
+static uint32_t flashCount;
+static uint32_t flashRead;       // changes of the head row already replayed
+static uint32_t flashRecovered;  // rows from before the reset, at the head
+static uint32_t flashSequence;   // of the next row written
+static offline_row_t rowBuffer;
+
+static offline_queue_stats_t offlineStats;
+
+// All of the above
+static SemaphoreHandle_t offlineQueueLock;
+
+/*******************************************************************************
+* Function Name: offlineQueueInit
+********************************************************************************
+* Summary:
+*  Creates the lock and finds the rows left in flash before a reset. Called
+*  once, before the tasks that use the store are started. Without flash the
+*  store keeps working in RAM only.
+*
+*******************************************************************************/
+void offlineQueueInit(void){
+	uint32_t header[2];
+	uint32_t lowest = 0;
+	bool found = false;
+
+	offlineQueueLock = xSemaphoreCreateMutex();
+
+	flashReady = rowsOpen();
+	if(!flashReady){
+		printf("Offline store has no flash, keeping %d changes in RAM\n", OFFLINE_QUEUE_RAM_SIZE);
+		return;
+	}
+
+	// The oldest row is the one with the lowest sequence
+	for(uint32_t row = 0; row < OFFLINE_QUEUE_FLASH_ROWS; row++){
+		if(rowRead(row, header, sizeof(header)) && header[0] == OFFLINE_ROW_MAGIC){
+			if(!found || (int32_t)(header[1] - lowest) < 0){
+				lowest = header[1];
+				flashHead = row;
+			}
+			found = true;
+		}
+	}
+	if(!found){
+		return;
+	}
+
+	// The rows after it were written in turn, up to the first gap
+	flashSequence = lowest;
+	while(flashCount < OFFLINE_QUEUE_FLASH_ROWS){
+		uint32_t row = (flashHead + flashCount) % OFFLINE_QUEUE_FLASH_ROWS;
+		if(!rowRead(row, header, sizeof(header)) || header[0] != OFFLINE_ROW_MAGIC || header[1] != flashSequence){
+			break;
+		}
+		flashCount++;
+		flashSequence++;
+	}
+	flashRecovered = flashCount;
+	printf("Offline store recovered %u rows from flash\n", (unsigned int)flashCount);
+}
+
+/*******************************************************************************
+* Function Name: offlineQueuePut
+********************************************************************************
+* Summary:
+*  Keeps a change of a reported field, with the current time.
+*
+* Parameters:
+*  uint32_t field - ACTUALTEMP, SETTEMP or MODE
+*  const thermostat_state_t *state - the state the value is taken from
+*
+* Return:
+*  void
+*
+*******************************************************************************/
+void offlineQueuePut(uint32_t field, const thermostat_state_t *state){
+	offline_delta_t delta = {
+		.timeMs = xTaskGetTickCount() * portTICK_PERIOD_MS,
+		.field = field
+	};
+
+	if(field == ACTUALTEMP){
+		delta.value = state->actualTemp;
+	}
+	else if(field == SETTEMP){
+		delta.value = state->setTemp;
+	}
+	else if(field == MODE){
+		delta.value = modeValue(state->mode);
+	}
+	else{
+		return;
+	}
+
+	xSemaphoreTake(offlineQueueLock, portMAX_DELAY);
+	offlineStats.stored++;
+
+	// Last writer wins for all but actualTemp, in what is still in RAM
+	if(field != ACTUALTEMP){
+		for(uint32_t i = 0; i < ramCount; i++){
+			if(ramDeltas[(ramHead + i) % OFFLINE_QUEUE_RAM_SIZE].field == field){
+				for(; i + 1 < ramCount; i++){
+					ramDeltas[(ramHead + i) % OFFLINE_QUEUE_RAM_SIZE] = ramDeltas[(ramHead + i + 1) % OFFLINE_QUEUE_RAM_SIZE];
+				}
+				ramCount--;
+				offlineStats.compacted++;
+				break;
+			}
+		}
+	}
+
+	if(ramCount == OFFLINE_QUEUE_RAM_SIZE){
+		spill();
+	}
+	ramDeltas[(ramHead + ramCount) % OFFLINE_QUEUE_RAM_SIZE] = delta;
+	ramCount++;
+	xSemaphoreGive(offlineQueueLock);
+}
+
+/*******************************************************************************
+* Function Name: offlineQueuePeek
+********************************************************************************
+* Summary:
+*  Copies the oldest changes, without taking them out of the store.
+*
+* Parameters:
+*  offline_delta_t *deltas - where they go
+*  uint32_t count - most to copy
+*
+* Return:
+*  uint32_t - number copied
+*
+*******************************************************************************/
+uint32_t offlineQueuePeek(offline_delta_t *deltas, uint32_t count){
+	uint32_t copied = 0;
+
+	xSemaphoreTake(offlineQueueLock, portMAX_DELAY);
+	for(uint32_t i = 0, start = flashRead; i < flashCount && copied < count; i++, start = 0){
+		if(!rowRead((flashHead + i) % OFFLINE_QUEUE_FLASH_ROWS, &rowBuffer, sizeof(rowBuffer))){
+			break;
+		}
+		for(uint32_t j = start; j < OFFLINE_QUEUE_ROW_DELTAS && copied < count; j++){
+			deltas[copied] = rowBuffer.deltas[j];
+			if(i < flashRecovered){
+				deltas[copied].timeMs = OFFLINE_TIME_UNKNOWN;
+			}
+			copied++;
+		}
+	}
+	for(uint32_t i = 0; i < ramCount && copied < count; i++){
+		deltas[copied++] = ramDeltas[(ramHead + i) % OFFLINE_QUEUE_RAM_SIZE];
+	}
+	xSemaphoreGive(offlineQueueLock);
+
+	return copied;
+}
+
+/*******************************************************************************
+* Function Name: offlineQueueDrop
+********************************************************************************
+* Summary:
+*  Takes the oldest changes out of the store once they were published. A row
+*  of flash is erased when the last of its changes is taken out.
+*
+*******************************************************************************/
+void offlineQueueDrop(uint32_t count){
+	xSemaphoreTake(offlineQueueLock, portMAX_DELAY);
+	while(count > 0 && (flashCount > 0 || ramCount > 0)){
+		if(flashCount > 0){
+			uint32_t taken = OFFLINE_QUEUE_ROW_DELTAS - flashRead;
+			if(taken > count){
+				taken = count;
+			}
+			flashRead += taken;
+			count -= taken;
+			offlineStats.replayed += taken;
+			if(flashRead == OFFLINE_QUEUE_ROW_DELTAS){
+				dropFlashHead();
+			}
+		}
+		else{
+			ramHead = (ramHead + 1) % OFFLINE_QUEUE_RAM_SIZE;
+			ramCount--;
+			count--;
+			offlineStats.replayed++;
+		}
+	}
+	xSemaphoreGive(offlineQueueLock);
+}
+
+/*******************************************************************************
+* Function Name: offlineQueueCount
+********************************************************************************
+* Summary:
+*  Number of changes in the store.
+*
+*******************************************************************************/
+uint32_t offlineQueueCount(void){
+	uint32_t count;
+
+	xSemaphoreTake(offlineQueueLock, portMAX_DELAY);
+	count = flashCount * OFFLINE_QUEUE_ROW_DELTAS - flashRead + ramCount;
+	xSemaphoreGive(offlineQueueLock);
+
+	return count;
+}
+
+/*******************************************************************************
+* Function Name: offlineQueueModeName
+********************************************************************************
+* Summary:
+*  The mode of the value of a MODE change.
+*
+*******************************************************************************/
+const char *offlineQueueModeName(int value){
+	if(value == OFFLINE_MODE_HEAT){
+		return MODE_HEAT;
+	}
+	if(value == OFFLINE_MODE_COOL){
+		return MODE_COOL;
+	}
+	return MODE_IDLE;
+}
+
+void offlineQueueGetStats(offline_queue_stats_t *stats){
+	xSemaphoreTake(offlineQueueLock, portMAX_DELAY);
+	*stats = offlineStats;
+	xSemaphoreGive(offlineQueueLock);
+}
+
+/*******************************************************************************
+* Function Name: offlineQueueHold
+********************************************************************************
+* Summary:
+*  Keeps every other task out of the store until offlineQueueRelease. Taken
+*  before a task that uses the store is deleted, so it is not deleted while
+*  it holds the lock.
+*
+*******************************************************************************/
+void offlineQueueHold(void){
+	xSemaphoreTake(offlineQueueLock, portMAX_DELAY);
+}
+
+void offlineQueueRelease(void){
+	xSemaphoreGive(offlineQueueLock);
+}
+
+/*******************************************************************************
+* Function Name: spill
+********************************************************************************
+* Summary:
+*  Makes room in RAM by writing its oldest changes to the next row of flash,
+*  dropping the oldest row if the flash is full. Without flash, or if the
+*  write fails, the oldest change in RAM is dropped. Called with the lock.
+*
+*******************************************************************************/
+static void spill(void){
+	if(flashReady){
+		if(flashCount == OFFLINE_QUEUE_FLASH_ROWS){
+			offlineStats.dropped += OFFLINE_QUEUE_ROW_DELTAS - flashRead;
+			dropFlashHead();
+		}
+
+		rowBuffer.magic = OFFLINE_ROW_MAGIC;
+		rowBuffer.sequence = flashSequence;
+		for(uint32_t i = 0; i < OFFLINE_QUEUE_ROW_DELTAS; i++){
+			rowBuffer.deltas[i] = ramDeltas[(ramHead + i) % OFFLINE_QUEUE_RAM_SIZE];
+		}
+		if(rowWrite((flashHead + flashCount) % OFFLINE_QUEUE_FLASH_ROWS, &rowBuffer)){
+			flashCount++;
+			flashSequence++;
+			ramHead = (ramHead + OFFLINE_QUEUE_ROW_DELTAS) % OFFLINE_QUEUE_RAM_SIZE;
+			ramCount -= OFFLINE_QUEUE_ROW_DELTAS;
+			offlineStats.spilled++;
+			return;
+		}
+		printf("Offline store failed to write flash\n");
+	}
+
+	ramHead = (ramHead + 1) % OFFLINE_QUEUE_RAM_SIZE;
+	ramCount--;
+	offlineStats.dropped++;
+}
+
+/*******************************************************************************
+* Function Name: dropFlashHead
+********************************************************************************
+* Summary:
+*  Erases the oldest row of flash. Called with the lock.
+*
+*******************************************************************************/
+static void dropFlashHead(void){
+	rowErase(flashHead);
+	flashHead = (flashHead + 1) % OFFLINE_QUEUE_FLASH_ROWS;
+	flashCount--;
+	flashRead = 0;
+	if(flashRecovered > 0){
+		flashRecovered--;
+	}
+}
+
+/*******************************************************************************
+* Function Name: modeValue
+********************************************************************************
+* Summary:
+*  The OFFLINE_MODE_* of a mode, kept instead of the pointer so it still
+*  means the same after a reset.
+*
+*******************************************************************************/
+static int modeValue(const char *mode){
+	if(strcmp(mode, MODE_HEAT) == 0){
+		return OFFLINE_MODE_HEAT;
+	}
+	if(strcmp(mode, MODE_COOL) == 0){
+		return OFFLINE_MODE_COOL;
+	}
+	return OFFLINE_MODE_IDLE;
+}
+
+#ifndef OFFLINE_QUEUE_FILE
+
+static cyhal_flash_t offlineFlash;
+static uint32_t offlineFlashBase;
+
+static bool rowsOpen(void){
+	cyhal_flash_info_t info;
+	if(cyhal_flash_init(&offlineFlash) != CY_RSLT_SUCCESS){
+		return false;
+	}
+	cyhal_flash_get_info(&offlineFlash, &info);
+	const cyhal_flash_block_info_t *block = &info.blocks[info.block_count - 1];
+	if(block->page_size != OFFLINE_QUEUE_ROW_SIZE || block->size < OFFLINE_QUEUE_FLASH_ROWS * OFFLINE_QUEUE_ROW_SIZE){
+		return false;
+	}
+	offlineFlashBase = block->start_address;
+	return true;
+}
+
+static bool rowRead(uint32_t row, void *data, uint32_t length){
+	return cyhal_flash_read(&offlineFlash, offlineFlashBase + row * OFFLINE_QUEUE_ROW_SIZE, (uint8_t *)data, length) == CY_RSLT_SUCCESS;
+}
+
+static bool rowWrite(uint32_t row, const offline_row_t *data){
+	// erases the row and programs it
+	return cyhal_flash_write(&offlineFlash, offlineFlashBase + row * OFFLINE_QUEUE_ROW_SIZE, (const uint32_t *)data) == CY_RSLT_SUCCESS;
+}
+
+static bool rowErase(uint32_t row){
+	return cyhal_flash_erase(&offlineFlash, offlineFlashBase + row * OFFLINE_QUEUE_ROW_SIZE) == CY_RSLT_SUCCESS;
+}
+
+#else
+
+static FILE *offlineFile;
+
+static bool rowsOpen(void){
+	offlineFile = fopen(OFFLINE_QUEUE_FILE, "r+b");
+	if(offlineFile == NULL){
+		offlineFile = fopen(OFFLINE_QUEUE_FILE, "w+b"); // first run
+	}
+	return offlineFile != NULL;
+}
+
+static bool rowRead(uint32_t row, void *data, uint32_t length){
+	memset(data, 0xFF, length); // past the end of the file reads as erased
+	if(fseek(offlineFile, row * OFFLINE_QUEUE_ROW_SIZE, SEEK_SET) != 0){
+		return false;
+	}
+	fread(data, 1, length, offlineFile);
+	return true;
+}
+
+static bool rowWrite(uint32_t row, const offline_row_t *data){
+	if(fseek(offlineFile, row * OFFLINE_QUEUE_ROW_SIZE, SEEK_SET) != 0 || fwrite(data, 1, sizeof(*data), offlineFile) != sizeof(*data)){
+		return false;
+	}
+	return fflush(offlineFile) == 0;
+}
+
+static bool rowErase(uint32_t row){
+	offline_row_t erased;
+	memset(&erased, 0xFF, sizeof(erased));
+	return rowWrite(row, &erased);
+}
+
+#endif
+
+/* [] END OF FILE */
@@ -0,0 +1,88 @@
+/******************************************************************************
+* File Name:   offline_queue.h
+*
+* Description: This file is the public interface of offline_queue.c, the
+*              store of the reported state changes made while the thermostat
+*              is not connected to the broker.
+*
+*              Each change is kept with the time it was made, first in RAM.
+*              When the RAM is full the oldest changes are written to a row
+*              of flash, and when the flash is full its oldest row is dropped,
+*              so the store never grows past OFFLINE_QUEUE_RAM_SIZE changes
+*              plus OFFLINE_QUEUE_FLASH_ROWS rows.
+*
+*              Every actualTemp is kept, for its history. setTemp and mode
+*              are last writer wins: a new change replaces the one still in
+*              RAM for the same field.
+*
+*              The rows in flash are found again after a reset, but the
+*              times of their changes are lost with the tick count and read
+*              back as OFFLINE_TIME_UNKNOWN. A row that was partly replayed
+*              before a reset is replayed again from its start.
+*
+******************************************************************************/
+#ifndef OFFLINE_QUEUE_H_
+#define OFFLINE_QUEUE_H_
+
+// Middleware Headers
+#include "FreeRTOS.h"
+
+// Task Headers
+#include "thermostat_state.h"
+
+/*******************************************************************************
+* Macros
+********************************************************************************/
+/* Changes kept in RAM before the oldest of them go to flash. */
+#define OFFLINE_QUEUE_RAM_SIZE                (128)
+
+/* Rows of flash the changes spill to, each holds OFFLINE_QUEUE_ROW_DELTAS. */
+#define OFFLINE_QUEUE_FLASH_ROWS              (16)
+#define OFFLINE_QUEUE_ROW_SIZE                (512)
+#define OFFLINE_QUEUE_ROW_HEADER              (8)
+#define OFFLINE_QUEUE_ROW_DELTAS              ((OFFLINE_QUEUE_ROW_SIZE - OFFLINE_QUEUE_ROW_HEADER) / sizeof(offline_delta_t))
+
+/* Time of a change read back from flash after a reset. */
+#define OFFLINE_TIME_UNKNOWN                  (0xFFFFFFFFu)
+
+/* Values of a MODE change. */
+#define OFFLINE_MODE_IDLE                     (0)
+#define OFFLINE_MODE_HEAT                     (1)
+#define OFFLINE_MODE_COOL                     (2)
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* One change of a reported field. */
+typedef struct {
+	uint32_t timeMs;   // tick count of the change, in ms
+	int16_t value;     // the temperature, or OFFLINE_MODE_* for MODE
+	uint8_t field;     // ACTUALTEMP, SETTEMP or MODE
+	uint8_t reserved;
+} offline_delta_t;
+
+/* Counters of the store. */
+typedef struct {
+	uint32_t stored;      // changes put in the store
+	uint32_t compacted;   // replaced by a later change of the same field
+	uint32_t spilled;     // rows written to flash
+	uint32_t dropped;     // lost when the flash was full
+	uint32_t replayed;    // taken out after they were published
+} offline_queue_stats_t;
+
+/*******************************************************************************
+* Function Prototypes
+********************************************************************************/
+void offlineQueueInit(void);
+void offlineQueuePut(uint32_t field, const thermostat_state_t *state);
+uint32_t offlineQueuePeek(offline_delta_t *deltas, uint32_t count);
+void offlineQueueDrop(uint32_t count);
+uint32_t offlineQueueCount(void);
+const char *offlineQueueModeName(int value);
+void offlineQueueGetStats(offline_queue_stats_t *stats);
+void offlineQueueHold(void);
+void offlineQueueRelease(void);
+
+#endif /* OFFLINE_QUEUE_H_ */
+
+/* [] END OF FILE */
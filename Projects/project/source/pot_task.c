@@ -16,9 +16,11 @@
 // Task Headers
 #include "pot_task.h"
 #include "mqtt_task.h"
+#include "publisher_task.h"
+#include "thermostat_state.h"
 
-// Middleware Headers
-#include "semphr.h"
+// Standard C header
+#include <string.h>
 
 /*******************************************************************************
 * Global Variables
@@ -26,15 +28,6 @@
 /* Task handle for this task. */
 TaskHandle_t pot_task_handle;
 
-// Defined in main.c
-extern int actualTemp, setTemp;
-extern char * mode;
-extern bool isConnected;
-extern SemaphoreHandle_t actualTempSemaphore;
-extern SemaphoreHandle_t setTempSemaphore;
-extern SemaphoreHandle_t modeSemaphore;
-extern SemaphoreHandle_t isConnectedSemaphore;
-
 /*******************************************************************************
 * Function Name: pot_task
 ********************************************************************************
@@ -101,6 +94,9 @@ void pot_task(void *pvParameters){
 	// Var to update temp
     int newActualTemp;
 
+    // The mode worked out
+    char *mode;
+
     for (;;){
     	/* Read the ADC conversion result for corresponding ADC channel in millivolts. */
 		adc_out = cyhal_adc_read_uv(&adc_chan_0_obj) / 1000;
@@ -109,55 +105,34 @@ void pot_task(void *pvParameters){
 		newActualTemp = (adc_out * (ACTUALTEMPMAX - ACTUALTEMPMIN) / (3303 - 0) + ACTUALTEMPMIN);
 
 		// If the temp changed, record it, then notify the publisher task so it can publish the new value
-		xSemaphoreTake(actualTempSemaphore, portMAX_DELAY);
-		if(newActualTemp != actualTemp){
-			actualTemp = newActualTemp;
+		if(thermostatSetActualTemp(newActualTemp)){
 			// Notify the display task and publisher task that the actualTemp has changed
 			xTaskNotifyGive(display_task_handle);
-			xSemaphoreTake(isConnectedSemaphore, portMAX_DELAY);
-			if(isConnected){
-				xTaskNotify(publisher_task_handle, ACTUALTEMP, eSetValueWithoutOverwrite);
-			}
-			xSemaphoreGive(isConnectedSemaphore);
+			publisherNotify(ACTUALTEMP);
 		}
 
 		// Determine what mode the thermostat should be in
-		xSemaphoreTake(modeSemaphore, portMAX_DELAY);
-		xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-		// Var to store the previous mode
-		char *modePrev = mode;
-
-		// Cooling
-		if(actualTemp > setTemp){
-			mode = MODE_COOL;
-			cyhal_gpio_write(CYBSP_LED_RGB_RED, CYBSP_LED_STATE_OFF);
-			cyhal_gpio_write(CYBSP_LED_RGB_BLUE, CYBSP_LED_STATE_ON);
-		}
-		// Heating
-		else if(actualTemp < setTemp){
-			mode = MODE_HEAT;
-			cyhal_gpio_write(CYBSP_LED_RGB_RED, CYBSP_LED_STATE_ON);
-			cyhal_gpio_write(CYBSP_LED_RGB_BLUE, CYBSP_LED_STATE_OFF);
-		}
-		// Idle
-		else{
-			mode = MODE_IDLE;
-			cyhal_gpio_write(CYBSP_LED_RGB_RED, CYBSP_LED_STATE_OFF);
-			cyhal_gpio_write(CYBSP_LED_RGB_BLUE, CYBSP_LED_STATE_OFF);
-		}
-		xSemaphoreGive(actualTempSemaphore);
-		xSemaphoreGive(setTempSemaphore);
-		// If the mode changed notify the display task to update the display and notify the publisher task to update the cloud
-		if(modePrev != mode){
-			xTaskNotifyGive(display_task_handle);
-			xSemaphoreTake(isConnectedSemaphore, portMAX_DELAY);
-			if(isConnected){
-				xTaskNotify(publisher_task_handle, MODE, eSetValueWithoutOverwrite);
+		if(thermostatUpdateMode(&mode)){
+			// Cooling
+			if(strcmp(mode, MODE_COOL) == 0){
+				cyhal_gpio_write(CYBSP_LED_RGB_RED, CYBSP_LED_STATE_OFF);
+				cyhal_gpio_write(CYBSP_LED_RGB_BLUE, CYBSP_LED_STATE_ON);
+			}
+			// Heating
+			else if(strcmp(mode, MODE_HEAT) == 0){
+				cyhal_gpio_write(CYBSP_LED_RGB_RED, CYBSP_LED_STATE_ON);
+				cyhal_gpio_write(CYBSP_LED_RGB_BLUE, CYBSP_LED_STATE_OFF);
+			}
+			// Idle
+			else{
+				cyhal_gpio_write(CYBSP_LED_RGB_RED, CYBSP_LED_STATE_OFF);
+				cyhal_gpio_write(CYBSP_LED_RGB_BLUE, CYBSP_LED_STATE_OFF);
 			}
-			xSemaphoreGive(isConnectedSemaphore);
-		}
-		xSemaphoreGive(modeSemaphore);
 
+			// Notify the display task to update the display and notify the publisher task to update the cloud
+			xTaskNotifyGive(display_task_handle);
+			publisherNotify(MODE);
+		}
 
 		/* Give delay between samples */
 		vTaskDelay(sampleDelay);
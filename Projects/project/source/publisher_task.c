@@ -49,6 +49,8 @@
 #include "mqtt_task.h"
 #include "subscriber_task.h"
 #include "display_task.h"
+#include "thermostat_state.h"
+#include "offline_queue.h"
 
 // Middleware Headers
 #include "semphr.h"
@@ -74,12 +76,20 @@
  * time (in milliseconds).
  */
 #define PUBLISH_RETRY_MS                (1000)
-#define MAX_MQTT_CHARS					(100)
+#define MAX_MQTT_CHARS					(160)
+
+/* The fields that go in the reported section, and all of them. */
+#define REPORTED_FIELDS					(NOTIFY_BIT(ACTUALTEMP) | NOTIFY_BIT(SETTEMP) | NOTIFY_BIT(MODE))
+#define ALL_FIELDS						(REPORTED_FIELDS | NOTIFY_BIT(DESIRED))
 
 /******************************************************************************
 * Function Prototypes
 *******************************************************************************/
 void publish(char valueToPublish[]);
+static void publishState(uint32_t fields, char payloadString[], uint32_t size);
+static uint32_t fieldCount(uint32_t fields);
+static uint32_t pendingFields(void);
+static void publishOffline(void);
 
 /******************************************************************************
 * Global Variables
@@ -87,6 +97,12 @@ void publish(char valueToPublish[]);
 /* FreeRTOS task handle for this task. */
 TaskHandle_t publisher_task_handle;
 
+/* Statistics of the coalescing windows. */
+publisher_stats_t publisherStats;
+
+/* Generations of each field, indexed by the notification identifiers. */
+publisher_generation_t publisherGenerations[PUBLISH_GENERATIONS];
+
 /* Structure to store publish message information. */
 cy_mqtt_publish_info_t publish_info =
 {
@@ -97,12 +113,6 @@ cy_mqtt_publish_info_t publish_info =
     .dup = false
 };
 
-// Defined in main.c
-extern int actualTemp, setTemp;
-extern char *mode;
-extern SemaphoreHandle_t actualTempSemaphore;
-extern SemaphoreHandle_t setTempSemaphore;
-extern SemaphoreHandle_t modeSemaphore;
 
 /******************************************************************************
  * Function Name: publisher_task
@@ -112,6 +122,11 @@ extern SemaphoreHandle_t modeSemaphore;
  *  ISR, and publishing of MQTT messages to control the device that is actuated
  *  by the subscriber task.
  *
+ *  The first change opens a window and the fields that change while it is
+ *  open are gathered, then all of them go out in one shadow document. A pot
+ *  movement that changes actualTemp and mode is one publish instead of one
+ *  per field.
+ *
  * Parameters:
  *  void *pvParameters : Task parameter defined during task creation (unused)
  *
@@ -124,8 +139,11 @@ void publisher_task(void *pvParameters){
     /* Var to store strings to publish in. */
 	char payloadString[MAX_MQTT_CHARS];
 
-    /* Variable to receive new device state from capsense thread, pot thread, or display thread */
-    uint32_t valueToUpdate; // either ACTUALTEMP, SETTEMP, or MODE
+    /* Fields that changed, NOTIFY_BIT() of ACTUALTEMP, SETTEMP, DESIRED or MODE */
+    uint32_t changedFields;
+
+    /* Generations of the fields read into the document */
+    uint32_t generations[PUBLISH_GENERATIONS];
 
     /* To avoid compiler warnings */
     (void)pvParameters;
@@ -136,37 +154,270 @@ void publisher_task(void *pvParameters){
     sprintf(payloadString, "{\"state\":{\"reported\":{\"IP Address\":\"%s\"}}}", ip4addr_ntoa((const ip4_addr_t *) &myIP.ip.v4));
     publish(payloadString);
 
+    // Changes notified to the task this one replaces after a reconnect are still due
+    changedFields = pendingFields();
+    if(changedFields){
+    	xTaskNotify(xTaskGetCurrentTaskHandle(), changedFields, eSetBits);
+    }
+
+    // Changes made while offline go out in batches, one per PUBLISH_REPLAY_INTERVAL_MS
+    TickType_t lastReplay = xTaskGetTickCount();
+
     while(true){
-        /* Wait for notification from capsense, pot, or subscriber tasks. */
-        xTaskNotifyWait(0, 0, &valueToUpdate, portMAX_DELAY);
-        
-       if(valueToUpdate == ACTUALTEMP){
-    	   xSemaphoreTake(actualTempSemaphore, portMAX_DELAY);
-    	   sprintf(payloadString, "{\"state\":{\"reported\":{\"actualTemp\":%d}}}", actualTemp);
-    	   xSemaphoreGive(actualTempSemaphore);
-       }
-       else if(valueToUpdate == SETTEMP){
-    	   xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-    	   sprintf(payloadString, "{\"state\":{\"reported\":{\"setTemp\":%d}}}", setTemp);
-    	   xSemaphoreGive(setTempSemaphore);
-       }
-       else if(valueToUpdate == MODE){
-    	   xSemaphoreTake(modeSemaphore, portMAX_DELAY);
-    	   sprintf(payloadString, "{\"state\":{\"reported\":{\"mode\":\"%s\"}}}", mode);
-    	   xSemaphoreGive(modeSemaphore);
-       }
-       else if(valueToUpdate == DESIRED){
-    	   // Overwrite desired shadow member then update current reported setTemp
-		   sprintf(payloadString, "{\"state\":{\"desired\":{\"setTemp\":%d}}}", SETTEMPDEFAULT);
-		   publish(payloadString);
-		   xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-		   sprintf(payloadString, "{\"state\":{\"reported\":{\"setTemp\":%d}}}", setTemp);
-		   xSemaphoreGive(setTempSemaphore);
-		  }
-       publish(payloadString);
+        /* Wait for notification from capsense, pot, or subscriber tasks, and take every field pending.
+         * While changes made offline are left, wait no longer than the next batch of them is due. */
+        TickType_t wait = portMAX_DELAY;
+        if(offlineQueueCount() > 0){
+        	TickType_t elapsed = xTaskGetTickCount() - lastReplay;
+        	wait = (elapsed >= pdMS_TO_TICKS(PUBLISH_REPLAY_INTERVAL_MS)) ? 0 : pdMS_TO_TICKS(PUBLISH_REPLAY_INTERVAL_MS) - elapsed;
+        }
+        if(wait == 0 || xTaskNotifyWait(0, ALL_FIELDS, &changedFields, wait) != pdTRUE){
+        	// A batch is due. Live changes stay pending in the notification bits.
+        	publishOffline();
+        	lastReplay = xTaskGetTickCount();
+        	continue;
+        }
+
+        // Gather the fields that change while the window is open
+        TickType_t first = xTaskGetTickCount();
+        TickType_t deadline = first + pdMS_TO_TICKS(PUBLISH_COALESCE_WINDOW_MS);
+        uint32_t fields = changedFields;
+        while(fieldCount(fields) < PUBLISH_COALESCE_MAX_FIELDS){
+        	TickType_t now = xTaskGetTickCount();
+        	if((int32_t)(deadline - now) <= 0 || xTaskNotifyWait(0, ALL_FIELDS, &changedFields, deadline - now) != pdTRUE){
+        		break;
+        	}
+        	fields |= changedFields;
+
+        	// Every change holds the window open a little longer, up to the latency bound
+        	deadline = xTaskGetTickCount() + pdMS_TO_TICKS(PUBLISH_COALESCE_WINDOW_MS);
+        	if(deadline - first > pdMS_TO_TICKS(PUBLISH_MAX_LATENCY_MS)){
+        		deadline = first + pdMS_TO_TICKS(PUBLISH_MAX_LATENCY_MS);
+        	}
+        }
+
+        // The generations are taken before the values are read, so the values
+        // are at least as new. A change that comes after sets its bit again.
+        uint32_t notifications = 0;
+        for(uint32_t value = 0; value < PUBLISH_GENERATIONS; value++){
+        	generations[value] = publisherGenerations[value].changed;
+        	if(fields & NOTIFY_BIT(value)){
+        		notifications += generations[value] - publisherGenerations[value].published;
+        	}
+        }
+
+        publishState(fields, payloadString, sizeof(payloadString));
+
+        for(uint32_t value = 0; value < PUBLISH_GENERATIONS; value++){
+        	if(fields & NOTIFY_BIT(value)){
+        		publisherGenerations[value].published = generations[value];
+        	}
+        }
+
+        uint32_t latency = (xTaskGetTickCount() - first) * portTICK_PERIOD_MS;
+        publisherStats.windows++;
+        publisherStats.notifications += notifications;
+        publisherStats.fullWindows += (fieldCount(fields) >= PUBLISH_COALESCE_MAX_FIELDS);
+        publisherStats.lastFields = fieldCount(fields);
+        publisherStats.lastLatencyMs = latency;
+        if(latency > publisherStats.maxLatencyMs){
+        	publisherStats.maxLatencyMs = latency;
+        }
+        printf("Coalesced %u changes in %u ms (%u publishes for %u changes so far)\n\n", (unsigned int)notifications, (unsigned int)latency,
+        		(unsigned int)publisherStats.windows, (unsigned int)publisherStats.notifications);
     }
 }
 
+/******************************************************************************
+ * Function Name: publisherNotify
+ ******************************************************************************
+ * Summary:
+ *  Tells the publisher task that a field changed. Called after the new value
+ *  is stored. The bit of the field is ORed into the notification value, so a
+ *  change is never lost while the publisher is busy; changes to the same
+ *  field before it wakes are published once, with the latest value. While
+ *  offline, or while there is no publisher task, the change goes to the
+ *  offline store instead.
+ *
+ * Parameters:
+ *  uint32_t value - ACTUALTEMP, SETTEMP, DESIRED or MODE
+ *
+ * Return:
+ *  void
+ *
+ ******************************************************************************/
+void publisherNotify(uint32_t value){
+
+	thermostat_state_t state;
+
+	taskENTER_CRITICAL();
+	publisherGenerations[value].changed++;
+	taskEXIT_CRITICAL();
+
+	// Offline the change is kept for the replay, and its field stays pending
+	// for the publisher started on the next connection. The check and the
+	// notify are one step for stop_mqtt_tasks, which clears the handle with
+	// the scheduler suspended before it deletes the publisher.
+	vTaskSuspendAll();
+	thermostatStateGet(&state);
+	bool notified = (state.isConnected && publisher_task_handle != NULL);
+	if(notified){
+		xTaskNotify(publisher_task_handle, NOTIFY_BIT(value), eSetBits);
+	}
+	xTaskResumeAll();
+
+	if(!notified){
+		offlineQueuePut(value, &state);
+	}
+}
+
+/******************************************************************************
+ * Function Name: publishState
+ ******************************************************************************
+ * Summary:
+ *  Publishes one shadow document with the current value of every field that
+ *  changed. DESIRED overwrites the desired setTemp in the same document and
+ *  reports the current setTemp.
+ *
+ * Parameters:
+ *  uint32_t fields - NOTIFY_BIT() of each field that changed
+ *  char payloadString[] - buffer for the document
+ *  uint32_t size - size of payloadString
+ *
+ * Return:
+ *  void
+ *
+ ******************************************************************************/
+static void publishState(uint32_t fields, char payloadString[], uint32_t size){
+
+	const char *separator = "";
+	int length;
+
+	// The values of one moment
+	thermostat_state_t state;
+	thermostatStateGet(&state);
+
+	if(fields & NOTIFY_BIT(DESIRED)){
+		fields |= NOTIFY_BIT(SETTEMP);
+	}
+
+	length = snprintf(payloadString, size, "{\"state\":{");
+	if(fields & NOTIFY_BIT(DESIRED)){
+		length += snprintf(&payloadString[length], size - length, "\"desired\":{\"setTemp\":%d},", SETTEMPDEFAULT);
+	}
+	length += snprintf(&payloadString[length], size - length, "\"reported\":{");
+	if(fields & NOTIFY_BIT(ACTUALTEMP)){
+		length += snprintf(&payloadString[length], size - length, "%s\"actualTemp\":%d", separator, state.actualTemp);
+		separator = ",";
+	}
+	if(fields & NOTIFY_BIT(SETTEMP)){
+		length += snprintf(&payloadString[length], size - length, "%s\"setTemp\":%d", separator, state.setTemp);
+		separator = ",";
+	}
+	if(fields & NOTIFY_BIT(MODE)){
+		length += snprintf(&payloadString[length], size - length, "%s\"mode\":\"%s\"", separator, state.mode);
+	}
+	snprintf(&payloadString[length], size - length, "}}}");
+
+	publish(payloadString);
+}
+
+/******************************************************************************
+ * Function Name: fieldCount
+ ******************************************************************************
+ * Summary:
+ *  Number of reported fields in a set of changed fields, DESIRED counts as
+ *  setTemp.
+ *
+ ******************************************************************************/
+static uint32_t fieldCount(uint32_t fields){
+
+	uint32_t count = 0;
+
+	if(fields & NOTIFY_BIT(DESIRED)){
+		fields |= NOTIFY_BIT(SETTEMP);
+	}
+	fields &= REPORTED_FIELDS;
+	while(fields){
+		count += fields & 1;
+		fields >>= 1;
+	}
+	return count;
+}
+
+/******************************************************************************
+ * Function Name: publishOffline
+ ******************************************************************************
+ * Summary:
+ *  Publishes the oldest PUBLISH_REPLAY_BATCH changes of the offline store as
+ *  one document, oldest first, each with how long ago it was made, then
+ *  takes them out of the store. If the publish fails they stay in the store
+ *  for the next connection.
+ *
+ *  {"state":{"reported":{"offline":[{"ageMs":4200,"actualTemp":71},...]}}}
+ *
+ ******************************************************************************/
+static void publishOffline(void){
+
+	static char replayString[PUBLISH_REPLAY_MAX_CHARS];
+	offline_delta_t deltas[PUBLISH_REPLAY_BATCH];
+	offline_queue_stats_t stats;
+	uint32_t count = offlineQueuePeek(deltas, PUBLISH_REPLAY_BATCH);
+	uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	int length;
+
+	if(count == 0){
+		return;
+	}
+
+	length = snprintf(replayString, sizeof(replayString), "{\"state\":{\"reported\":{\"offline\":[");
+	for(uint32_t i = 0; i < count; i++){
+		length += snprintf(&replayString[length], sizeof(replayString) - length, "%s{\"ageMs\":", i ? "," : "");
+		if(deltas[i].timeMs == OFFLINE_TIME_UNKNOWN){
+			length += snprintf(&replayString[length], sizeof(replayString) - length, "null");
+		}
+		else{
+			length += snprintf(&replayString[length], sizeof(replayString) - length, "%u", (unsigned int)(now - deltas[i].timeMs));
+		}
+		if(deltas[i].field == ACTUALTEMP){
+			length += snprintf(&replayString[length], sizeof(replayString) - length, ",\"actualTemp\":%d}", deltas[i].value);
+		}
+		else if(deltas[i].field == SETTEMP){
+			length += snprintf(&replayString[length], sizeof(replayString) - length, ",\"setTemp\":%d}", deltas[i].value);
+		}
+		else{
+			length += snprintf(&replayString[length], sizeof(replayString) - length, ",\"mode\":\"%s\"}", offlineQueueModeName(deltas[i].value));
+		}
+	}
+	snprintf(&replayString[length], sizeof(replayString) - length, "]}}}");
+
+	publish(replayString);
+	offlineQueueDrop(count);
+
+	offlineQueueGetStats(&stats);
+	printf("Replayed %u offline changes, %u left (%u stored, %u compacted, %u dropped)\n\n", (unsigned int)count, (unsigned int)offlineQueueCount(),
+			(unsigned int)stats.stored, (unsigned int)stats.compacted, (unsigned int)stats.dropped);
+}
+
+/******************************************************************************
+ * Function Name: pendingFields
+ ******************************************************************************
+ * Summary:
+ *  The fields with changes that have not been published.
+ *
+ ******************************************************************************/
+static uint32_t pendingFields(void){
+
+	uint32_t fields = 0;
+
+	for(uint32_t value = 0; value < PUBLISH_GENERATIONS; value++){
+		if(publisherGenerations[value].changed != publisherGenerations[value].published){
+			fields |= NOTIFY_BIT(value);
+		}
+	}
+	return fields;
+}
+
 /******************************************************************************
  * Function Name: publish
  ******************************************************************************
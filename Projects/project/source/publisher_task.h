@@ -50,16 +50,60 @@
 #define PUBLISHER_TASK_PRIORITY               (2)
 #define PUBLISHER_TASK_STACK_SIZE             (1024 * 1)
 
+/* Coalescing of the reported state. The changes that come within
+ * PUBLISH_COALESCE_WINDOW_MS of each other are published as one document,
+ * but never later than PUBLISH_MAX_LATENCY_MS after the first of them. The
+ * window closes early once PUBLISH_COALESCE_MAX_FIELDS fields have changed,
+ * there is nothing left to wait for. */
+#define PUBLISH_COALESCE_WINDOW_MS            (100)
+#define PUBLISH_MAX_LATENCY_MS                (250)
+#define PUBLISH_COALESCE_MAX_FIELDS           (3)
+
+/* Replay of the changes made while offline, see offline_queue.h. At most
+ * PUBLISH_REPLAY_BATCH of them go in one document, one document every
+ * PUBLISH_REPLAY_INTERVAL_MS, between the live updates. */
+#define PUBLISH_REPLAY_BATCH                  (8)
+#define PUBLISH_REPLAY_INTERVAL_MS            (500)
+#define PUBLISH_REPLAY_MAX_CHARS              (400)
+
+/* Generations kept, one per notification identifier of mqtt_task.h. */
+#define PUBLISH_GENERATIONS                   (5)
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* Statistics of the coalescing windows, only written by the publisher task. */
+typedef struct {
+	uint32_t windows;          // merged documents published
+	uint32_t notifications;    // changes merged into them
+	uint32_t fullWindows;      // windows closed early by PUBLISH_COALESCE_MAX_FIELDS
+	uint32_t lastFields;       // fields in the last document
+	uint32_t lastLatencyMs;    // first change to publish, of the last window
+	uint32_t maxLatencyMs;     // the longest of those
+} publisher_stats_t;
+
+/* Generations of a field. changed counts the changes notified with
+ * publisherNotify, published is what changed was when the field was last
+ * read into a document. The cloud has the latest value of the field when the
+ * two are equal. */
+typedef struct {
+	volatile uint32_t changed;   // by the notifying tasks
+	volatile uint32_t published; // by the publisher task
+} publisher_generation_t;
+
 /*******************************************************************************
 * Extern Variables
 ********************************************************************************/
 // Defined in publisher.c
 extern TaskHandle_t publisher_task_handle;
+extern publisher_stats_t publisherStats;
+extern publisher_generation_t publisherGenerations[PUBLISH_GENERATIONS];
 
 /*******************************************************************************
 * Function Prototypes
 ********************************************************************************/
 void publisher_task(void *pvParameters);
+void publisherNotify(uint32_t value);
 
 #endif /* PUBLISHER_TASK_H_ */
 
@@ -46,7 +46,6 @@
 
 /* Middleware libraries */
 #include "FreeRTOS.h"
-#include "semphr.h"
 #include "cy_retarget_io.h"
 #include "cy_mqtt_api.h"
 #include "cJSON.h"
@@ -54,6 +53,8 @@
 /* Task header files */
 #include "subscriber_task.h"
 #include "mqtt_task.h"
+#include "publisher_task.h"
+#include "thermostat_state.h"
 
 /* Configuration file for MQTT client */
 #include "mqtt_client_config.h"
@@ -81,10 +82,6 @@ static void subscribe_to_topic(void);
 /* Task handle for this task. */
 TaskHandle_t subscriber_task_handle;
 
-// Defined in main.c
-extern int setTemp;
-extern SemaphoreHandle_t setTempSemaphore;
-
 /* Configure the subscription information structure. */
 cy_mqtt_subscribe_info_t subscribe_info =
 {
@@ -122,13 +119,11 @@ void subscriber_task(void *pvParameters){
         /* Block until a notification is received from the subscriber callback. */
         xTaskNotifyWait(0, 0, &received_setTemp_Value, portMAX_DELAY);
         /* Update the current device setTemp Value with the one just recieved. */
-        xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-        setTemp = received_setTemp_Value;
-        xSemaphoreGive(setTempSemaphore);
+        thermostatSetSetTemp(received_setTemp_Value);
         // Notify the display thread that setTemp has changed
         xTaskNotifyGive(display_task_handle);
         // Notify the publisher task to overwrite the desired shadow member
-		xTaskNotify(publisher_task_handle, DESIRED, eSetValueWithoutOverwrite);
+		publisherNotify(DESIRED);
     }
 }
 
@@ -219,11 +214,12 @@ void mqtt_subscription_callback(cy_mqtt_publish_info_t *received_msg_info){
     cJSON *setTempRecieved = cJSON_GetObjectItem(reported, "setTemp");// Search for the key "setTemp"
 
     // If the read value does not equal the current global setTemp value, and is within range notify the subscriber task
-    xSemaphoreTake(setTempSemaphore, portMAX_DELAY);
-    if(setTempRecieved != NULL  && setTemp != setTempRecieved->valueint && setTempRecieved->valueint >= ACTUALTEMPMIN && setTempRecieved->valueint <= ACTUALTEMPMAX){
+    thermostat_state_t state;
+    thermostatStateGet(&state);
+    if(setTempRecieved != NULL  && state.setTemp != setTempRecieved->valueint && setTempRecieved->valueint >= ACTUALTEMPMIN && setTempRecieved->valueint <= ACTUALTEMPMAX){
     	uint32_t setTempValue = setTempRecieved->valueint;
-		xTaskNotify(subscriber_task_handle, setTempValue, eSetValueWithoutOverwrite);
+		// The latest desired value wins over one the task has not taken yet
+		xTaskNotify(subscriber_task_handle, setTempValue, eSetValueWithOverwrite);
     }
-    xSemaphoreGive(setTempSemaphore);
 }
 /* [] END OF FILE */
@@ -0,0 +1,221 @@
+/******************************************************************************
+* File Name: thermostat_state.c
+*
+* Description: The state of the thermostat, written by the pot, capsense,
+*              subscriber and MQTT tasks and read by all of them, see
+*              thermostat_state.h.
+*
+******************************************************************************/
+//PSoC MCU Headers
+#include "cyhal.h"
+
+// Task Headers
+#include "thermostat_state.h"
+#include "mqtt_task.h"
+
+// Middleware Headers
+#include "task.h"
+
+/*******************************************************************************
+* Global Variables
+********************************************************************************/
+// The state of the thermostat, only changed between writeBegin and writeEnd
+static volatile thermostat_state_t thermostatState = {
+	.actualTemp = 0,
+	.setTemp = 70,
+	.mode = MODE_IDLE,
+	.isConnected = false
+};
+
+// Odd while the state is being written
+static volatile uint32_t thermostatSequence;
+
+/*******************************************************************************
+* Function Prototypes
+********************************************************************************/
+static void writeBegin(void);
+static void writeEnd(void);
+
+/*******************************************************************************
+* Function Name: thermostatStateGet
+********************************************************************************
+* Summary:
+*  Copies the state of the thermostat, without blocking. The copy is taken
+*  again if a writer ran while it was taken, which only happens when the
+*  reader was preempted by the writer.
+*
+* Parameters:
+*  thermostat_state_t *state - where the copy goes
+*
+* Return:
+*  void
+*
+*******************************************************************************/
+void thermostatStateGet(thermostat_state_t *state){
+	uint32_t sequence;
+
+	do{
+		sequence = thermostatSequence;
+		__DMB();
+		state->actualTemp = thermostatState.actualTemp;
+		state->setTemp = thermostatState.setTemp;
+		state->mode = thermostatState.mode;
+		state->isConnected = thermostatState.isConnected;
+		__DMB();
+	}while((sequence & 1) || sequence != thermostatSequence);
+}
+
+/*******************************************************************************
+* Function Name: thermostatSetActualTemp
+********************************************************************************
+* Summary:
+*  Stores the temperature read by the pot task.
+*
+* Return:
+*  bool - true if the temperature changed
+*
+*******************************************************************************/
+bool thermostatSetActualTemp(int actualTemp){
+	bool changed;
+
+	writeBegin();
+	changed = (thermostatState.actualTemp != actualTemp);
+	thermostatState.actualTemp = actualTemp;
+	writeEnd();
+
+	return changed;
+}
+
+/*******************************************************************************
+* Function Name: thermostatSetSetTemp
+********************************************************************************
+* Summary:
+*  Stores a set temperature received from the cloud.
+*
+* Return:
+*  bool - true if the set temperature changed
+*
+*******************************************************************************/
+bool thermostatSetSetTemp(int setTemp){
+	bool changed;
+
+	writeBegin();
+	changed = (thermostatState.setTemp != setTemp);
+	thermostatState.setTemp = setTemp;
+	writeEnd();
+
+	return changed;
+}
+
+/*******************************************************************************
+* Function Name: thermostatStepSetTemp
+********************************************************************************
+* Summary:
+*  Moves the set temperature by step, within the range of the thermostat. The
+*  step is taken from the value at the time of the write, so a set
+*  temperature received from the cloud at the same time is not undone.
+*
+* Return:
+*  bool - true if the set temperature changed
+*
+*******************************************************************************/
+bool thermostatStepSetTemp(int step){
+	int setTemp;
+	bool changed;
+
+	writeBegin();
+	setTemp = thermostatState.setTemp + step;
+	if(setTemp < ACTUALTEMPMIN){
+		setTemp = ACTUALTEMPMIN;
+	}
+	else if(setTemp > ACTUALTEMPMAX){
+		setTemp = ACTUALTEMPMAX;
+	}
+	changed = (thermostatState.setTemp != setTemp);
+	thermostatState.setTemp = setTemp;
+	writeEnd();
+
+	return changed;
+}
+
+/*******************************************************************************
+* Function Name: thermostatUpdateMode
+********************************************************************************
+* Summary:
+*  Works the mode out from the actual and set temperatures of the same moment
+*  and stores it.
+*
+* Parameters:
+*  char **mode - the mode stored
+*
+* Return:
+*  bool - true if the mode changed
+*
+*******************************************************************************/
+bool thermostatUpdateMode(char **mode){
+	char *newMode;
+	bool changed;
+
+	writeBegin();
+	// Cooling
+	if(thermostatState.actualTemp > thermostatState.setTemp){
+		newMode = MODE_COOL;
+	}
+	// Heating
+	else if(thermostatState.actualTemp < thermostatState.setTemp){
+		newMode = MODE_HEAT;
+	}
+	// Idle
+	else{
+		newMode = MODE_IDLE;
+	}
+	changed = (thermostatState.mode != newMode);
+	thermostatState.mode = newMode;
+	writeEnd();
+
+	*mode = newMode;
+	return changed;
+}
+
+/*******************************************************************************
+* Function Name: thermostatSetConnected
+********************************************************************************
+* Summary:
+*  Stores whether the MQTT client is connected.
+*
+*******************************************************************************/
+void thermostatSetConnected(bool isConnected){
+	writeBegin();
+	thermostatState.isConnected = isConnected;
+	writeEnd();
+}
+
+/*******************************************************************************
+* Function Name: writeBegin
+********************************************************************************
+* Summary:
+*  Starts a write. The critical section keeps writers apart and keeps a
+*  reader from preempting a writer, so no reader spins on a write that
+*  cannot finish. Writes are a few loads and stores long.
+*
+*******************************************************************************/
+static void writeBegin(void){
+	taskENTER_CRITICAL();
+	thermostatSequence++;
+	__DMB();
+}
+
+/*******************************************************************************
+* Function Name: writeEnd
+********************************************************************************
+* Summary:
+*  Ends a write started with writeBegin.
+*
+*******************************************************************************/
+static void writeEnd(void){
+	__DMB();
+	thermostatSequence++;
+	taskEXIT_CRITICAL();
+}
+
+/* [] END OF FILE */
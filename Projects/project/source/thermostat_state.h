@@ -0,0 +1,48 @@
+/******************************************************************************
+* File Name:   thermostat_state.h
+*
+* Description: This file is the public interface of thermostat_state.c, the
+*              state of the thermostat shared by the tasks.
+*
+*              The state is one struct behind a sequence lock. A writer makes
+*              the sequence odd, changes the state and makes it even again,
+*              all in a critical section, so writers never overlap and a
+*              writer is never preempted half way. A reader copies the state
+*              and copies it again if the sequence was odd or moved while it
+*              copied. Readers never block and always get the four values
+*              from the same moment.
+*
+******************************************************************************/
+#ifndef THERMOSTAT_STATE_H_
+#define THERMOSTAT_STATE_H_
+
+// Middleware Headers
+#include "FreeRTOS.h"
+
+// Standard C header
+#include <stdbool.h>
+
+/*******************************************************************************
+* Types
+********************************************************************************/
+/* A snapshot of the thermostat. */
+typedef struct {
+	int actualTemp;
+	int setTemp;
+	char *mode;       // MODE_HEAT, MODE_COOL or MODE_IDLE
+	bool isConnected; // to the MQTT broker
+} thermostat_state_t;
+
+/*******************************************************************************
+* Function Prototypes
+********************************************************************************/
+void thermostatStateGet(thermostat_state_t *state);
+bool thermostatSetActualTemp(int actualTemp);
+bool thermostatSetSetTemp(int setTemp);
+bool thermostatStepSetTemp(int step);
+bool thermostatUpdateMode(char **mode);
+void thermostatSetConnected(bool isConnected);
+
+#endif /* THERMOSTAT_STATE_H_ */
+
+/* [] END OF FILE */